@@ -0,0 +1,351 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ */
+
+#include "autotuner.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "fifo.h"
+#include "oclenv.h"
+#include "oclptxhandler.h"
+#include "oclptxOptions.h"
+#include "particlegen.h"
+#include "threading.h"
+
+static const int kDefaultStepsPerKernel = 1000;
+static const int kDefaultReducers = 1;
+// Launches much shorter than this are dominated by host round trips.
+static const int kMinStepsPerKernel = 125;
+static const int kMaxReducers = 4;
+
+Autotuner::Autotuner(OclEnv *env, ParticleGenerator *particle_gen):
+  env_(env),
+  particle_gen_(particle_gen),
+  run_particles_(-1)
+{
+  null_fd_ = fopen("/dev/null", "w");
+}
+
+Autotuner::~Autotuner()
+{
+  if (null_fd_)
+    fclose(null_fd_);
+}
+
+TuneParams Autotuner::Defaults()
+{
+  oclptxOptions& opts = oclptxOptions::getInstance();
+  TuneParams p;
+
+  p.steps_per_kernel = kDefaultStepsPerKernel;
+  if (0 < opts.stepsperkernel.value())
+    p.steps_per_kernel = opts.stepsperkernel.value();
+  p.wg_size = 0;
+  p.max_wgs = 0;
+  p.num_reducers = kDefaultReducers;
+  if (0 < opts.reducers.value())
+    p.num_reducers = opts.reducers.value();
+
+  return p;
+}
+
+// Halves, then if that didn't help doubles, one setting while the rate
+// improves.  Settings that aren't a multiple of `multiple` are skipped.
+void Autotuner::Climb(
+    int device,
+    const struct PtxHandler::particle_attrs &attrs,
+    int TuneParams::*field,
+    int lo,
+    int hi,
+    int multiple,
+    TuneParams *p,
+    double *best,
+    int *num_wg)
+{
+  bool moved = false;
+  for (int up = 0; up < 2 && !moved; ++up)
+  {
+    while (1)
+    {
+      TuneParams t = *p;
+      t.*field = up ? 2 * (p->*field) : (p->*field) / 2;
+      if (t.*field < lo || t.*field > hi || 0 != t.*field % multiple)
+        break;
+
+      int trial_wg;
+      double rate = Trial(device, attrs, t, &trial_wg);
+      if (rate < kMinGain * *best)
+        break;
+
+      *p = t;
+      *best = rate;
+      *num_wg = trial_wg;
+      moved = true;
+    }
+  }
+}
+
+TuneParams Autotuner::Tune(
+    int device,
+    const struct PtxHandler::particle_attrs &attrs)
+{
+  oclptxOptions& opts = oclptxOptions::getInstance();
+  TuneParams p = Defaults();
+  int max_wg = env_->GetKernelWorkGroupInfo(device);
+  int wg_multiple = env_->GetWorkGroupMultiple(device);
+
+  bool fix_steps = 0 < opts.stepsperkernel.value();
+  bool fix_wg = 0 < opts.wgsize.value();
+  bool fix_particles = 0 < opts.particlesperside.value();
+  bool fix_reducers = 0 < opts.reducers.value();
+
+  p.wg_size = max_wg;
+  if (fix_wg)
+    p.wg_size = std::min(opts.wgsize.value(), max_wg);
+  p.max_wgs = env_->GetMaxWorkGroups(device);
+
+  const char *source = "defaults";
+  std::string mode = opts.autotune.value();
+  if ("off" != mode && "auto" != mode && "force" != mode)
+  {
+    printf("Unknown --autotune mode '%s', use auto, force or off.\n",
+      mode.c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  // Anything that changes how far particles get, or how much each step
+  // costs, goes into the key.
+  char extra[256];
+  const EnvironmentData *env_dat = env_->GetEnvData();
+  snprintf(extra, 256, "%i %i %u %u %u %u %#.9g %#.9g %u",
+    attrs.max_steps, attrs.min_steps, attrs.sample_nx, attrs.sample_ny,
+    attrs.sample_nz, attrs.num_samples, attrs.step_length,
+    attrs.curvature_threshold, env_dat->n_bricks);
+  std::string key = env_->ProfileKey(device, extra);
+
+  TuneParams stored;
+  bool all_fixed = fix_steps && fix_wg && fix_particles && fix_reducers;
+  if ("off" == mode || all_fixed)
+  {
+    if (all_fixed)
+      source = "command line";
+  }
+  else if ("force" != mode && LoadProfile(key, &stored))
+  {
+    if (!fix_steps)
+      p.steps_per_kernel = stored.steps_per_kernel;
+    if (!fix_wg)
+      p.wg_size = std::min(stored.wg_size, max_wg);
+    if (!fix_particles)
+      p.max_wgs = stored.max_wgs;
+    if (!fix_reducers)
+      p.num_reducers = stored.num_reducers;
+    source = "profile";
+  }
+  else
+  {
+    if (0 > run_particles_)
+      run_particles_ = particle_gen_->CountParticles();
+
+    // Sized from the memory plan, so a short run launches nothing.
+    struct PtxHandler::particle_attrs plan_attrs = attrs;
+    plan_attrs.steps_per_kernel = p.steps_per_kernel;
+    int plan_wgs = p.max_wgs;
+    if (fix_particles)
+      plan_wgs = std::max(1, opts.particlesperside.value() / p.wg_size);
+    plan_wgs = OclPtxHandler::PlanWorkGroups(plan_attrs,
+                                             env_dat,
+                                             *env_->GetMemPlan(device),
+                                             p.wg_size,
+                                             plan_wgs);
+
+    if (run_particles_ < kMinRunFills * 2 * plan_wgs * p.wg_size)
+    {
+      puts("Run too short to be worth calibrating, using defaults.");
+    }
+    else
+    {
+      printf("Calibrating device %i...\n", device);
+      int num_wg;
+      double best = Trial(device, attrs, p, &num_wg);
+
+      int max_steps = std::max(attrs.max_steps, kMinStepsPerKernel);
+      if (!fix_steps)
+        Climb(device, attrs, &TuneParams::steps_per_kernel,
+              kMinStepsPerKernel, max_steps, 1, &p, &best, &num_wg);
+      if (!fix_wg)
+        Climb(device, attrs, &TuneParams::wg_size,
+              wg_multiple, max_wg, wg_multiple, &p, &best, &num_wg);
+      if (!fix_particles)
+      {
+        // Fewer particles than fit can still win, by staying in cache or
+        // by shortening the tail of each fill.
+        int fill_wgs = p.max_wgs;
+        p.max_wgs = num_wg;
+        Climb(device, attrs, &TuneParams::max_wgs,
+              1, num_wg, 1, &p, &best, &num_wg);
+        if (p.max_wgs == num_wg)
+          p.max_wgs = fill_wgs;
+      }
+      if (!fix_reducers)
+        Climb(device, attrs, &TuneParams::num_reducers,
+              1, kMaxReducers, 1, &p, &best, &num_wg);
+
+      SaveProfile(key, p, best);
+      source = "calibrated";
+    }
+  }
+
+  if (fix_particles)
+    p.max_wgs = std::max(1, opts.particlesperside.value() / p.wg_size);
+
+  char particles[64] = "as many particles as fit";
+  if (0 < p.max_wgs)
+    snprintf(particles, 64, "at most %i particles",
+      p.max_wgs * p.wg_size);
+  printf("Device %i: %i steps per launch, work-groups of %i, %s per side, "
+         "%i reducer(s) (%s)\n",
+         device, p.steps_per_kernel, p.wg_size, particles, p.num_reducers,
+         source);
+
+  return p;
+}
+
+double Autotuner::Trial(
+    int device,
+    const struct PtxHandler::particle_attrs &attrs,
+    const TuneParams &p,
+    int *num_wg)
+{
+  oclptxOptions& opts = oclptxOptions::getInstance();
+  struct PtxHandler::particle_attrs trial_attrs = attrs;
+  trial_attrs.steps_per_kernel = p.steps_per_kernel;
+
+  int max_wgs = p.max_wgs;
+  if (0 < opts.particlesperside.value())
+    max_wgs = std::max(1, opts.particlesperside.value() / p.wg_size);
+
+  OclPtxHandler *handler = new OclPtxHandler;
+  if (1 < env_->GetEnvData()->n_bricks)
+    handler->SetBricks(env_, device);
+  handler->Init(env_->GetContext(),
+                env_->GetCq(device),
+                env_->GetKernel(device),
+                env_->GetSumKernel(device),
+                &trial_attrs,
+                null_fd_,
+                p.wg_size,
+                max_wgs,
+                env_->GetEnvData(),
+                env_->GetMemPlan(device),
+                env_->GetDevicePdf(device),
+                NULL,  // Trials leave the matrices, targets and path
+                NULL,  // lengths and directions alone.
+                NULL,
+                NULL);
+
+  int count = kTrialFills * 2 * handler->particles_per_side();
+  Fifo<struct PtxHandler::particle_data> *fifo = particle_gen_->Sample(count);
+
+  std::chrono::high_resolution_clock::time_point t_start =
+    std::chrono::high_resolution_clock::now();
+  threading::RunThreads(handler, fifo, p.num_reducers, NULL, device, NULL);
+  std::chrono::duration<double> delta_t =
+    std::chrono::high_resolution_clock::now() - t_start;
+
+  *num_wg = env_->GetMemPlan(device)->num_wg;
+  delete handler;
+  delete fifo;
+
+  // Counted once per direction internally, as in main.
+  double rate = count / 2 / delta_t.count();
+  printf("  %i steps, work-groups of %i, %i groups, %i reducer(s): "
+         "%.f particles/sec\n",
+         p.steps_per_kernel, p.wg_size, *num_wg, p.num_reducers, rate);
+  return rate;
+}
+
+std::string Autotuner::ProfilePath()
+{
+  std::string dir = env_->GetCacheDir();
+  if ("" == dir)
+    return "";
+  return dir + "/autotune.profile";
+}
+
+// One line per key: key steps_per_kernel wg_size max_wgs num_reducers rate
+bool Autotuner::LoadProfile(const std::string &key, TuneParams *p)
+{
+  std::string path = ProfilePath();
+  if ("" == path)
+    return false;
+
+  std::ifstream in(path.c_str());
+  std::string line;
+  while (std::getline(in, line))
+  {
+    std::istringstream fields(line);
+    std::string line_key;
+    TuneParams t;
+    fields >> line_key >> t.steps_per_kernel >> t.wg_size >> t.max_wgs
+           >> t.num_reducers;
+    if (fields && line_key == key && 0 < t.steps_per_kernel
+        && 0 < t.wg_size && 0 <= t.max_wgs && 0 < t.num_reducers)
+    {
+      *p = t;
+      return true;
+    }
+  }
+  return false;
+}
+
+void Autotuner::SaveProfile(
+    const std::string &key,
+    const TuneParams &p,
+    double rate)
+{
+  std::string path = ProfilePath();
+  if ("" == path)
+    return;
+
+  std::vector<std::string> lines;
+  std::ifstream in(path.c_str());
+  std::string line;
+  while (std::getline(in, line))
+    if (0 != line.compare(0, key.size() + 1, key + " "))
+      lines.push_back(line);
+  in.close();
+
+  char entry[256];
+  snprintf(entry, 256, "%s %i %i %i %i %.f", key.c_str(), p.steps_per_kernel,
+    p.wg_size, p.max_wgs, p.num_reducers, rate);
+  lines.push_back(entry);
+
+  // Write then rename, as for the kernel cache.
+  mkdir(env_->GetCacheDir().c_str(), 0755);
+  char suffix[32];
+  snprintf(suffix, 32, ".tmp%i", static_cast<int>(getpid()));
+  std::string tmp_path = path + suffix;
+
+  std::ofstream out(tmp_path.c_str());
+  for (size_t i = 0; i < lines.size(); ++i)
+    out << lines[i] << "\n";
+  out.close();
+
+  if (!out || 0 != rename(tmp_path.c_str(), path.c_str()))
+  {
+    printf("Warning: could not write tuning profile %s\n", path.c_str());
+    unlink(tmp_path.c_str());
+  }
+}
@@ -0,0 +1,85 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ *
+ * Picks per-device tracking settings: steps per kernel launch, work-group
+ * size, particles in flight and reducer threads.
+ *
+ * Settings given on the command line are used as they are.  The rest come
+ * from a profile kept next to the kernel cache, keyed by device, driver,
+ * kernel build options and dataset, or failing that from a short calibration
+ * run on that device.  Calibration tracks a few fills' worth of particles
+ * from random seeds through the normal pipeline and climbs one setting at a
+ * time towards higher particles/sec.
+ */
+
+#ifndef AUTOTUNER_H_
+#define AUTOTUNER_H_
+
+#include <stdio.h>
+
+#include <stdint.h>
+
+#include <string>
+
+#include "ptxhandler.h"
+
+class OclEnv;
+class ParticleGenerator;
+
+struct TuneParams
+{
+  int steps_per_kernel;
+  int wg_size;
+  int max_wgs;  // Upper bound on work-groups, or 0 to fill memory.
+  int num_reducers;
+};
+
+class Autotuner{
+ public:
+  Autotuner(OclEnv *env, ParticleGenerator *particle_gen);
+  ~Autotuner();
+
+  // Settings for one device.  attrs are the run's, steps_per_kernel aside.
+  TuneParams Tune(int device, const struct PtxHandler::particle_attrs &attrs);
+
+  // Settings used without OpenCL (--cpu): overrides, else the defaults.
+  static TuneParams Defaults();
+
+ private:
+  // Calibration needs at least this many fills' worth of particles in the
+  // run to pay for itself.
+  static const int kMinRunFills = 32;
+  // Fills of the device tracked per trial.
+  static const int kTrialFills = 2;
+  // Rates within this factor of each other are noise.
+  static constexpr double kMinGain = 1.03;
+
+  // Particles/sec with settings p.  Sets *num_wg to the work-groups used.
+  double Trial(
+      int device,
+      const struct PtxHandler::particle_attrs &attrs,
+      const TuneParams &p,
+      int *num_wg);
+  void Climb(
+      int device,
+      const struct PtxHandler::particle_attrs &attrs,
+      int TuneParams::*field,
+      int lo,
+      int hi,
+      int multiple,
+      TuneParams *p,
+      double *best,
+      int *num_wg);
+  bool LoadProfile(const std::string &key, TuneParams *p);
+  void SaveProfile(const std::string &key, const TuneParams &p, double rate);
+  std::string ProfilePath();
+
+  OclEnv *env_;
+  ParticleGenerator *particle_gen_;
+  FILE *null_fd_;  // Where calibration paths go with --savepaths
+  int64_t run_particles_;
+};
+
+#endif  // AUTOTUNER_H_
@@ -0,0 +1,52 @@
+// Copyright 2014 Jeff Taylor
+// Test case for the local rules packed into the brain mask.
+
+#include "customtypes.h"
+
+#include<cassert>
+#include<cmath>
+#include<cstdio>
+
+int main()
+{
+  // The ends and the middle come back exactly.
+  assert(1 == CurvatureLevel(-1.f));
+  assert(128 == CurvatureLevel(0.f));
+  assert(255 == CurvatureLevel(1.f));
+  assert(-1.f == CurvatureThreshold(1));
+  assert(0.f == CurvatureThreshold(128));
+  assert(1.f == CurvatureThreshold(255));
+
+  // Out of range thresholds clamp.
+  assert(1 == CurvatureLevel(-5.f));
+  assert(255 == CurvatureLevel(2.f));
+
+  puts("Ends");
+
+  // Anything else is within half a step, 1/254.
+  for (int i = -1000; i <= 1000; i++)
+  {
+    float threshold = i / 1000.f;
+    int level = CurvatureLevel(threshold);
+    assert(1 <= level && level <= 255);
+    assert(fabs(CurvatureThreshold(level) - threshold) <= 1 / 254.f + 1e-6);
+  }
+
+  puts("Round trip");
+
+  // A voxel carries the brain bit, the fibre choice and the level without
+  // them overlapping, as the kernel unpacks them.
+  for (int choice = 0; choice <= 2; choice++)
+    for (int level = 0; level <= 255; level++)
+    {
+      unsigned short voxel = 1 | choice << kVoxelFibreShift
+                               | level << kVoxelCurvShift;
+      assert(1 == (voxel & 1));
+      assert(choice == ((voxel >> kVoxelFibreShift) & 3));
+      assert(level == voxel >> kVoxelCurvShift);
+    }
+
+  puts("Packed");
+
+  return 0;
+}
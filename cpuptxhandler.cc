@@ -0,0 +1,925 @@
+/*  Copyright (C) 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ */
+
+#include "cpuptxhandler.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+
+// The object is built for a portable baseline.  The tracking loop is also
+// built for AVX2 and AVX-512, and Init() picks what the CPU supports.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CPU_DISPATCH 1
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#else
+#define CPU_DISPATCH 0
+#define TARGET_AVX2
+#define TARGET_AVX512
+#endif
+
+// Completion codes, from oclkernels/attrs.h
+static const int kBreakBrainMask = 1;
+static const int kBreakCurv = 2;
+static const int kBreakLoopcheck = 3;
+static const int kBreakInvalid = 4;
+static const int kBreakTerminate = 5;
+static const int kBreakExclusion = 6;
+static const int kBreakMaxSteps = 7;
+static const int kBreakInit = 8;
+static const int kStillFinished = 9;
+static const int kAnisoBreak = 10;
+static const int kBreakWayorder = 11;
+
+static const float kRandMax = 18446744073709551616.f;
+
+// Particles stepped together.  One AVX-512 register of floats, two of AVX
+// and four of SSE, so every build and instruction set uses the same chunks.
+static const int kLanes = 16;
+
+// Chunks of kLanes particles per thread per side.  Enough to let the stealing
+// even out particles that finish early, while keeping per-slot memory (the
+// loopcheck grid especially) modest.
+static const int kChunksPerThread = 8;
+
+typedef uint64_t LaneRng[5][kLanes];
+
+template <typename T>
+static T *AllocLanes(size_t count)
+{
+  void *mem = NULL;
+  if (0 == count)
+    return NULL;
+  if (posix_memalign(&mem, 64, count * sizeof(T)))
+  {
+    puts("Ran out of host memory while allocating particle buffers.");
+    exit(-1);
+  }
+  memset(mem, 0, count * sizeof(T));
+  return reinterpret_cast<T*>(mem);
+}
+
+// Rand() from rng.h, on lane l.
+template <bool kUsePrng>
+static inline uint64_t LaneRand(LaneRng z, int l)
+{
+  uint64_t b;
+  if (!kUsePrng)
+    return 0;
+
+  b = (((z[0][l] << 1) ^ z[0][l]) >> 53);
+  z[0][l] = (((z[0][l] & 18446744073709551614UL) << 10) ^ b);
+
+  b = (((z[1][l] << 24) ^ z[1][l]) >> 50);
+  z[1][l] = (((z[1][l] & 18446744073709551104UL) << 5) ^ b);
+
+  b = (((z[2][l] << 3) ^ z[2][l]) >> 23);
+  z[2][l] = (((z[2][l] & 18446744073709547520UL) << 29) ^ b);
+
+  b = (((z[3][l] << 5) ^ z[3][l]) >> 24);
+  z[3][l] = (((z[3][l] & 18446744073709420544UL) << 23) ^ b);
+
+  b = (((z[4][l] << 3) ^ z[4][l]) >> 33);
+  z[4][l] = (((z[4][l] & 18446744073701163008UL) << 8) ^ b);
+
+  return z[0][l] ^ z[1][l] ^ z[2][l] ^ z[3][l] ^ z[4][l];
+}
+
+// Unlike the GPU, reading outside the volume here would crash, so positions
+// are clamped to the last vertex before indexing.
+static inline uint32_t ClampVertex(uint32_t v, uint32_t n)
+{
+  return (v < n) ? v : n - 1;
+}
+
+static inline float ClampPosition(float p, uint32_t n)
+{
+  return fminf(fmaxf(p, 0.f), n - 1.f);
+}
+
+// pick_fibre() from interpolate.cl.  fibres points at n_fibers (x, y, z, f).
+// randfib only draws the first fibre, later steps take the closest.
+template <bool kUsePrng>
+static inline const float *PickFibre(
+  const float *fibres,
+  uint32_t n_fibers,
+  const PtxHandler::particle_attrs &attrs,
+  float last_x, float last_y, float last_z,
+  bool first_step,
+  LaneRng rng, int l)
+{
+  const float *picked = fibres;
+
+  if (0 == attrs.randfib || !first_step)
+  {
+    float best = 0.f;
+    for (uint32_t i = 0; i < n_fibers; ++i)
+    {
+      const float *fib = fibres + 4 * i;
+      float closeness =
+        fabsf(fib[0] * last_x + fib[1] * last_y + fib[2] * last_z);
+      if (fib[3] > attrs.fibthresh && closeness > best)
+      {
+        best = closeness;
+        picked = fib;
+      }
+    }
+    if (first_step && static_cast<uint32_t>(attrs.fibst) < n_fibers)
+      picked = fibres + 4 * attrs.fibst;
+    return picked;
+  }
+
+  float weight[kMaxFibers];
+  float total = 0.f;
+  for (uint32_t i = 0; i < n_fibers; ++i)
+  {
+    float fib_f = fibres[4 * i + 3];
+    bool eligible = 3 == attrs.randfib || fib_f > attrs.fibthresh;
+    weight[i] = eligible ? (2 == attrs.randfib ? fib_f : 1.f) : 0.f;
+    total += weight[i];
+  }
+
+  float r = total * fminf(LaneRand<kUsePrng>(rng, l) / kRandMax,
+                          0.99999994f);
+  float sum = 0.f;
+  for (uint32_t i = 0; i < n_fibers; ++i)
+  {
+    sum += weight[i];
+    if (r < sum)
+      return fibres + 4 * i;
+  }
+  return picked;
+}
+
+// get_direction() from interpolate.cl, followed by the alignment and scaling
+// the main loop applies to the result.
+template <bool kUsePrng>
+static inline void StepDirection(
+  const HostSamples &samples,
+  const PtxHandler::particle_attrs &attrs,
+  float x, float y, float z,
+  float last_x, float last_y, float last_z,
+  bool first_step,
+  LaneRng rng, int l,
+  float *dx, float *dy, float *dz, float *f)
+{
+  const uint32_t nx = attrs.sample_nx;
+  const uint32_t ny = attrs.sample_ny;
+  const uint32_t nz = attrs.sample_nz;
+
+  x = ClampPosition(x, nx);
+  y = ClampPosition(y, ny);
+  z = ClampPosition(z, nz);
+
+  uint32_t vx = static_cast<uint32_t>(x);
+  uint32_t vy = static_cast<uint32_t>(y);
+  uint32_t vz = static_cast<uint32_t>(z);
+  float frac_x = (x - vx) * kRandMax;
+  float frac_y = (y - vy) * kRandMax;
+  float frac_z = (z - vz) * kRandMax;
+
+  // Pick Sample
+  uint32_t sample = LaneRand<kUsePrng>(rng, l) % attrs.num_samples;
+
+  // Volume Fraction Selection
+  uint64_t r0 = LaneRand<kUsePrng>(rng, l);
+  uint64_t r1 = LaneRand<kUsePrng>(rng, l);
+  uint64_t r2 = LaneRand<kUsePrng>(rng, l);
+  vx = ClampVertex(vx + ((static_cast<float>(r0) > frac_x)? 1: 0), nx);
+  vy = ClampVertex(vy + ((static_cast<float>(r1) > frac_y)? 1: 0), ny);
+  vz = ClampVertex(vz + ((static_cast<float>(r2) > frac_z)? 1: 0), nz);
+
+  size_t index = static_cast<size_t>(sample) * nx * ny * nz
+               + vx * ny * nz + vy * nz + vz;
+
+  const float *fibre = samples.directions + 4 * samples.n_fibers * index;
+  if (1 < samples.n_fibers)
+    fibre = PickFibre<kUsePrng>(fibre, samples.n_fibers, attrs,
+                                last_x, last_y, last_z, first_step, rng, l);
+
+  float ux = fibre[0];
+  float uy = fibre[1];
+  float uz = fibre[2];
+  *f = fibre[3];
+
+  // Align direction to keep angle under 90 degrees
+  if (ux * last_x + uy * last_y + uz * last_z < 0.f)
+  {
+    ux = -ux;
+    uy = -uy;
+    uz = -uz;
+  }
+
+  *dx = ux / attrs.brain_mask_dim.s[0] * attrs.step_length;
+  *dy = uy / attrs.brain_mask_dim.s[1] * attrs.step_length;
+  *dz = uz / attrs.brain_mask_dim.s[2] * attrs.step_length;
+}
+
+// do_particle_finish() from interpolate.cl.
+void CpuPtxHandler::FinishParticle(int slot)
+{
+  int done = complete_[slot];
+
+  if (steps_[slot] < attrs_.min_steps)
+    return;
+
+  if (exclusion_ && exclusion_[slot])
+    return;
+
+  if (waypoints_ && env_dat_->way_order)
+  {
+    // waypoints[0] is the next waypoint expected.
+    if (waypoints_[slot * attrs_.n_waypoint_masks]
+        != attrs_.n_waypoint_masks)
+      return;
+  }
+  else if (waypoints_)
+  {
+    // All waypoints for AND, any for OR.
+    int waypoint_check = env_dat_->way_and ? 1 : 0;
+    uint16_t *waypoints = waypoints_ + slot * attrs_.n_waypoint_masks;
+    for (cl_uint w = 0; w < attrs_.n_waypoint_masks; ++w)
+    {
+      if (env_dat_->way_and)
+        waypoint_check &= waypoints[w];
+      else
+        waypoint_check |= waypoints[w];
+    }
+    if (0 == waypoint_check)
+      return;
+  }
+
+  if (done
+   && kBreakInvalid != done
+   && kBreakInit != done
+   && kStillFinished != done)
+  {
+    std::vector<uint32_t> *visited = &visited_[slot];
+    std::sort(visited->begin(), visited->end());
+    std::vector<uint32_t>::iterator end =
+      std::unique(visited->begin(), visited->end());
+
+    for (std::vector<uint32_t>::iterator it = visited->begin();
+         it != end; ++it)
+      __sync_fetch_and_add(&global_pdf_[*it], 1);
+  }
+}
+
+// Always inlined, so TrackLanesAvx2 and TrackLanesAvx512 compile the whole
+// loop for their instruction set.
+template <unsigned kFeatures>
+inline __attribute__((always_inline))
+void CpuPtxHandler::TrackLanes(int first_slot)
+{
+  const bool use_prng = kFeatures & kPrng;
+  const bool use_aniso = kFeatures & kAniso;
+  const bool use_euler = kFeatures & kEuler;
+  const bool use_loopcheck = kFeatures & kLoopcheck;
+  const bool use_masks = kFeatures & kMasks;
+
+  const uint32_t nx = attrs_.sample_nx;
+  const uint32_t ny = attrs_.sample_ny;
+  const uint32_t nz = attrs_.sample_nz;
+  const size_t loopcheck_cells = attrs_.lx * attrs_.ly * attrs_.lz;
+
+  // Lane-local copies of the slot state.
+  float px[kLanes], py[kLanes], pz[kLanes];
+  float dx[kLanes], dy[kLanes], dz[kLanes];
+  LaneRng rng;
+  int steps[kLanes];
+  int done[kLanes];
+  int started[kLanes];
+  int active[kLanes];
+  int exit_step[kLanes];
+
+  // Per step scratch.
+  float new_dx[kLanes], new_dy[kLanes], new_dz[kLanes];
+  float tx[kLanes], ty[kLanes], tz[kLanes];
+  float f[kLanes];
+  int code[kLanes];
+
+  int num_active = 0;
+  for (int l = 0; l < kLanes; ++l)
+  {
+    int slot = first_slot + l;
+    px[l] = pos_[0][slot];
+    py[l] = pos_[1][slot];
+    pz[l] = pos_[2][slot];
+    dx[l] = dr_[0][slot];
+    dy[l] = dr_[1][slot];
+    dz[l] = dr_[2][slot];
+    for (int i = 0; i < 5; ++i)
+      rng[i][l] = rng_[i][slot];
+    steps[l] = steps_[slot];
+    done[l] = complete_[slot];
+    exit_step[l] = attrs_.steps_per_kernel;
+
+    started[l] = (0 == done[l]);
+    active[l] = started[l];
+    num_active += active[l];
+  }
+
+  // Main loop.  Finished lanes keep computing alongside the others, so every
+  // vector step is full width, but their results are never committed.
+  int step;
+  for (step = 0; step < attrs_.steps_per_kernel && 0 < num_active; ++step)
+  {
+#pragma omp simd
+    for (int l = 0; l < kLanes; ++l)
+      StepDirection<use_prng>(
+        samples_, attrs_,
+        px[l], py[l], pz[l], dx[l], dy[l], dz[l],
+        0 == steps[l],
+        rng, l,
+        &new_dx[l], &new_dy[l], &new_dz[l], &f[l]);
+
+    if (use_aniso)
+    {
+      for (int l = 0; l < kLanes; ++l)
+      {
+        float r = static_cast<float>(LaneRand<use_prng>(rng, l));
+        if (active[l] && f[l] * kRandMax < r)
+        {
+          done[l] = kAnisoBreak;
+          active[l] = 0;
+          exit_step[l] = step;
+          --num_active;
+        }
+      }
+    }
+
+    if (use_euler)
+    {
+#pragma omp simd
+      for (int l = 0; l < kLanes; ++l)
+      {
+        float dx2, dy2, dz2;
+        StepDirection<use_prng>(
+          samples_, attrs_,
+          px[l] + new_dx[l], py[l] + new_dy[l], pz[l] + new_dz[l],
+          dx[l], dy[l], dz[l],
+          0 == steps[l],
+          rng, l,
+          &dx2, &dy2, &dz2, &f[l]);
+        new_dx[l] = 0.5f * (new_dx[l] + dx2);
+        new_dy[l] = 0.5f * (new_dy[l] + dy2);
+        new_dz[l] = 0.5f * (new_dz[l] + dz2);
+      }
+
+      if (use_aniso)
+      {
+        for (int l = 0; l < kLanes; ++l)
+        {
+          float r = static_cast<float>(LaneRand<use_prng>(rng, l));
+          if (active[l] && f[l] * kRandMax < r)
+          {
+            done[l] = kAnisoBreak;
+            active[l] = 0;
+            exit_step[l] = step;
+            --num_active;
+          }
+        }
+      }
+    }
+
+    // Curvature threshold and bounds.
+#pragma omp simd
+    for (int l = 0; l < kLanes; ++l)
+    {
+      tx[l] = px[l] + new_dx[l];
+      ty[l] = py[l] + new_dy[l];
+      tz[l] = pz[l] + new_dz[l];
+
+      float norm = sqrtf(new_dx[l] * new_dx[l]
+                       + new_dy[l] * new_dy[l]
+                       + new_dz[l] * new_dz[l]);
+      new_dx[l] /= norm;
+      new_dy[l] /= norm;
+      new_dz[l] /= norm;
+
+      float curvature = new_dx[l] * dx[l] + new_dy[l] * dy[l]
+                      + new_dz[l] * dz[l];
+      int out_of_bounds = (tx[l] > nx) | (ty[l] > ny) | (tz[l] > nz)
+                        | (0.f > tx[l]) | (0.f > ty[l]) | (0.f > tz[l]);
+
+      code[l] = 0;
+      if (steps[l] > 1 && curvature < attrs_.curvature_threshold)
+        code[l] = kBreakCurv;
+      else if (out_of_bounds)
+        code[l] = kBreakInvalid;
+    }
+
+    // Mask tests and bookkeeping, lane by lane.
+    for (int l = 0; l < kLanes; ++l)
+    {
+      if (!active[l])
+        continue;
+
+      int slot = first_slot + l;
+      size_t mask_index = 0;
+
+      if (!code[l])
+      {
+        // Brain Mask Test - Checks NEAREST vertex.
+        mask_index =
+          ClampVertex(static_cast<uint32_t>(roundf(tx[l])), nx) * ny * nz
+        + ClampVertex(static_cast<uint32_t>(roundf(ty[l])), ny) * nz
+        + ClampVertex(static_cast<uint32_t>(roundf(tz[l])), nz);
+
+        if (0 == samples_.brain_mask[mask_index])
+          code[l] = kBreakBrainMask;
+      }
+
+      if (use_masks && !code[l])
+      {
+        if (samples_.termination_mask
+            && 1 == samples_.termination_mask[mask_index])
+        {
+          code[l] = kBreakTerminate;
+        }
+        else if (samples_.exclusion_mask
+            && 1 == samples_.exclusion_mask[mask_index])
+        {
+          exclusion_[slot] = 1;
+          code[l] = kBreakExclusion;
+        }
+        else if (waypoints_)
+        {
+          uint16_t *waypoints = waypoints_ + slot * attrs_.n_waypoint_masks;
+          for (cl_uint w = 0; w < attrs_.n_waypoint_masks; ++w)
+          {
+            if (0 == samples_.waypoint_masks->at(w)[mask_index])
+              continue;
+            // As in the kernel, with --wayorder waypoints[0] is the next
+            // waypoint expected, and one further on stops the particle.
+            if (!env_dat_->way_order)
+              waypoints[w] |= 1;
+            else if (w == waypoints[0])
+              waypoints[0]++;
+            else if (w > waypoints[0])
+              code[l] = kBreakWayorder;
+          }
+        }
+      }
+
+      if (use_loopcheck && !code[l])
+      {
+        uint32_t cx = ClampVertex(
+          static_cast<uint32_t>(roundf(tx[l]) / 5), attrs_.lx);
+        uint32_t cy = ClampVertex(
+          static_cast<uint32_t>(roundf(ty[l]) / 5), attrs_.ly);
+        uint32_t cz = ClampVertex(
+          static_cast<uint32_t>(roundf(tz[l]) / 5), attrs_.lz);
+        float *last_dr = loopcheck_ + 3 * (slot * loopcheck_cells
+                                         + cx * attrs_.ly * attrs_.lz
+                                         + cy * attrs_.lz + cz);
+
+        if (last_dr[0] * new_dx[l] + last_dr[1] * new_dy[l]
+            + last_dr[2] * new_dz[l] < 0.f)
+        {
+          code[l] = kBreakLoopcheck;
+        }
+        else
+        {
+          last_dr[0] = new_dx[l];
+          last_dr[1] = new_dy[l];
+          last_dr[2] = new_dz[l];
+        }
+      }
+
+      if (code[l])
+      {
+        if (kBreakExclusion == code[l] || kBreakWayorder == code[l])
+        {
+          rejects_++;
+          reject_steps_ += attrs_.max_steps - 1 - steps[l];
+        }
+        done[l] = code[l];
+        active[l] = 0;
+        exit_step[l] = step;
+        --num_active;
+        continue;
+      }
+
+      // update step location and last flow vector
+      px[l] = tx[l];
+      py[l] = ty[l];
+      pz[l] = tz[l];
+      dx[l] = new_dx[l];
+      dy[l] = new_dy[l];
+      dz[l] = new_dz[l];
+
+      if (path_)
+      {
+        float *path = path_ + 4 * (slot * attrs_.steps_per_kernel + step);
+        path[0] = tx[l];
+        path[1] = ty[l];
+        path[2] = tz[l];
+        path[3] = 0.f;
+      }
+
+      // Add position to position list.  The kernel keeps a set; we keep a
+      // list and deduplicate once the particle finishes.
+      uint32_t index =
+          ClampVertex(static_cast<uint32_t>(tx[l]), nx) * ny * nz
+        + ClampVertex(static_cast<uint32_t>(ty[l]), ny) * nz
+        + ClampVertex(static_cast<uint32_t>(tz[l]), nz);
+      if (visited_[slot].empty() || visited_[slot].back() != index)
+        visited_[slot].push_back(index);
+
+      if (steps[l] + 1 == attrs_.max_steps)
+      {
+        done[l] = kBreakMaxSteps;
+        active[l] = 0;
+        exit_step[l] = step;
+        --num_active;
+        continue;
+      }
+
+      steps[l] += 1;
+    }
+  }
+
+  for (int l = 0; l < kLanes; ++l)
+  {
+    int slot = first_slot + l;
+
+    // No new valid data.  Likely the host is out of data.  Signal that.
+    if (!started[l])
+    {
+      complete_[slot] = kStillFinished;
+      steps_[slot] = 0;
+      continue;
+    }
+
+    // If the host is reading path data, no new data has been added.  We need
+    // to signal that.
+    if (0 == exit_step[l])
+      steps[l] = 0;
+
+    pos_[0][slot] = px[l];
+    pos_[1][slot] = py[l];
+    pos_[2][slot] = pz[l];
+    dr_[0][slot] = dx[l];
+    dr_[1][slot] = dy[l];
+    dr_[2][slot] = dz[l];
+    for (int i = 0; i < 5; ++i)
+      rng_[i][slot] = rng[i][l];
+    steps_[slot] = steps[l];
+    complete_[slot] = done[l];
+
+    FinishParticle(slot);
+  }
+}
+
+template <unsigned kFeatures>
+TARGET_AVX2 void CpuPtxHandler::TrackLanesAvx2(int first_slot)
+{
+  TrackLanes<kFeatures>(first_slot);
+}
+
+template <unsigned kFeatures>
+TARGET_AVX512 void CpuPtxHandler::TrackLanesAvx512(int first_slot)
+{
+  TrackLanes<kFeatures>(first_slot);
+}
+
+CpuPtxHandler::Isa CpuPtxHandler::DetectIsa()
+{
+#if CPU_DISPATCH
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+    return kIsaAvx512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return kIsaAvx2;
+#endif
+  return kIsaBase;
+}
+
+// Map a runtime feature set and instruction set onto a TrackLanes
+// instantiation.
+template <unsigned kFeatures>
+CpuPtxHandler::TrackFn CpuPtxHandler::SelectTracker(unsigned features, Isa isa)
+{
+  if (kFeatures != features)
+    return SelectTracker<kFeatures - 1>(features, isa);
+  if (kIsaAvx512 == isa)
+    return &CpuPtxHandler::TrackLanesAvx512<kFeatures>;
+  if (kIsaAvx2 == isa)
+    return &CpuPtxHandler::TrackLanesAvx2<kFeatures>;
+  return &CpuPtxHandler::TrackLanes<kFeatures>;
+}
+
+template <>
+CpuPtxHandler::TrackFn CpuPtxHandler::SelectTracker<0>(unsigned features,
+                                                       Isa isa)
+{
+  if (kIsaAvx512 == isa)
+    return &CpuPtxHandler::TrackLanesAvx512<0>;
+  if (kIsaAvx2 == isa)
+    return &CpuPtxHandler::TrackLanesAvx2<0>;
+  return &CpuPtxHandler::TrackLanes<0>;
+}
+
+CpuPtxHandler::CpuPtxHandler():
+  global_pdf_(NULL),
+  steps_(NULL),
+  complete_(NULL),
+  exclusion_(NULL),
+  waypoints_(NULL),
+  loopcheck_(NULL),
+  path_(NULL),
+  visited_(NULL),
+  num_threads_(0),
+  queues_(NULL),
+  generation_(0),
+  running_(0),
+  quit_(false),
+  side_(0)
+{
+  for (int i = 0; i < 3; ++i)
+  {
+    pos_[i] = NULL;
+    dr_[i] = NULL;
+  }
+  for (int i = 0; i < 5; ++i)
+    rng_[i] = NULL;
+}
+
+void CpuPtxHandler::Init(
+  struct particle_attrs *attrs,
+  FILE *path_dump_fd,
+  EnvironmentData *env_dat,
+  const HostSamples &samples,
+  uint32_t *global_pdf,
+  int num_threads)
+{
+  attrs_ = *attrs;
+  path_dump_fd_ = path_dump_fd;
+  env_dat_ = env_dat;
+  samples_ = samples;
+  global_pdf_ = global_pdf;
+  first_time_ = 1;
+  launches_ = 0;
+  rejects_ = 0;
+  reject_steps_ = 0;
+
+  num_threads_ = num_threads;
+  if (num_threads_ <= 0)
+    num_threads_ = std::thread::hardware_concurrency();
+  if (num_threads_ <= 0)
+    num_threads_ = 1;
+
+  // num_wg counts chunks here.
+  attrs_.num_wg = num_threads_ * kChunksPerThread;
+  attrs_.particles_per_side = attrs_.num_wg * kLanes;
+  printf("Allocating %i particles in %i chunks of %i lanes on %i threads.\n",
+      attrs_.particles_per_side, attrs_.num_wg, kLanes, num_threads_);
+
+  size_t slots = 2 * attrs_.particles_per_side;
+  size_t loopcheck_cells = attrs_.lx * attrs_.ly * attrs_.lz;
+
+  for (int i = 0; i < 3; ++i)
+  {
+    pos_[i] = AllocLanes<float>(slots);
+    dr_[i] = AllocLanes<float>(slots);
+  }
+  for (int i = 0; i < 5; ++i)
+    rng_[i] = AllocLanes<uint64_t>(slots);
+  steps_ = AllocLanes<uint16_t>(slots);
+  complete_ = AllocLanes<uint16_t>(slots);
+  if (env_dat_->exclusion_mask)
+    exclusion_ = AllocLanes<uint16_t>(slots);
+  if (0 < env_dat_->n_waypts)
+    waypoints_ = AllocLanes<uint16_t>(slots * attrs_.n_waypoint_masks);
+  if (env_dat_->loopcheck)
+    loopcheck_ = AllocLanes<float>(slots * 3 * loopcheck_cells);
+  if (env_dat_->save_paths)
+    path_ = AllocLanes<float>(slots * 4 * attrs_.steps_per_kernel);
+  visited_ = new std::vector<uint32_t>[slots];
+
+  for (size_t i = 0; i < slots; ++i)
+    complete_[i] = kBreakInit;
+
+  unsigned features = 0;
+  if (!env_dat_->deterministic)
+    features |= kPrng;
+  if (env_dat_->aniso_const)
+    features |= kAniso;
+  if (env_dat_->euler_streamline)
+    features |= kEuler;
+  if (env_dat_->loopcheck)
+    features |= kLoopcheck;
+  if (samples_.exclusion_mask || samples_.termination_mask || waypoints_)
+    features |= kMasks;
+  Isa isa = DetectIsa();
+  track_ = SelectTracker<kNumFeatureSets - 1>(features, isa);
+  printf("CPU tracking built for %s.\n",
+      kIsaAvx512 == isa ? "AVX-512" : kIsaAvx2 == isa ? "AVX2" : "baseline");
+
+  // Split each side's chunks evenly between threads.
+  queues_ = new ChunkQueue[num_threads_];
+  int begin = 0;
+  for (int t = 0; t < num_threads_; ++t)
+  {
+    int count = attrs_.num_wg / num_threads_
+              + ((t < attrs_.num_wg % num_threads_)? 1: 0);
+    queues_[t].begin = begin;
+    queues_[t].end = begin + count;
+    queues_[t].next = queues_[t].end;
+    begin += count;
+  }
+
+  for (int t = 0; t < num_threads_; ++t)
+    threads_.push_back(new std::thread(&CpuPtxHandler::WorkerThread, this, t));
+}
+
+CpuPtxHandler::~CpuPtxHandler()
+{
+  std::unique_lock<std::mutex> lk(pool_lock_);
+  quit_ = true;
+  start_cv_.notify_all();
+  lk.unlock();
+
+  for (size_t t = 0; t < threads_.size(); ++t)
+  {
+    threads_[t]->join();
+    delete threads_[t];
+  }
+  delete[] queues_;
+
+  for (int i = 0; i < 3; ++i)
+  {
+    free(pos_[i]);
+    free(dr_[i]);
+  }
+  for (int i = 0; i < 5; ++i)
+    free(rng_[i]);
+  free(steps_);
+  free(complete_);
+  free(exclusion_);
+  free(waypoints_);
+  free(loopcheck_);
+  free(path_);
+  delete[] visited_;
+}
+
+int CpuPtxHandler::particles_per_side()
+{
+  return attrs_.particles_per_side;
+}
+
+int CpuPtxHandler::launches()
+{
+  return launches_;
+}
+
+void CpuPtxHandler::PrintRejects()
+{
+  if (0 < rejects_)
+    printf("Stopped %li rejected particles early, saving at most %li steps "
+        "(an upper bound, from the steps left before --nsteps).\n",
+        static_cast<int64_t>(rejects_), static_cast<int64_t>(reject_steps_));
+}
+
+void CpuPtxHandler::WriteParticle(
+    struct particle_data *data,
+    int offset)
+{
+  assert(offset < 2 * attrs_.particles_per_side);
+
+  if (env_dat_->save_paths)
+    fprintf(path_dump_fd_, "%i:%f,%f,%fn\n",
+        offset,
+        data->position.s[0],
+        data->position.s[1],
+        data->position.s[2]);
+
+  for (int i = 0; i < 3; ++i)
+  {
+    pos_[i][offset] = data->position.s[i];
+    dr_[i][offset] = data->dr.s[i];
+  }
+  for (int i = 0; i < 5; ++i)
+    rng_[i][offset] = data->rng.s[i];
+
+  complete_[offset] = 0;
+  steps_[offset] = 0;
+  visited_[offset].clear();
+
+  if (loopcheck_)
+  {
+    size_t cells = attrs_.lx * attrs_.ly * attrs_.lz;
+    memset(loopcheck_ + offset * 3 * cells, 0, 3 * cells * sizeof(float));
+  }
+
+  if (waypoints_)
+    memset(waypoints_ + offset * attrs_.n_waypoint_masks, 0,
+           attrs_.n_waypoint_masks * sizeof(uint16_t));
+
+  if (exclusion_)
+    exclusion_[offset] = 0;
+}
+
+void CpuPtxHandler::WorkerThread(int id)
+{
+  int64_t seen_generation = 0;
+
+  while (1)
+  {
+    std::unique_lock<std::mutex> lk(pool_lock_);
+    while (!quit_ && generation_ == seen_generation)
+      start_cv_.wait(lk);
+    if (quit_)
+      return;
+    seen_generation = generation_;
+    lk.unlock();
+
+    RunChunks(id);
+
+    lk.lock();
+    if (0 == --running_)
+      finish_cv_.notify_one();
+  }
+}
+
+void CpuPtxHandler::RunChunks(int id)
+{
+  int first_slot = side_ * attrs_.particles_per_side;
+  int chunk;
+
+  // Own queue first, then steal from the others in turn.
+  for (int i = 0; i < num_threads_; ++i)
+  {
+    ChunkQueue *queue = &queues_[(id + i) % num_threads_];
+    while ((chunk = queue->next.fetch_add(1)) < queue->end)
+      (this->*track_)(first_slot + chunk * kLanes);
+  }
+}
+
+void CpuPtxHandler::RunKernel(int side)
+{
+  std::unique_lock<std::mutex> lk(pool_lock_);
+
+  side_ = side;
+  for (int t = 0; t < num_threads_; ++t)
+    queues_[t].next = queues_[t].begin;
+  running_ = num_threads_;
+  ++generation_;
+  start_cv_.notify_all();
+
+  while (0 < running_)
+    finish_cv_.wait(lk);
+
+  launches_++;
+}
+
+void CpuPtxHandler::RunSumKernel()
+{
+}
+
+void CpuPtxHandler::ReadStatus(int offset, int count, cl_ushort *ret)
+{
+  memcpy(ret, complete_ + offset, count * sizeof(cl_ushort));
+}
+
+void CpuPtxHandler::DumpPath(int offset, int count)
+{
+  if (!env_dat_->save_paths)
+    return;
+
+  assert(NULL != path_dump_fd_);
+
+  // See OclPtxHandler::DumpPath: the first call only sees garbage.
+  if (first_time_)
+  {
+    first_time_ = 0;
+    return;
+  }
+
+  for (int id = 0; id < count; ++id)
+  {
+    int slot = id + offset;
+    int step_count = steps_[slot];
+    for (int step = 0; step < attrs_.steps_per_kernel; ++step)
+    {
+      float *value = path_ + 4 * (slot * attrs_.steps_per_kernel + step);
+      // Only dump if this element is before the path's end.
+      if ((0 == step_count % attrs_.steps_per_kernel && 0 != step_count)
+        || step < step_count % attrs_.steps_per_kernel)
+        fprintf(path_dump_fd_, "%i:%f,%f,%f\n",
+            slot,
+            value[0],
+            value[1],
+            value[2]);
+    }
+  }
+}
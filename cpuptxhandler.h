@@ -0,0 +1,147 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ *
+ * Tracks particles on the host CPUs, for machines with many cores and no GPU.
+ * Slots, sides and completion codes work exactly as in OclPtxHandler, and the
+ * step loop is that of interpolate.cl, run a chunk of particles at a time.
+ * It needs no OpenCL platform or device, though the binary still links the
+ * OpenCL loader for the GPU engine.
+ */
+
+#ifndef CPUPTXHANDLER_H_
+#define CPUPTXHANDLER_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "customtypes.h"
+#include "ptxhandler.h"
+
+// Host copies of what the kernel reads from global memory.
+struct HostSamples
+{
+  const float *directions;  // OclEnv::GetPackedSamples()
+  uint32_t n_fibers;
+  const unsigned short *brain_mask;
+  const unsigned short *exclusion_mask;  // NULL if unused
+  const unsigned short *termination_mask;  // NULL if unused
+  std::vector<unsigned short*> *waypoint_masks;  // NULL if unused
+};
+
+class CpuPtxHandler : public PtxHandler{
+ public:
+  CpuPtxHandler();
+  // global_pdf must hold env_dat->global_pdf_size zeroed entries.  Finished
+  // particles are added to it directly.  num_threads <= 0 means one per core.
+  void Init(
+      struct particle_attrs *attrs,
+      FILE *path_dump_fd,
+      EnvironmentData *env_dat,
+      const HostSamples &samples,
+      uint32_t *global_pdf,
+      int num_threads);
+  ~CpuPtxHandler();
+
+  int particles_per_side();
+  int launches();
+
+  void WriteParticle(struct particle_data *data, int offset);
+  void RunKernel(int side);
+  void ReadStatus(int offset, int count, cl_ushort *ret);
+  void DumpPath(int offset, int count);
+  // Nothing to do, particles are summed into global_pdf as they finish.
+  void RunSumKernel();
+
+  void PrintRejects();
+
+ private:
+  // Template switches, mirroring the kernel's -D flags.  The three mask tests
+  // share one switch; which masks are present is checked at runtime.
+  enum Feature
+  {
+    kPrng      = 1 << 0,
+    kAniso     = 1 << 1,
+    kEuler     = 1 << 2,
+    kLoopcheck = 1 << 3,
+    kMasks     = 1 << 4,
+    kNumFeatureSets = 1 << 5
+  };
+  // Instruction sets TrackLanes is built for, picked at runtime.
+  enum Isa
+  {
+    kIsaBase,
+    kIsaAvx2,
+    kIsaAvx512
+  };
+  typedef void (CpuPtxHandler::*TrackFn)(int first_slot);
+  static Isa DetectIsa();
+
+  // Steps one chunk of slots, starting at first_slot, for one batch.
+  template <unsigned kFeatures> void TrackLanes(int first_slot);
+  // TrackLanes, compiled for the newer instruction sets.
+  template <unsigned kFeatures> void TrackLanesAvx2(int first_slot);
+  template <unsigned kFeatures> void TrackLanesAvx512(int first_slot);
+  template <unsigned kFeatures>
+  TrackFn SelectTracker(unsigned features, Isa isa);
+
+  void FinishParticle(int slot);
+  void WorkerThread(int id);
+  void RunChunks(int id);
+
+  struct particle_attrs attrs_;
+  EnvironmentData *env_dat_;
+  HostSamples samples_;
+  uint32_t *global_pdf_;
+  FILE *path_dump_fd_;
+  bool first_time_;
+  // Read by main's progress loop.
+  std::atomic<int> launches_;
+  // Particles stopped early by --avoid or --wayorder, and the steps they had
+  // left before max_steps, as the kernel's rejects buffer.
+  std::atomic<int64_t> rejects_;
+  std::atomic<int64_t> reject_steps_;
+
+  TrackFn track_;
+
+  // Particle state, one entry per slot (structure of arrays).
+  float *pos_[3];
+  float *dr_[3];
+  uint64_t *rng_[5];
+  uint16_t *steps_;
+  uint16_t *complete_;
+  uint16_t *exclusion_;
+  uint16_t *waypoints_;  // n_waypoint_masks per slot
+  float *loopcheck_;  // 3 * lx * ly * lz per slot
+  float *path_;  // 4 * steps_per_kernel per slot
+  std::vector<uint32_t> *visited_;  // Voxels entered.  May repeat.
+
+  // Scheduler.  Each thread owns a run of chunks and steals from the other
+  // threads' runs once its own is empty.
+  struct ChunkQueue
+  {
+    std::atomic<int> next;
+    int begin;
+    int end;
+    char pad[64 - sizeof(std::atomic<int>) - 2 * sizeof(int)];
+  };
+  int num_threads_;
+  ChunkQueue *queues_;
+  std::vector<std::thread*> threads_;
+  std::mutex pool_lock_;
+  std::condition_variable start_cv_;
+  std::condition_variable finish_cv_;
+  int64_t generation_;
+  int running_;
+  bool quit_;
+  int side_;
+};
+
+#endif  // CPUPTXHANDLER_H_
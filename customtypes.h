@@ -30,7 +30,11 @@
  */
 
 
+#include <math.h>
+
+#include <algorithm>
 #include <iostream>
+#include <string>
 #include <vector>
 
  #ifdef __APPLE__
@@ -84,6 +88,30 @@ struct IntVolume
     //MutexWrapper& operator=(MutexWrapper const&) { return *this; }
 //};
 
+// Everything about the inputs that can be read from image headers alone,
+// before any sample data is loaded.
+struct SampleGeometry
+{
+  uint32_t nx, ny, nz;  // bedpostx sample volume
+  uint32_t ns;          // number of samples
+  float xdim, ydim, zdim;  // brain mask voxel size (mm)
+};
+
+// How one device's memory is spent.  OclEnv fills in the device limits and
+// what the shared data needs, the handler on that device fills in the rest.
+struct DeviceMemPlan
+{
+  std::string name;
+  cl_ulong global_mem_size;
+  cl_ulong max_buffer_size;
+  cl_ulong usable_mem_size;  // global_mem_size * --memrisk
+  cl_long dynamic_mem_left;  // usable_mem_size less samples, masks and pdf
+
+  size_t particle_size;
+  int num_wg;
+  int particles_per_side;
+};
+
 struct BedpostXData
 {
   std::vector<float*> data;
@@ -104,6 +132,65 @@ struct BedpostXData
 // multiply by the direction #, (from 0 to n-1)
 //
 
+// One slab of the volume, x in [first_x, last_x), for out-of-core tracking.
+// The resident copy on a device adds a halo so that lookups from particles
+// inside the slab never leave it.
+struct BrickInfo
+{
+  uint32_t width;  // Slab width, the same for every brick but the last
+  uint32_t first_x;
+  uint32_t last_x;
+  uint32_t base_x;  // First resident x
+  uint32_t nx;  // Resident width
+};
+
+// A device's resident brick.
+struct BrickBuffers
+{
+  cl::Buffer *samples;  // Packed, see OclEnv::PackSamples
+  cl::Buffer *brain_mask;
+  cl::Buffer *waypoint_masks;
+  cl::Buffer *termination_mask;
+  cl::Buffer *exclusion_mask;
+  int resident;  // Brick number, or -1
+};
+
+// Most sample buffers the samples may be split into.  The kernel takes one
+// argument per tile, see oclkernels/interpolate.cl.
+static const uint32_t kMaxSampleTiles = 4;
+
+// Most fibres per voxel tracked along, as probtrackx2 does.  Further fibres
+// on disk are ignored.
+static const uint32_t kMaxFibers = 3;
+
+// Most --targetmasks, one bit each in a uint per voxel.
+static const uint32_t kMaxTargets = 32;
+
+// Local rules (--loccurvthresh, --locfibchoice) ride along in the brain mask
+// the kernel reads every step: bit 0 is set inside the brain, the next two
+// bits hold the local fibre choice and the top byte the local curvature
+// threshold, 0 meaning none.  These must match oclkernels/attrs.h.
+static const int kVoxelFibreShift = 1;
+static const int kVoxelCurvShift = 8;
+
+// The level, 1 to 255, that stands for a local curvature threshold, clamped
+// to [-1, 1].
+inline int CurvatureLevel(float threshold)
+{
+  threshold = std::min(1.f, std::max(-1.f, threshold));
+  return 1 + static_cast<int>(roundf((threshold + 1) * 127));
+}
+
+// The threshold the kernel reads back from a level, within 1/254 of the one
+// packed.
+inline float CurvatureThreshold(int level)
+{
+  return (level - 1) / 127.f - 1.f;
+}
+
+// --opathdir: the upper triangle of a symmetric 3x3 direction tensor.
+static const uint32_t kPathDirComponents = 6;
+
 //TODO @STEVE
 //
 // Declare these all as const, and then have oclEnv initialize them
@@ -116,6 +203,7 @@ struct EnvironmentData
 
   cl_ulong max_buffer_size; //
   cl_ulong global_mem_size; //
+  bool zero_copy; // Samples are used in place from host memory.
 
   //Input Data - Size Related
   uint32_t nx; //
@@ -123,7 +211,7 @@ struct EnvironmentData
   uint32_t nz; //
   uint32_t ns; //
 
-  uint32_t bpx_dirs; //
+  uint32_t bpx_dirs; // Fibres tracked, at most kMaxFibers
   uint32_t n_waypts;
   bool exclusion_mask;
   bool terminate_mask;
@@ -139,9 +227,21 @@ struct EnvironmentData
   uint32_t max_steps;
   bool save_paths;
   bool way_and;
+  bool way_order;  // Waypoints must be hit in order (--wayorder)
   bool euler_streamline;
   bool deterministic;
   bool aniso_const;
+  bool kernel_refill;  // Lanes refill from a device-side reserve
+  bool image_samples;  // Samples in RGBA images, see AllocateSampleImages
+  bool matrix1;  // Seed to seed connectivity (--omatrix1)
+  bool matrix3;  // Target3 to target3 connectivity (--omatrix3)
+  uint32_t n_matrices;  // Of the two above, in that order
+  uint32_t matrix_slots;  // Hash table entries per matrix, a power of two
+  uint32_t n_targets;  // Seeds to targets (--os2t), at most kMaxTargets
+  bool network;  // The targets are the seed masks (--network)
+  bool path_dist;  // Path length sums alongside the pdf (--pd)
+  bool path_dirs;  // Direction tensor sums alongside the pdf (--opathdir)
+  bool local_rules;  // --loccurvthresh or --locfibchoice, in the brain mask
 
   // Particle Containers
   uint32_t section_size;
@@ -151,7 +251,11 @@ struct EnvironmentData
   //values to use for computation, buffers
   uint32_t interval_size; //2R in Oclptx Data Diagram 2.odg
 
-  cl_uint single_sample_mem_size;
+  cl_ulong single_sample_mem_size;
+  uint32_t sample_tiles;  // Buffers per direction, split by sample number
+  uint32_t samples_per_tile;
+  uint32_t n_bricks;  // 1 unless tracking out of core
+  uint32_t brick_width;
   cl_uint particle_paths_mem_size;
   cl_uint particle_uint_mem_size;
   cl_uint particles_prng_mem_size;
@@ -162,7 +266,7 @@ struct EnvironmentData
   cl_uint particle_loopcheck_dir_mem_size;
   cl_long dynamic_mem_left;
 
-  uint32_t total_static_gpu_mem;
+  cl_ulong total_static_gpu_mem;
   //uint32_t dynamic_gpu_mem_left;
   uint32_t max_particles_per_batch;
 
@@ -170,14 +274,19 @@ struct EnvironmentData
   // These are allocated/deallocated by OclEnv
   //
 
-  cl::Buffer** f_samples_buffers;
-  cl::Buffer** phi_samples_buffers;
-  cl::Buffer** theta_samples_buffers;
+  // One per tile, packed as in OclEnv::PackSamples.
+  cl::Buffer** samples_buffers;
+  // The same, with image_samples, instead of samples_buffers.
+  cl::Image3D** sample_images;
   cl::Buffer* brain_mask_buffer;
 
   cl::Buffer* waypoint_masks_buffer;
   cl::Buffer* exclusion_mask_buffer;
   cl::Buffer* termination_mask_buffer;
+  // Row/column label of every voxel, one volume per matrix.
+  cl::Buffer* matrix_labels_buffer;
+  // A bit per target, per voxel.
+  cl::Buffer* target_masks_buffer;
 };
 
 #endif
@@ -0,0 +1,204 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ *
+ * Compares sample lookups from buffers against lookups from an RGBA image
+ * (--imagesamples), on a synthetic volume of the given size.  Only the
+ * lookups are timed, see oclkernels/fetch_bench.cl.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+static const int kRepeats = 5;
+
+static void Check(cl_int ret, const char *what)
+{
+  if (CL_SUCCESS != ret)
+  {
+    printf("%s failed: %i\n", what, ret);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Seconds per launch, best of kRepeats after a warm-up.
+static double TimeKernel(
+    cl::CommandQueue *cq,
+    cl::Kernel *kernel,
+    int particles,
+    int wg_size)
+{
+  double best = 0.;
+  for (int r = 0; r <= kRepeats; ++r)
+  {
+    std::chrono::high_resolution_clock::time_point t_start =
+      std::chrono::high_resolution_clock::now();
+    Check(cq->enqueueNDRangeKernel(*kernel,
+                                   cl::NullRange,
+                                   cl::NDRange(particles),
+                                   cl::NDRange(wg_size)),
+          "enqueueNDRangeKernel");
+    Check(cq->finish(), "finish");
+    std::chrono::duration<double> delta_t =
+      std::chrono::high_resolution_clock::now() - t_start;
+
+    if (1 == r || (1 < r && delta_t.count() < best))
+      best = delta_t.count();
+  }
+  return best;
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 5)
+  {
+    printf("Usage: %s <nx> <ny> <nz> <num_samples> [particles] [steps] "
+           "[device]\n", argv[0]);
+    return -1;
+  }
+
+  cl_uint nx = atoi(argv[1]);
+  cl_uint ny = atoi(argv[2]);
+  cl_uint nz = atoi(argv[3]);
+  cl_uint ns = atoi(argv[4]);
+  int particles = argc > 5 ? atoi(argv[5]) : 65536;
+  int steps = argc > 6 ? atoi(argv[6]) : 1000;
+  unsigned device_num = argc > 7 ? atoi(argv[7]) : 0;
+  cl_int ret;
+
+  std::vector<cl::Platform> platforms;
+  Check(cl::Platform::get(&platforms), "clGetPlatformIDs");
+  std::vector<cl::Device> devices;
+  Check(platforms.at(0).getDevices(CL_DEVICE_TYPE_ALL, &devices),
+        "clGetDeviceIDs");
+  if (device_num >= devices.size())
+  {
+    printf("No device %u\n", device_num);
+    return -1;
+  }
+  cl::Device device = devices[device_num];
+  printf("Device: %s\n", device.getInfo<CL_DEVICE_NAME>().c_str());
+
+  if (CL_TRUE != device.getInfo<CL_DEVICE_IMAGE_SUPPORT>()
+   || nz > device.getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>()
+   || ny > device.getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>()
+   || nx * ns > device.getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>())
+  {
+    printf("Device can't hold %u samples of %ux%ux%u in one image.\n",
+      ns, nx, ny, nz);
+    return -1;
+  }
+
+  std::vector<cl::Device> context_devices(1, device);
+  cl::Context context(context_devices, NULL, NULL, NULL, &ret);
+  Check(ret, "clCreateContext");
+  cl::CommandQueue cq(context, device, 0, &ret);
+  Check(ret, "clCreateCommandQueue");
+
+  // A smoothly varying field, with per-sample noise, so particles move
+  // coherently as they do through real data.
+  size_t voxels = static_cast<size_t>(nx) * ny * nz;
+  std::vector<float> texels(4 * ns * voxels);
+  srand(1);
+  for (cl_uint s = 0; s < ns; ++s)
+    for (cl_uint x = 0; x < nx; ++x)
+      for (cl_uint y = 0; y < ny; ++y)
+        for (cl_uint z = 0; z < nz; ++z)
+        {
+          size_t i = ((s*nx + x)*ny + y)*nz + z;
+          float noise = 0.3f * rand() / RAND_MAX;
+          float theta = M_PI * (x + z) / (nx + nz) + noise;
+          float phi = 2 * M_PI * y / ny + noise;
+          texels[4*i] = cos(phi) * sin(theta);
+          texels[4*i+1] = sin(phi) * sin(theta);
+          texels[4*i+2] = cos(theta);
+          texels[4*i+3] = 1.f;
+        }
+
+  cl::Buffer samples_buf(context,
+                         CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                         texels.size() * sizeof(float),
+                         &texels[0],
+                         &ret);
+  Check(ret, "samples buffer");
+  cl::Image3D image(context,
+                    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                    cl::ImageFormat(CL_RGBA, CL_FLOAT),
+                    nz, ny, nx * ns,
+                    0, 0,
+                    &texels[0],
+                    &ret);
+  Check(ret, "image");
+
+  std::ifstream source_file("oclkernels/fetch_bench.cl");
+  std::stringstream source;
+  source << source_file.rdbuf();
+  std::string source_str = source.str();
+  cl::Program::Sources sources(
+      1, std::make_pair(source_str.c_str(), source_str.size()));
+  cl::Program program(context, sources, &ret);
+  Check(ret, "clCreateProgramWithSource");
+  ret = program.build(context_devices);
+  if (CL_SUCCESS != ret)
+  {
+    printf("%s\n",
+      program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device).c_str());
+    Check(ret, "clBuildProgram");
+  }
+
+  cl_uint4 dims = {{nx, ny, nz, ns}};
+  cl::Kernel buffers(program, "FetchBuffers", &ret);
+  Check(ret, "FetchBuffers");
+  buffers.setArg(0, samples_buf);
+  buffers.setArg(1, dims);
+  buffers.setArg(2, steps);
+
+  cl::Kernel images(program, "FetchImage", &ret);
+  Check(ret, "FetchImage");
+  images.setArg(0, image);
+  images.setArg(1, dims);
+  images.setArg(2, steps);
+
+  int wg_size = buffers.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device);
+  wg_size = std::min<int>(wg_size,
+    images.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+  particles = (particles + wg_size - 1) / wg_size * wg_size;
+
+  cl::Buffer out_buf(context,
+                     CL_MEM_WRITE_ONLY,
+                     particles * sizeof(cl_float4),
+                     NULL,
+                     &ret);
+  Check(ret, "output buffer");
+  buffers.setArg(3, out_buf);
+  images.setArg(3, out_buf);
+
+  printf("%u samples of %ux%ux%u, %i particles of %i steps, "
+         "work-groups of %i\n", ns, nx, ny, nz, particles, steps, wg_size);
+
+  double fetches = static_cast<double>(particles) * steps;
+  double t_buffers = TimeKernel(&cq, &buffers, particles, wg_size);
+  printf("buffers: %8.2f ms, %8.1f M lookups/sec\n",
+    1e3 * t_buffers, fetches / t_buffers / 1e6);
+  double t_image = TimeKernel(&cq, &images, particles, wg_size);
+  printf("image:   %8.2f ms, %8.1f M lookups/sec\n",
+    1e3 * t_image, fetches / t_image / 1e6);
+  printf("image/buffers: %.2fx\n", t_buffers / t_image);
+
+  return 0;
+}
@@ -0,0 +1,105 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ */
+
+#include "loadbalancer.h"
+
+#include <stdio.h>
+
+LoadBalancer::LoadBalancer(
+    int num_devices,
+    int64_t total_particles,
+    Fifo<struct PtxHandler::particle_data> *particles):
+  num_devices_(num_devices),
+  total_particles_(total_particles),
+  particles_(particles)
+{
+  stats_ = new DeviceStats[num_devices_];
+  for (int i = 0; i < num_devices_; ++i)
+  {
+    stats_[i].started = 0;
+    stats_[i].finished = 0;
+    stats_[i].busy_seconds = 0.;
+    stats_[i].particle_seconds = 0.;
+    stats_[i].batches = 0;
+  }
+}
+
+LoadBalancer::~LoadBalancer()
+{
+  delete[] stats_;
+}
+
+int64_t LoadBalancer::InFlight(int device)
+{
+  return stats_[device].started - stats_[device].finished;
+}
+
+double LoadBalancer::Latency(int device)
+{
+  if (0 == stats_[device].finished)
+    return 0.;
+  return stats_[device].particle_seconds / stats_[device].finished;
+}
+
+void LoadBalancer::ReportBatch(int device, double seconds)
+{
+  std::unique_lock<std::mutex> lk(stats_lock_);
+  stats_[device].busy_seconds += seconds;
+  stats_[device].particle_seconds += seconds * InFlight(device);
+  stats_[device].batches++;
+}
+
+void LoadBalancer::Started(int device)
+{
+  stats_[device].started++;
+}
+
+void LoadBalancer::Finished(int device)
+{
+  stats_[device].finished++;
+}
+
+bool LoadBalancer::MayRefill(int device)
+{
+  if (1 == num_devices_ || 0 == InFlight(device))
+    return true;
+
+  // Not in the tail yet, everyone refills.
+  int64_t remaining = total_particles_ - particles_->count();
+  int64_t in_flight = 0;
+  for (int i = 0; i < num_devices_; ++i)
+    in_flight += InFlight(i);
+  if (remaining > in_flight)
+    return true;
+
+  std::unique_lock<std::mutex> lk(stats_lock_);
+  double latency = Latency(device);
+  if (0. == latency)
+    return true;  // Not measured yet.
+
+  for (int i = 0; i < num_devices_; ++i)
+  {
+    double other = Latency(i);
+    if (i != device && 0. < other && kTailSlack * other < latency)
+      return false;
+  }
+  return true;
+}
+
+void LoadBalancer::PrintStats()
+{
+  std::unique_lock<std::mutex> lk(stats_lock_);
+  for (int i = 0; i < num_devices_; ++i)
+  {
+    double rate = 0.;
+    if (0. < stats_[i].busy_seconds)
+      rate = stats_[i].finished / stats_[i].busy_seconds;
+    printf("Device %i: %li particles in %li batches, %.1fs busy, "
+           "%.f particles/sec, %.3fs/particle\n",
+           i, static_cast<int64_t>(stats_[i].finished), stats_[i].batches,
+           stats_[i].busy_seconds, rate, Latency(i));
+  }
+}
@@ -0,0 +1,77 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ *
+ * Shares the particle stream between devices of different speeds.
+ *
+ * While plenty of particles remain, every free slot on every device is
+ * refilled.  Once fewer particles remain than are in flight (the tail of the
+ * run), a new particle goes only to devices that are expected to finish it
+ * about as soon as the fastest one would.  Slower devices then drain instead
+ * of taking on work that would hold up the end of the run.
+ *
+ * A device's expected particle latency comes from Little's law: particles in
+ * flight, integrated over its busy time, divided by particles finished.
+ */
+
+#ifndef LOADBALANCER_H_
+#define LOADBALANCER_H_
+
+#include <stdint.h>
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "fifo.h"
+#include "ptxhandler.h"
+
+class LoadBalancer{
+ public:
+  LoadBalancer(
+      int num_devices,
+      int64_t total_particles,
+      Fifo<struct PtxHandler::particle_data> *particles);
+  ~LoadBalancer();
+
+  // Worker: a batch of steps took `seconds` on `device`.
+  void ReportBatch(int device, double seconds);
+
+  // Reducers: a particle was written to, or finished on, `device`.
+  void Started(int device);
+  void Finished(int device);
+
+  // Reducers: should a free slot on `device` take a new particle?  Always
+  // true for a device with nothing in flight, so no device stops early.
+  bool MayRefill(int device);
+
+  void PrintStats();
+
+ private:
+  // Devices at most this much slower than the fastest keep refilling in the
+  // tail.  Slots free up on the fast device one batch at a time, so a small
+  // margin avoids starving devices that are nearly as good.
+  static constexpr double kTailSlack = 1.25;
+
+  struct DeviceStats
+  {
+    std::atomic<int64_t> started;
+    std::atomic<int64_t> finished;
+    double busy_seconds;
+    double particle_seconds;  // In flight particles * busy seconds
+    int64_t batches;
+  };
+
+  int64_t InFlight(int device);
+  // Expected seconds for a particle started now on `device`, or 0 if unknown.
+  double Latency(int device);
+
+  int num_devices_;
+  int64_t total_particles_;
+  Fifo<struct PtxHandler::particle_data> *particles_;
+  DeviceStats *stats_;
+  std::mutex stats_lock_;
+};
+
+#endif  // LOADBALANCER_H_
@@ -0,0 +1,72 @@
+// Copyright 2014 Jeff Taylor
+// Test case for the load balancer: who may refill in the tail of a run.
+
+#include "loadbalancer.h"
+
+#include<cassert>
+#include<cstdio>
+
+int main()
+{
+  // A lone device always refills.
+  Fifo<struct PtxHandler::particle_data> none(4);
+  LoadBalancer lone(1, 0, &none);
+  lone.Started(0);
+  assert(lone.MayRefill(0));
+
+  puts("Lone device");
+
+  // Three devices share 8 particles.
+  const int kTotal = 8;
+  struct PtxHandler::particle_data particles[kTotal];
+  Fifo<struct PtxHandler::particle_data> fifo(16);
+  for (int i = 0; i < kTotal; i++)
+    fifo.Push(&particles[i]);
+
+  LoadBalancer lb(3, kTotal, &fifo);
+  for (int device = 0; device < 3; device++)
+  {
+    lb.Started(device);
+    lb.Started(device);
+  }
+
+  // 8 left in the FIFO, 6 in flight: not the tail, everyone refills.
+  for (int device = 0; device < 3; device++)
+    assert(lb.MayRefill(device));
+
+  puts("Before the tail");
+
+  // Drain the FIFO, so more are in flight than remain.  Nothing is measured
+  // yet, so everyone still refills.
+  for (int i = 0; i < kTotal; i++)
+    assert(NULL != fifo.Pop());
+  for (int device = 0; device < 3; device++)
+    assert(lb.MayRefill(device));
+
+  puts("Tail, unmeasured");
+
+  // Little's law: 2 in flight for a batch of t seconds, then one finished,
+  // is 2t seconds per particle.  Devices take 2s, 2.4s and 3s.
+  lb.ReportBatch(0, 1.0);
+  lb.ReportBatch(1, 1.2);
+  lb.ReportBatch(2, 1.5);
+  for (int device = 0; device < 3; device++)
+    lb.Finished(device);
+
+  // 1.2x the fastest is within kTailSlack, 1.5x is not.
+  assert(lb.MayRefill(0));
+  assert(lb.MayRefill(1));
+  assert(!lb.MayRefill(2));
+
+  puts("Tail, measured");
+
+  // Once the slow device has drained, it may take a particle again.
+  lb.Finished(2);
+  assert(lb.MayRefill(2));
+
+  puts("Drained");
+
+  lb.PrintStats();
+
+  return 0;
+}
@@ -4,13 +4,17 @@
  *  Jeff Taylor
  */
 
+#include <string.h>
 #include <unistd.h>
 #include <cassert>
 #include <thread>
 #include <chrono>
 #include <cmath>
 
+#include "autotuner.h"
+#include "cpuptxhandler.h"
 #include "fifo.h"
+#include "loadbalancer.h"
 #include "oclenv.h"
 #include "oclptxhandler.h"
 #include "particlegen.h"
@@ -22,6 +26,7 @@ cl_ulong8 rng_zero = {{0,}};
 
 std::chrono::high_resolution_clock::time_point t_end;
 std::chrono::high_resolution_clock::time_point t_start;
+std::chrono::high_resolution_clock::time_point t_program_start;
 
 void start_timer()
 {
@@ -36,29 +41,110 @@ void end_timer(const char *verb)
   printf("Time to %s: %fs\n", verb, delta_t.count());
 }
 
+float since_program_start()
+{
+  std::chrono::duration<float> delta_t =
+    std::chrono::high_resolution_clock::now() - t_program_start;
+  return delta_t.count();
+}
+
+// --benchmark: one row per interval, with each device's pipeline stages in
+// seconds spent during it.
+void BenchmarkHeader(FILE *fd, int num_dev)
+{
+  fprintf(fd, "seconds,finished,particles_per_sec");
+  for (int i = 0; i < num_dev; ++i)
+    fprintf(fd, ",d%i_batches,d%i_wait,d%i_write,d%i_kernel,d%i_read,d%i_dump",
+            i, i, i, i, i, i);
+  fprintf(fd, "\n");
+}
+
+void BenchmarkRow(
+    FILE *fd,
+    float seconds,
+    float window,
+    const threading::StageTimes *now,
+    const threading::StageTimes *last,
+    int num_dev)
+{
+  int64_t finished = 0;
+  int64_t window_finished = 0;
+  for (int i = 0; i < num_dev; ++i)
+  {
+    finished += now[i].finished;
+    window_finished += now[i].finished - last[i].finished;
+  }
+
+  // Particles are counted once per direction, see below.
+  fprintf(fd, "%.2f,%li,%.f", seconds, finished / 2,
+          0. < window ? window_finished / 2 / window : 0.);
+  for (int i = 0; i < num_dev; ++i)
+    fprintf(fd, ",%li,%.4f,%.4f,%.4f,%.4f,%.4f",
+            now[i].batches - last[i].batches,
+            now[i].wait - last[i].wait,
+            now[i].write - last[i].write,
+            now[i].kernel - last[i].kernel,
+            now[i].read - last[i].read,
+            now[i].dump - last[i].dump);
+  fprintf(fd, "\n");
+  fflush(fd);
+}
+
+// Device discovery and kernel builds only depend on the options, so they run
+// on their own thread while the samples load.
+void SetupOpenCL(OclEnv *env, std::string gpu_select)
+{
+  std::chrono::high_resolution_clock::time_point t_build_start =
+    std::chrono::high_resolution_clock::now();
+
+  env->OclInit();
+  env->NewCLCommandQueues(gpu_select);
+  env->CreateKernels("standard");
+
+  std::chrono::duration<float> delta_t =
+    std::chrono::high_resolution_clock::now() - t_build_start;
+  printf("Time to build kernels: %fs\n", delta_t.count());
+}
+
 int main(int argc, char **argv)
 {
-  const int kStepsPerKernel = 1000;
-  const int kNumReducers = 1;
   FILE *global_fd;
-  Fifo<struct OclPtxHandler::particle_data> *particles_fifo;
+  Fifo<struct PtxHandler::particle_data> *particles_fifo;
+
+  t_program_start = std::chrono::high_resolution_clock::now();
 
   // Startup the samplemanager
-  puts("Loading samples...");
-  start_timer();
   SampleManager sample_manager;
   sample_manager.ParseCommandLine(argc, argv);
-  end_timer("load samples");
 
-  puts("Setting up OpenCL...");
+  // Create our oclenv, and start building kernels in the background
+  OclEnv env;
+  env.ProcessOptions(
+    sample_manager.GetOclptxOptions(),
+    sample_manager.GetNumFibers(),
+    sample_manager.GetNumWayMasks(),
+    sample_manager.GetNumTargets(),
+    sample_manager.GetSampleGeometry());
+
+  // The CPU engine needs no OpenCL at all.
+  bool use_cpu = sample_manager.GetOclptxOptions().cpu.value();
+  std::thread *ocl_setup = NULL;
+  if (!use_cpu)
+    ocl_setup = new std::thread(
+      SetupOpenCL,
+      &env,
+      sample_manager.GetOclptxOptions().gpuselect.value());
+
+  puts("Loading samples...");
   start_timer();
+  sample_manager.LoadSamples();
+  end_timer("load samples");
 
-  // Create our oclenv
-  OclEnv env;
-  env.OclInit();
-  env.NewCLCommandQueues(
-    sample_manager.GetOclptxOptions().gpuselect.value());
+  puts(use_cpu ? "Setting up CPU tracking..." : "Setting up OpenCL...");
+  start_timer();
 
+  const unsigned short int * brain_mask =
+    sample_manager.GetBrainMaskToArray();
   const unsigned short int * rubbish_mask =
     sample_manager.GetExclusionMaskToArray();
   const unsigned short int * stop_mask =
@@ -66,25 +152,39 @@ int main(int argc, char **argv)
   std::vector<unsigned short int*>* waypoints =
     sample_manager.GetWayMasksToVector();
 
-  env.AvailableGPUMem(
-    sample_manager.GetFDataPtr(),
-    sample_manager.GetOclptxOptions(),
-    waypoints->size(),
-    rubbish_mask,
-    stop_mask
-  );
-
-  env.CreateKernels("standard");
-
-  env.AllocateSamples(
-    sample_manager.GetFDataPtr(),
-    sample_manager.GetPhiDataPtr(),
-    sample_manager.GetThetaDataPtr(),
-    sample_manager.GetBrainMaskToArray(),
-    rubbish_mask,
-    stop_mask,
-    waypoints
-  );
+  ParticleGenerator particle_gen;
+
+  if (use_cpu)
+  {
+    env.SetSampleSizes(sample_manager.GetFDataPtr());
+  }
+  else
+  {
+    ocl_setup->join();
+    delete ocl_setup;
+    particle_gen.UseDevice(&env);
+
+    env.AvailableGPUMem(
+      sample_manager.GetFDataPtr(),
+      sample_manager.GetOclptxOptions()
+    );
+
+    env.AllocateSamples(
+      sample_manager.GetFDataPtr(),
+      sample_manager.GetPhiDataPtr(),
+      sample_manager.GetThetaDataPtr(),
+      brain_mask,
+      rubbish_mask,
+      stop_mask,
+      waypoints
+    );
+
+    if (0 < env.GetEnvData()->n_matrices)
+      env.AllocateMatrices(particle_gen.SeedVoxels(),
+                           sample_manager.GetTarget3MaskToArray());
+    if (0 < env.GetEnvData()->n_targets)
+      env.AllocateTargets(sample_manager.GetTargetBitsToArray());
+  }
 
   global_fd = fopen("./path_output", "w");
   if (NULL == global_fd)
@@ -99,13 +199,12 @@ int main(int argc, char **argv)
   * sample_manager.GetOclptxOptions().steplength.value()
   / dims.s[0]);
 
+  // ProcessOptions() checked it against the fibres tracked.
   int fibst = sample_manager.GetOclptxOptions().fibst.value() - 1;
-  if (fibst > 1);
-    fibst = 1;
 
-  struct OclPtxHandler::particle_attrs attrs = {
+  struct PtxHandler::particle_attrs attrs = {
     sample_manager.brain_mask_dim(),
-    kStepsPerKernel,
+    0, // Steps per kernel are tuned per device.
     sample_manager.GetOclptxOptions().nsteps.value(), // max_steps
     min_steps,
     0, // Particles per side not determined here.
@@ -123,39 +222,121 @@ int main(int argc, char **argv)
     sample_manager.GetOclptxOptions().randfib.value(),
     sample_manager.GetOclptxOptions().fibthresh.value()
     }; // num waymasks.
-  int num_dev = env.HowManyCQ();
+  int num_dev = use_cpu ? 1 : env.HowManyCQ();
+
+  // Launch sizes and reducer threads, per device.
+  TuneParams *tune = new TuneParams[num_dev];
+  if (use_cpu)
+  {
+    tune[0] = Autotuner::Defaults();
+  }
+  else
+  {
+    Autotuner tuner(&env, &particle_gen);
+    for (int i = 0; i < num_dev; ++i)
+      tune[i] = tuner.Tune(i, attrs);
+  }
 
-  // Create a new oclptxhandler.
-  OclPtxHandler *handler = new OclPtxHandler[num_dev];
+  // Create our handlers, one per device.
+  PtxHandler **handler = new PtxHandler*[num_dev];
   std::thread *gpu_managers[num_dev];
+  uint32_t *host_pdf = NULL;
 
   int total_particles = 0;
 
-  for (int i = 0; i < num_dev; ++i)
+  if (use_cpu)
   {
-    handler[i].Init(env.GetContext(),
-                    env.GetCq(i),
-                    env.GetKernel(i),
-                    env.GetSumKernel(i),
-                    &attrs,
-                    global_fd,
-                    env.GetKernelWorkGroupInfo(i),
-                    env.GetEnvData(),
-                    env.GetDevicePdf(i));
-
-    total_particles += handler[i].particles_per_side();
+    host_pdf = new uint32_t[env.GetEnvData()->global_pdf_size];
+    memset(host_pdf, 0, env.GetEnvData()->global_pdf_size * sizeof(uint32_t));
+
+    env.PackSamples(sample_manager.GetFDataPtr(),
+                    sample_manager.GetPhiDataPtr(),
+                    sample_manager.GetThetaDataPtr());
+
+    HostSamples samples;
+    samples.directions = env.GetPackedSamples();
+    samples.n_fibers = env.GetEnvData()->bpx_dirs;
+    samples.brain_mask = brain_mask;
+    samples.exclusion_mask = rubbish_mask;
+    samples.termination_mask = stop_mask;
+    samples.waypoint_masks = waypoints->empty() ? NULL : waypoints;
+
+    attrs.steps_per_kernel = tune[0].steps_per_kernel;
+    CpuPtxHandler *cpu_handler = new CpuPtxHandler;
+    cpu_handler->Init(&attrs,
+                      global_fd,
+                      env.GetEnvData(),
+                      samples,
+                      host_pdf,
+                      sample_manager.GetOclptxOptions().cputhreads.value());
+    handler[0] = cpu_handler;
+    total_particles += handler[0]->particles_per_side();
+  }
+  else
+  {
+    for (int i = 0; i < num_dev; ++i)
+    {
+      attrs.steps_per_kernel = tune[i].steps_per_kernel;
+      OclPtxHandler *ocl_handler = new OclPtxHandler;
+      if (1 < env.GetEnvData()->n_bricks)
+        ocl_handler->SetBricks(&env, i);
+      ocl_handler->Init(env.GetContext(),
+                        env.GetCq(i),
+                        env.GetKernel(i),
+                        env.GetSumKernel(i),
+                        &attrs,
+                        global_fd,
+                        tune[i].wg_size,
+                        tune[i].max_wgs,
+                        env.GetEnvData(),
+                        env.GetMemPlan(i),
+                        env.GetDevicePdf(i),
+                        env.GetDeviceMatrices(i),
+                        env.GetDeviceSeedsToTargets(i),
+                        env.GetDevicePathDist(i),
+                        env.GetDevicePathDirs(i));
+      handler[i] = ocl_handler;
+      total_particles += handler[i]->particles_per_side();
+    }
+    env.PrintMemPlans();
   }
 
-  ParticleGenerator particle_gen;
   particles_fifo = particle_gen.Init(total_particles);
 
+  LoadBalancer balancer(num_dev, particle_gen.total_particles(),
+                        particles_fifo);
+  threading::PipelineStats *stats = new threading::PipelineStats[num_dev];
+
   for (int i = 0; i < num_dev; ++i)
   {
     gpu_managers[i] = new std::thread(
         threading::RunThreads,
-        &handler[i],
+        handler[i],
         particles_fifo,
-        kNumReducers);
+        tune[i].num_reducers,
+        &balancer,
+        i,
+        &stats[i]);
+  }
+
+  const float kBenchmarkInterval = 1.;  // s
+  FILE *benchmark_fd = NULL;
+  threading::StageTimes *bench_now = new threading::StageTimes[num_dev];
+  threading::StageTimes *bench_last = new threading::StageTimes[num_dev];
+  float bench_last_time = 0.;
+  std::string benchmark_file =
+    sample_manager.GetOclptxOptions().benchmark.value();
+  if ("" != benchmark_file)
+  {
+    benchmark_fd = fopen(benchmark_file.c_str(), "w");
+    if (NULL == benchmark_fd)
+    {
+      perror("Couldn't open benchmark file");
+      exit(1);
+    }
+    BenchmarkHeader(benchmark_fd, num_dev);
+    for (int i = 0; i < num_dev; ++i)
+      bench_last[i] = stats[i].Get();
   }
 
   end_timer("set up OpenCL");
@@ -164,17 +345,48 @@ int main(int argc, char **argv)
   start_timer();
 
   int64_t count = 0;
+  int64_t finished;
   float percent;
   float rate;
+  bool first_tracked = false;
   int64_t total = particle_gen.total_particles();
   while (count < total)
   {
+    if (!first_tracked)
+    {
+      for (int i = 0; i < num_dev; ++i)
+        first_tracked |= (0 < handler[i]->launches());
+      if (first_tracked)
+        printf("Time to first tracked particle: %fs\n",
+               since_program_start());
+    }
+
     count = particles_fifo->count();
     percent = (100. * count) / total;
     t_end = std::chrono::high_resolution_clock::now();
     std::chrono::duration<float> track_time = (t_end - t_start);
 
-    rate = count / track_time.count();
+    // The rate is of particles finished.  Counting particles handed out
+    // instead credits the first fill of every slot to the start of the run,
+    // which shows as a rate that decays for as long as the run lasts.
+    finished = 0;
+    for (int i = 0; i < num_dev; ++i)
+    {
+      bench_now[i] = stats[i].Get();
+      finished += bench_now[i].finished;
+    }
+    rate = finished / track_time.count();
+
+    if (benchmark_fd
+     && kBenchmarkInterval <= track_time.count() - bench_last_time)
+    {
+      BenchmarkRow(benchmark_fd, track_time.count(),
+                   track_time.count() - bench_last_time,
+                   bench_now, bench_last, num_dev);
+      bench_last_time = track_time.count();
+      for (int i = 0; i < num_dev; ++i)
+        bench_last[i] = bench_now[i];
+    }
 
     // Internally, we count each particle twice (once per direction).  The
     // user doesn't expect that, so we correct it here by dividing by two.
@@ -192,16 +404,65 @@ int main(int argc, char **argv)
 
   end_timer("track");
 
+  if (benchmark_fd)
+  {
+    std::chrono::duration<float> track_time = (t_end - t_start);
+    for (int i = 0; i < num_dev; ++i)
+      bench_now[i] = stats[i].Get();
+    BenchmarkRow(benchmark_fd, track_time.count(),
+                 track_time.count() - bench_last_time,
+                 bench_now, bench_last, num_dev);
+    fclose(benchmark_fd);
+  }
+
+  if (1 < num_dev)
+    balancer.PrintStats();
+  for (int i = 0; i < num_dev; ++i)
+    handler[i]->PrintRejects();
+
   puts("Writing to file...");
   start_timer();
 
   for (int i = 0; i < num_dev; ++i)
-    handler[i].RunSumKernel();
-  env.PdfsToFile("pdf_out");
+    handler[i]->RunSumKernel();
+  env.PdfsToFile("pdf_out", host_pdf);
+  if (particle_gen.SeedToDiffusion())
+    env.SeedSpacePdfToFile("pdf_seedspace_out",
+                           *particle_gen.SeedToDiffusion(),
+                           host_pdf);
+  if (env.GetEnvData()->path_dist)
+    env.PathDistToFile("pdf_pd_out", "pdf_length_out");
+  if (env.GetEnvData()->path_dirs)
+  {
+    std::vector<float> path_dirs;
+    env.ReadPathDirs(&path_dirs);
+    sample_manager.WritePathDirs(&path_dirs[0]);
+  }
+  if (0 < env.GetEnvData()->n_matrices)
+    env.MatricesToFile();
+  if (0 < env.GetEnvData()->n_targets)
+  {
+    std::vector<uint32_t> s2t_counts;
+    env.ReadSeedsToTargets(&s2t_counts);
+    if (env.GetEnvData()->network)
+      sample_manager.WriteNetwork(&s2t_counts[0]);
+    else
+      sample_manager.WriteSeedsToTargets(&s2t_counts[0],
+                                         particle_gen.SeedVoxels());
+  }
 
   end_timer("write to file");
 
+  printf("Total time: %fs\n", since_program_start());
+
+  for (int i = 0; i < num_dev; ++i)
+    delete handler[i];
   delete[] handler;
+  delete[] tune;
+  delete[] stats;
+  delete[] bench_now;
+  delete[] bench_last;
+  delete[] host_pdf;
 
   fclose(global_fd);
 
@@ -0,0 +1,76 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ *
+ * Morton (Z-order) codes of particle positions.  Particles sorted by code
+ * sit near each other in the volume, so handing them to neighbouring slots
+ * lets a work-group's lookups share cache lines.
+ */
+
+#ifndef MORTON_H_
+#define MORTON_H_
+
+#include <stdint.h>
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "ptxhandler.h"
+
+// Spreads the low 21 bits of v to every third bit.
+inline uint64_t MortonSpread(uint64_t v)
+{
+  v &= 0x1fffff;
+  v = (v | v << 32) & 0x1f00000000ffffULL;
+  v = (v | v << 16) & 0x1f0000ff0000ffULL;
+  v = (v | v << 8)  & 0x100f00f00f00f00fULL;
+  v = (v | v << 4)  & 0x10c30c30c30c30c3ULL;
+  v = (v | v << 2)  & 0x1249249249249249ULL;
+  return v;
+}
+
+// Code of the voxel containing (x, y, z), in voxel coordinates.
+inline uint64_t MortonCode(float x, float y, float z)
+{
+  uint64_t vx = static_cast<uint64_t>(std::max(x, 0.f));
+  uint64_t vy = static_cast<uint64_t>(std::max(y, 0.f));
+  uint64_t vz = static_cast<uint64_t>(std::max(z, 0.f));
+  return MortonSpread(vx) | MortonSpread(vy) << 1 | MortonSpread(vz) << 2;
+}
+
+// Sorts count particles in place by the Morton code of their position.
+inline void MortonSort(struct PtxHandler::particle_data *data, int count)
+{
+  if (count < 2)
+    return;
+
+  std::vector<std::pair<uint64_t, int> > order(count);
+  for (int i = 0; i < count; ++i)
+    order[i] = std::make_pair(MortonCode(data[i].position.s[0],
+                                         data[i].position.s[1],
+                                         data[i].position.s[2]), i);
+  std::sort(order.begin(), order.end());
+
+  // Permute in place, a cycle at a time.  particle_data is 64-byte aligned,
+  // which new[] doesn't promise before C++17.
+  std::vector<bool> placed(count, false);
+  for (int i = 0; i < count; ++i)
+  {
+    if (placed[i])
+      continue;
+    struct PtxHandler::particle_data first = data[i];
+    int to = i;
+    for (int from = order[to].second; from != i; from = order[to].second)
+    {
+      data[to] = data[from];
+      placed[to] = true;
+      to = from;
+    }
+    data[to] = first;
+    placed[to] = true;
+  }
+}
+
+#endif  // MORTON_H_
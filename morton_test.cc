@@ -0,0 +1,60 @@
+// Copyright 2014 Jeff Taylor
+// Test case for Morton codes and the order they sort particles in.
+
+#include "morton.h"
+
+#include<cassert>
+#include<cstdio>
+
+int main()
+{
+  // Bits spread to every third place.
+  assert(0 == MortonSpread(0));
+  assert(1 == MortonSpread(1));
+  assert(010 == MortonSpread(2));
+  assert(011 == MortonSpread(3));
+  assert(0x1249249249249249ULL == MortonSpread(0x1fffff));
+  // Only the low 21 bits count.
+  assert(MortonSpread(1) == MortonSpread(0x200001));
+
+  puts("Spread");
+
+  // x is the lowest bit of each triple, then y, then z.
+  assert(1 == MortonCode(1, 0, 0));
+  assert(2 == MortonCode(0, 1, 0));
+  assert(4 == MortonCode(0, 0, 1));
+  assert(7 == MortonCode(1, 1, 1));
+  assert(010 == MortonCode(2, 0, 0));
+  // Positions within a voxel share its code, and negatives clamp to 0.
+  assert(MortonCode(1, 1, 1) == MortonCode(1.9, 1.2, 1.5));
+  assert(0 == MortonCode(-3, -0.5, 0));
+
+  puts("Codes");
+
+  // (3, 3, 3) closes the first 4^3 block, so it comes before (4, 0, 0) even
+  // though its x is smaller than 4 and larger than 1.
+  const int kCount = 4;
+  float positions[kCount][3] = {{4, 0, 0}, {3, 3, 3}, {0, 0, 0}, {1, 0, 0}};
+  const cl_uint sorted[kCount] = {2, 3, 1, 0};
+
+  struct PtxHandler::particle_data data[kCount];
+  for (int i = 0; i < kCount; i++)
+  {
+    for (int j = 0; j < 3; j++)
+      data[i].position.s[j] = positions[i][j];
+    data[i].seed_voxel = i;
+  }
+  MortonSort(data, kCount);
+
+  // Each particle moves whole.
+  for (int i = 0; i < kCount; i++)
+  {
+    assert(sorted[i] == data[i].seed_voxel);
+    for (int j = 0; j < 3; j++)
+      assert(positions[sorted[i]][j] == data[i].position.s[j]);
+  }
+
+  puts("Sorted");
+
+  return 0;
+}
@@ -30,9 +30,15 @@
  */
 
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <iostream>
 #include <fstream>
+#include <iterator>
+#include <sstream>
 #include <vector>
 #include <cmath>
 #include <algorithm>
@@ -55,6 +61,23 @@
 
 static void die(int reason);
 
+// Connectivity tables, as oclkernels/attrs.h lays them out: a header, then
+// MATRIX_SLOTS keys and as many counts.
+enum
+{
+  kMatrixColumns = 0,
+  kMatrixDropped = 1,
+  kMatrixHeader = 4
+};
+
+// Keys are row * columns + column + 1, in 32 bits.
+static const uint32_t kMaxMatrixLabels = 65535;
+
+static size_t MatrixTableSize(uint32_t slots)
+{
+  return kMatrixHeader + 2 * static_cast<size_t>(slots);
+}
+
 //*********************************************************************
 //
 // OclEnv Constructors/Destructors
@@ -65,13 +88,35 @@ static void die(int reason);
 //
 OclEnv::OclEnv()
 {
-  this->env_data.f_samples_buffers = NULL;
-  this->env_data.phi_samples_buffers = NULL;
-  this->env_data.theta_samples_buffers = NULL;
+  this->env_data.samples_buffers = NULL;
+  this->env_data.sample_images = NULL;
   this->env_data.brain_mask_buffer = NULL;
   this->env_data.exclusion_mask_buffer = NULL;
   this->env_data.termination_mask_buffer = NULL;
   this->env_data.waypoint_masks_buffer = NULL;
+  this->env_data.zero_copy = false;
+  this->env_data.sample_tiles = 1;
+  this->env_data.samples_per_tile = 0;
+  this->env_data.n_bricks = 1;
+  this->env_data.brick_width = 0;
+  this->env_data.kernel_refill = false;
+  this->env_data.image_samples = false;
+  this->env_data.matrix1 = false;
+  this->env_data.matrix3 = false;
+  this->env_data.n_matrices = 0;
+  this->env_data.matrix_slots = 0;
+  this->env_data.matrix_labels_buffer = NULL;
+  this->env_data.n_targets = 0;
+  this->env_data.network = false;
+  this->env_data.path_dist = false;
+  this->env_data.path_dirs = false;
+  this->env_data.local_rules = false;
+  this->env_data.target_masks_buffer = NULL;
+  this->matrix1_min_steps = 0;
+  this->matrix3_min_steps = 0;
+  this->specialize = false;
+  this->transform_built = false;
+  this->device_type = CL_DEVICE_TYPE_GPU;
 }
 
 //
@@ -79,21 +124,18 @@ OclEnv::OclEnv()
 //
 OclEnv::~OclEnv()
 {
-  if (this->env_data.f_samples_buffers != NULL)
+  if (this->env_data.samples_buffers != NULL)
   {
-    for (uint32_t s = 0; s < 2; s++)
-    {
-      if(this->env_data.f_samples_buffers[s] != NULL)
-        delete this->env_data.f_samples_buffers[s];
-      if(this->env_data.phi_samples_buffers[s] != NULL)
-        delete this->env_data.phi_samples_buffers[s];
-      if(this->env_data.theta_samples_buffers[s] != NULL)
-        delete this->env_data.theta_samples_buffers[s];
-    }
-    
-    delete[] this->env_data.f_samples_buffers;
-    delete[] this->env_data.phi_samples_buffers;
-    delete[] this->env_data.theta_samples_buffers;
+    for (uint32_t t = 0; t < kMaxSampleTiles; t++)
+      delete this->env_data.samples_buffers[t];
+    delete[] this->env_data.samples_buffers;
+  }
+
+  if (this->env_data.sample_images != NULL)
+  {
+    for (uint32_t t = 0; t < kMaxSampleTiles; t++)
+      delete this->env_data.sample_images[t];
+    delete[] this->env_data.sample_images;
   }
 
   delete this->env_data.brain_mask_buffer;
@@ -107,6 +149,27 @@ OclEnv::~OclEnv()
 
   for (uint32_t i = 0; i < this->device_global_pdf_buffers.size(); i++)
     delete device_global_pdf_buffers.at(i);
+  for (uint32_t i = 0; i < this->device_path_dist_buffers.size(); i++)
+    delete device_path_dist_buffers.at(i);
+  for (uint32_t i = 0; i < this->device_path_dir_buffers.size(); i++)
+    delete device_path_dir_buffers.at(i);
+
+  delete this->env_data.matrix_labels_buffer;
+  for (uint32_t i = 0; i < this->device_matrix_buffers.size(); i++)
+    delete device_matrix_buffers.at(i);
+
+  delete this->env_data.target_masks_buffer;
+  for (uint32_t i = 0; i < this->device_s2t_buffers.size(); i++)
+    delete device_s2t_buffers.at(i);
+
+  for (uint32_t i = 0; i < this->brick_buffers.size(); i++)
+  {
+    delete this->brick_buffers[i].samples;
+    delete this->brick_buffers[i].brain_mask;
+    delete this->brick_buffers[i].waypoint_masks;
+    delete this->brick_buffers[i].termination_mask;
+    delete this->brick_buffers[i].exclusion_mask;
+  }
 }
 
 static void die(int reason)
@@ -161,6 +224,44 @@ cl::Buffer * OclEnv::GetDevicePdf(uint32_t device_num)
   return this->device_global_pdf_buffers.at(device_num);
 }
 
+cl::Buffer * OclEnv::GetDevicePathDist(uint32_t device_num)
+{
+  if (this->device_path_dist_buffers.empty())
+    return NULL;
+  return this->device_path_dist_buffers.at(device_num);
+}
+
+cl::Buffer * OclEnv::GetDevicePathDirs(uint32_t device_num)
+{
+  if (this->device_path_dir_buffers.empty())
+    return NULL;
+  return this->device_path_dir_buffers.at(device_num);
+}
+
+cl::Buffer * OclEnv::GetDeviceMatrices(uint32_t device_num)
+{
+  if (this->device_matrix_buffers.empty())
+    return NULL;
+  return this->device_matrix_buffers.at(device_num);
+}
+
+cl::Buffer * OclEnv::GetDeviceSeedsToTargets(uint32_t device_num)
+{
+  if (this->device_s2t_buffers.empty())
+    return NULL;
+  return this->device_s2t_buffers.at(device_num);
+}
+
+DeviceMemPlan * OclEnv::GetMemPlan(uint32_t device_num)
+{
+  return &(this->mem_plans.at(device_num));
+}
+
+std::string OclEnv::GetCacheDir()
+{
+  return this->kernel_cache_dir;
+}
+
 
 //*********************************************************************
 //
@@ -174,8 +275,11 @@ cl::Buffer * OclEnv::GetDevicePdf(uint32_t device_num)
 //
 void OclEnv::OclInit()
 {
-  // Prevent Nvidia from (erroneously) caching stale build files.
-  setenv("CUDA_CACHE_DISABLE", "1", 1);
+  // Note: the driver's own build cache used to be disabled here
+  // (CUDA_CACHE_DISABLE), as Nvidia keys it on the top level source only and
+  // would happily reuse builds made against stale headers.  BuildProgram now
+  // passes a hash of the full include tree as a define, which fixes the
+  // driver's key as well as our own.
 
   cl::Platform::get(&(this->ocl_platforms));
 
@@ -185,23 +289,37 @@ void OclEnv::OclInit()
     exit(-1);
   }
 
+  // A context spans a single platform, so take the first one offering the
+  // requested device type.  CPU devices usually come from their own platform
+  // (pocl, Intel), separate from the GPU vendor's.
+  std::vector<cl::Device> devices;
+  uint32_t p;
+  for (p = 0; p < this->ocl_platforms.size(); p++)
+  {
+    devices.clear();
+    this->ocl_platforms[p].getDevices(this->device_type, &devices);
+    if (0 < devices.size())
+      break;
+  }
+
+  if (p == this->ocl_platforms.size())
+  {
+    printf("No OpenCL devices of the requested type (--device) found.\n");
+    exit(-1);
+  }
+
+  std::string platform_name;
+  this->ocl_platforms[p].getInfo(CL_PLATFORM_NAME, &platform_name);
+  printf("Using OpenCL platform: %s\n", platform_name.c_str());
+
   cl_context_properties con_prop[3] =
   {
     CL_CONTEXT_PLATFORM,
-    (cl_context_properties) (this->ocl_platforms[0]) (),
+    (cl_context_properties) (this->ocl_platforms[p]) (),
     0
   };
 
-  this->ocl_platforms.at(0);
-
-  // cl::Context test_context = cl::Context(CL_DEVICE_TYPE_GPU, con_prop);
-  // std::vector<cl::Device> test_device_list =
-  //   this->ocl_context.getInfo<CL_CONTEXT_DEVICES>();
-
-  this->ocl_context = cl::Context(CL_DEVICE_TYPE_GPU, con_prop);
-  // GPU DEVICES ONLY, FOR CPU, (don't use CPU unless informed, not
-  // quite the same physical interface):
-  // this->oclContext = cl::Context(CL_DEVICE_TYPE_CPU, conProp);
+  this->ocl_context = cl::Context(devices, con_prop);
   this->ocl_devices = this->ocl_context.getInfo<CL_CONTEXT_DEVICES>();
 }
 
@@ -253,17 +371,146 @@ unsigned int OclEnv::HowManyCQ()
 size_t OclEnv::GetKernelWorkGroupInfo(uint32_t device)
 {
   size_t wg_size;
+  size_t wg_multiple;
+  cl::Device *dev = &(this->ocl_devices.at(this->ocl_queue_devices.at(device)));
+
   this->ocl_kernel_set.at(device).getWorkGroupInfo<size_t>(
-    this->ocl_devices.at(device), CL_KERNEL_WORK_GROUP_SIZE, &wg_size);
+    *dev, CL_KERNEL_WORK_GROUP_SIZE, &wg_size);
+
+  // CPU runtimes run a whole work-group on one core, vectorising across work
+  // items, and report huge maximums (4096+).  A few vector widths per group
+  // keeps the groups numerous enough to spread across cores.
+  if (CL_DEVICE_TYPE_CPU == dev->getInfo<CL_DEVICE_TYPE>())
+  {
+    this->ocl_kernel_set.at(device).getWorkGroupInfo<size_t>(
+      *dev, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, &wg_multiple);
+    wg_size = std::min(wg_size, 4 * wg_multiple);
+  }
+
   return wg_size;
 }
 
+uint32_t OclEnv::GetMaxWorkGroups(uint32_t device)
+{
+  cl::Device *dev = &(this->ocl_devices.at(this->ocl_queue_devices.at(device)));
+
+  // A CPU device's "global memory" is host RAM, so sizing from memory would
+  // allocate far more particles than there are cores to step them.  Two
+  // groups per core lets one core's groups cover for another's stragglers.
+  // Every group also carries a whole-volume local pdf, another reason to keep
+  // the count down.
+  if (CL_DEVICE_TYPE_CPU == dev->getInfo<CL_DEVICE_TYPE>())
+    return 2 * dev->getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+
+  return 0;
+}
+
+size_t OclEnv::GetWorkGroupMultiple(uint32_t device)
+{
+  size_t wg_multiple;
+  cl::Device *dev = &(this->ocl_devices.at(this->ocl_queue_devices.at(device)));
+
+  this->ocl_kernel_set.at(device).getWorkGroupInfo<size_t>(
+    *dev, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE, &wg_multiple);
+
+  return wg_multiple;
+}
+
+bool OclEnv::IsHostMemoryDevice(uint32_t device)
+{
+  cl::Device *dev = &(this->ocl_devices.at(this->ocl_queue_devices.at(device)));
+
+  return CL_DEVICE_TYPE_CPU == dev->getInfo<CL_DEVICE_TYPE>()
+      || CL_TRUE == dev->getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+}
+
+// Samples are split by sample number into as few tiles as the smallest
+// device's allocation limit allows.  A lookup draws one sample, so it only
+// ever touches one tile.  Images are also limited in depth, which holds
+// nx slices per sample.
+void OclEnv::PlanSampleTiles()
+{
+  uint32_t nx = this->sample_geometry.nx;
+  uint32_t ny = this->sample_geometry.ny;
+  uint32_t nz = this->sample_geometry.nz;
+  uint32_t ns = this->sample_geometry.ns;
+  uint32_t n_fibers = this->env_data.bpx_dirs;
+  bool images = this->env_data.image_samples;
+
+  cl_ulong max_alloc = 0;
+  size_t max_depth = 0;
+  for (uint32_t k = 0; k < this->ocl_queue_devices.size(); k++)
+  {
+    cl::Device *dev = &(this->ocl_devices.at(this->ocl_queue_devices.at(k)));
+    cl_ulong dev_alloc = dev->getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+    if (0 == k || dev_alloc < max_alloc)
+      max_alloc = dev_alloc;
+
+    if (!images)
+      continue;
+
+    size_t dev_depth = dev->getInfo<CL_DEVICE_IMAGE3D_MAX_DEPTH>();
+    if (0 == k || dev_depth < max_depth)
+      max_depth = dev_depth;
+
+    if (CL_TRUE != dev->getInfo<CL_DEVICE_IMAGE_SUPPORT>()
+     || nz * n_fibers > dev->getInfo<CL_DEVICE_IMAGE3D_MAX_WIDTH>()
+     || ny > dev->getInfo<CL_DEVICE_IMAGE3D_MAX_HEIGHT>()
+     || nx > dev_depth)
+    {
+      printf("Device %u (%s) can't hold the samples in images.  Rerun "
+        "without --imagesamples.\n", k,
+        dev->getInfo<CL_DEVICE_NAME>().c_str());
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // A float4 per fibre and voxel.
+  cl_ulong sample_mem_size = static_cast<cl_ulong>(nx) * ny * nz * n_fibers
+    * 4 * sizeof(float);
+
+  // If even kMaxSampleTiles is too few, AvailableGPUMem() says so.  Bricks
+  // are sized to fit instead.
+  cl_ulong tiles = kMaxSampleTiles;
+  if (1 < this->env_data.n_bricks)
+    tiles = 1;
+  else if (0 < sample_mem_size && sample_mem_size <= max_alloc)
+  {
+    cl_ulong max_per_tile = max_alloc / sample_mem_size;
+    tiles = std::min<cl_ulong>((ns + max_per_tile - 1) / max_per_tile,
+                               kMaxSampleTiles);
+  }
+  if (images)
+  {
+    cl_ulong max_per_image = max_depth / nx;
+    tiles = std::max<cl_ulong>(tiles,
+                               (ns + max_per_image - 1) / max_per_image);
+    if (kMaxSampleTiles < tiles)
+    {
+      printf("%u samples of %u slices need %lu images per direction, at "
+        "most %u are supported.  Rerun without --imagesamples.\n",
+        ns, nx, static_cast<unsigned long>(tiles), kMaxSampleTiles);
+      exit(EXIT_FAILURE);
+    }
+  }
+  tiles = std::max<cl_ulong>(1, std::min<cl_ulong>(tiles, ns));
+
+  // Even tiles; the last one may be short.
+  this->env_data.samples_per_tile = (ns + tiles - 1) / tiles;
+  this->env_data.sample_tiles = 1;
+  if (0 < ns)
+    this->env_data.sample_tiles =
+      (ns + this->env_data.samples_per_tile - 1)
+      / this->env_data.samples_per_tile;
+}
+
 //
 //
 //
 void OclEnv::NewCLCommandQueues(std::string gpu_select)
 {
   this->ocl_device_queues.clear();
+  this->ocl_queue_devices.clear();
 
   if (gpu_select == "")
   {
@@ -277,6 +524,7 @@ void OclEnv::NewCLCommandQueues(std::string gpu_select)
           this->ocl_devices[k]
         )
       );
+      this->ocl_queue_devices.push_back(k);
     }
   }
   else
@@ -310,8 +558,15 @@ void OclEnv::NewCLCommandQueues(std::string gpu_select)
           this->ocl_devices[gpu_list.at(k)]
         )
       );
+      this->ocl_queue_devices.push_back(gpu_list.at(k));
     }
   }
+  // Samples can be used in place only if every device can see host memory.
+  this->env_data.zero_copy = true;
+  for (uint32_t k = 0; k < this->ocl_device_queues.size(); k++)
+    this->env_data.zero_copy &= this->IsHostMemoryDevice(k);
+  if (this->env_data.zero_copy)
+    printf("Devices share host memory, samples will not be copied.\n");
 }
 
 
@@ -357,7 +612,11 @@ void OclEnv::CreateKernels( std::string kernel_name )
   if (!(this->env_data.deterministic))
     define_list += " -D PRNG";
   if (this->env_data.bpx_dirs > 1)
-    define_list += " -D TWO_DIR";
+  {
+    char fibers[32];
+    snprintf(fibers, 32, " -D N_FIBERS=%u", this->env_data.bpx_dirs);
+    define_list += fibers;
+  }
   if (this->env_data.n_waypts > 0)
     define_list += " -D WAYPOINTS";
   if (this->env_data.terminate_mask)
@@ -368,12 +627,64 @@ void OclEnv::CreateKernels( std::string kernel_name )
     define_list += " -D EULER_STREAMLINE";
   if (this->env_data.way_and)
     define_list += " -D WAYAND";
+  if (this->env_data.way_order)
+    define_list += " -D WAYORDER";
   if (this->env_data.save_paths)
     define_list += " -D PATH_SAVE";
   if (this->env_data.loopcheck)
     define_list += " -D LOOPCHECK";
   if (this->env_data.aniso_const)
     define_list += " -D ANISOTROPIC";
+  if (1 < this->env_data.n_bricks)
+    define_list += " -D BRICKED";
+  if (this->env_data.kernel_refill)
+    define_list += " -D KERNEL_REFILL";
+  if (this->env_data.image_samples)
+    define_list += " -D IMAGE_SAMPLES";
+  if (0 < this->env_data.n_targets)
+  {
+    char targets[64];
+    snprintf(targets, 64, " -D TARGETS -D N_TARGETS=%u",
+      this->env_data.n_targets);
+    define_list += targets;
+    if (this->env_data.network)
+      define_list += " -D NETWORK";
+  }
+  if (this->env_data.path_dist)
+    define_list += " -D PATH_DIST";
+  if (this->env_data.path_dirs)
+    define_list += " -D PATH_DIRS";
+  if (this->env_data.local_rules)
+    define_list += " -D LOCAL_RULES";
+  if (0 < this->env_data.n_matrices)
+  {
+    char matrices[128];
+    snprintf(matrices, 128, " -D MATRIX_SLOTS=%uu",
+      this->env_data.matrix_slots);
+    define_list += matrices;
+    if (this->env_data.matrix1)
+    {
+      snprintf(matrices, 128, " -D MATRIX1 -D kMatrix1MinSteps=%u",
+        this->matrix1_min_steps);
+      define_list += matrices;
+    }
+    if (this->env_data.matrix3)
+    {
+      snprintf(matrices, 128, " -D MATRIX3 -D kMatrix3MinSteps=%u",
+        this->matrix3_min_steps);
+      define_list += matrices;
+    }
+  }
+
+  // Sample tiles, if one buffer can't hold a direction's samples.
+  this->PlanSampleTiles();
+  if (1 < this->env_data.sample_tiles)
+  {
+    char tiles[64];
+    snprintf(tiles, 64, " -D SAMPLE_TILES=%u -D kSamplesPerTile=%uu",
+      this->env_data.sample_tiles, this->env_data.samples_per_tile);
+    define_list += tiles;
+  }
 
   // Compute the rbtree size
   char buf[32];
@@ -384,32 +695,38 @@ void OclEnv::CreateKernels( std::string kernel_name )
       (int) (2 * std::ceil(std::log2(env_data.max_steps))));
   define_list += buf;
 
-  std::ifstream main_stream(interp_kernel_source);
-  std::string main_code(  (std::istreambuf_iterator<char>(main_stream) ),
-                            (std::istreambuf_iterator<char>()));
-
-  std::ifstream sum_stream(sum_kernel_source);
-  std::string sum_code(  (std::istreambuf_iterator<char>(sum_stream) ),
-                            (std::istreambuf_iterator<char>()));
+  // Run constants.  Floats are printed with enough digits to round trip
+  // exactly, and with a forced decimal point so "2" becomes a valid "2.f".
+  if (this->specialize)
+  {
+    char spec[256];
+    snprintf(spec, 256,
+      " -D SPECIALIZED"
+      " -D kSampleNx=%uu -D kSampleNy=%uu -D kSampleNz=%uu"
+      " -D kNumSamples=%uu"
+      " -D kStepLength=%#.9gf -D kCurvatureThreshold=%#.9gf"
+      " -D kBrainMaskDimX=%#.9gf -D kBrainMaskDimY=%#.9gf"
+      " -D kBrainMaskDimZ=%#.9gf",
+      this->sample_geometry.nx,
+      this->sample_geometry.ny,
+      this->sample_geometry.nz,
+      this->sample_geometry.ns,
+      this->step_length,
+      this->curvature_threshold,
+      this->sample_geometry.xdim,
+      this->sample_geometry.ydim,
+      this->sample_geometry.zdim);
+    define_list += spec;
+  }
 
   printf("Build Options: %s\n", define_list.c_str());
+  this->build_options = define_list;
   //
   // Build Program files here
   //
 
-  cl::Program::Sources main_source(
-    1,
-    std::make_pair(main_code.c_str(), main_code.length())
-  );
-
-  cl::Program::Sources sum_source(
-    1,
-    std::make_pair(sum_code.c_str(), sum_code.length())
-  );
-
-  cl::Program main_program(this->ocl_context, main_source);
-
-  err = main_program.build(this->ocl_devices, define_list.c_str());
+  cl::Program main_program;
+  err = this->BuildProgram(interp_kernel_source, define_list, &main_program);
 
   if(err != CL_SUCCESS)
   {
@@ -427,9 +744,8 @@ void OclEnv::CreateKernels( std::string kernel_name )
     exit(EXIT_FAILURE);
   }
 
-  cl::Program sum_program(this->ocl_context, sum_source);
-
-  err = sum_program.build(this->ocl_devices, define_list.c_str());
+  cl::Program sum_program;
+  err = this->BuildProgram(sum_kernel_source, define_list, &sum_program);
 
   if(err != CL_SUCCESS)
   {
@@ -562,176 +878,381 @@ std::string OclEnv::OclErrorStrings(cl_int error)
 
 //*********************************************************************
 //
-// Resource Allocation
+// OclEnv Kernel Binary Cache
 //
 //*********************************************************************
 
-// TODO @STEVE
-// Right now I've just kluged together AllocateSamples, but really
-// AvailableGPUMem should run more thoroughly and calculate a lot of the vallues
-// currently bneing calculated in AllocateSamples
-//
-uint32_t OclEnv::AvailableGPUMem(
-  const BedpostXData* f_data,
-  const oclptxOptions& ptx_options,
-  uint32_t n_waypoints,
-  const unsigned short int* exclusion_mask,
-  const unsigned short int* termination_mask
-)
+static const uint64_t kFnvOffset = 14695981039346656037ULL;
+static const char kCacheMagic[8] = {'O', 'C', 'L', 'P', 'T', 'X', 'B', '1'};
+
+// 64-bit FNV-1a.  Not cryptographic, but the full key is also stored in each
+// cache file and compared on load, so a collision only costs a rebuild.
+static uint64_t Fnv1a(const std::string& data, uint64_t hash)
 {
-  // ***********************************************
-  //  Hardware Parameters
-  // ***********************************************
-  cl_ulong max_buff_size;
-  cl_ulong gl_mem_size;
-  cl_ulong useful_gl_mem_size;
+  for (size_t i = 0; i < data.size(); ++i)
+  {
+    hash ^= static_cast<unsigned char>(data[i]);
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
 
-  std::vector<cl::Device>::iterator dit = this->ocl_devices.begin();
+static std::string ReadFile(const std::string& path)
+{
+  std::ifstream stream(path.c_str(), std::ios::binary);
+  return std::string((std::istreambuf_iterator<char>(stream)),
+                     (std::istreambuf_iterator<char>()));
+}
 
-  dit->getInfo(CL_DEVICE_MAX_MEM_ALLOC_SIZE, &max_buff_size);
-  this->env_data.max_buffer_size = max_buff_size;
+// Hash a kernel source along with everything it #includes from oclkernels/.
+// The headers change far more often than the kernels themselves.
+static uint64_t HashKernelSource(
+  const std::string& path, uint64_t hash, int depth)
+{
+  std::string code = ReadFile(path);
+  hash = Fnv1a(path, hash);
+  hash = Fnv1a(code, hash);
 
-  dit->getInfo(CL_DEVICE_GLOBAL_MEM_SIZE, &gl_mem_size);
-  this->env_data.global_mem_size = gl_mem_size;
+  if (depth > 8)
+    return hash;
 
-  useful_gl_mem_size =
-    std::floor(gl_mem_size * ptx_options.mem_risk_frac.value());
+  std::string dir = path.substr(0, path.find_last_of(slash) + 1);
+  std::istringstream lines(code);
+  std::string line;
+  while (std::getline(lines, line))
+  {
+    size_t start = line.find("#include \"");
+    if (std::string::npos == start)
+      continue;
+    start += 10;
+    size_t stop = line.find('"', start);
+    if (std::string::npos == stop)
+      continue;
+    hash = HashKernelSource(
+      dir + line.substr(start, stop - start), hash, depth + 1);
+  }
 
-  // ***********************************************
-  //  BPX Sample Parameters + Masks
-  // ***********************************************
+  return hash;
+}
 
-  this->env_data.bpx_dirs = 1;
-  // oclptx supports up to two fiber directions per vertex. Supporting 3
-  // is unpractical for the typical workstation GPU.
-  if( f_data->data.size() > 2)
-    this->env_data.bpx_dirs = 2;
+static void MakeDirs(const std::string& path)
+{
+  size_t pos = path.find(slash, 1);
+  while (1)
+  {
+    mkdir(path.substr(0, pos).c_str(), 0755);
+    if (std::string::npos == pos)
+      break;
+    pos = path.find(slash, pos + 1);
+  }
+}
 
-  this->env_data.nx = f_data->nx;
-  this->env_data.ny = f_data->ny;
-  this->env_data.nz = f_data->nz;
-  this->env_data.ns = f_data->ns;
+static bool LoadProgramBinaries(
+  const std::string& path,
+  const std::string& key,
+  cl::Context& context,
+  std::vector<cl::Device>& devices,
+  cl::Program *program)
+{
+  std::ifstream in(path.c_str(), std::ios::binary);
+  if (!in)
+    return false;
+
+  char magic[8];
+  uint64_t key_size;
+  uint64_t n_dev;
+
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(&key_size), sizeof(key_size));
+  if (!in || memcmp(magic, kCacheMagic, sizeof(magic))
+      || key_size != key.size())
+    return false;
+
+  std::string stored_key(key_size, '\0');
+  in.read(&stored_key[0], key_size);
+  in.read(reinterpret_cast<char*>(&n_dev), sizeof(n_dev));
+  if (!in || stored_key != key || n_dev != devices.size())
+    return false;
+
+  std::vector<std::string> binaries(n_dev);
+  std::vector<size_t> lengths(n_dev);
+  std::vector<const unsigned char*> pointers(n_dev);
+  std::vector<cl_device_id> ids(n_dev);
+
+  for (uint64_t d = 0; d < n_dev; d++)
+  {
+    uint64_t size;
+    in.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if (!in || 0 == size)
+      return false;
+
+    binaries[d].resize(size);
+    in.read(&binaries[d][0], size);
+    if (!in)
+      return false;
+
+    lengths[d] = size;
+    pointers[d] = reinterpret_cast<const unsigned char*>(binaries[d].data());
+    ids[d] = devices[d]();
+  }
 
-  cl_uint single_direction_size =
-    f_data->nx * f_data->ny * f_data->nz;
+  cl_int err;
+  cl_program raw_program = clCreateProgramWithBinary(
+    context(),
+    n_dev,
+    &ids[0],
+    &lengths[0],
+    &pointers[0],
+    NULL,
+    &err);
+  if (CL_SUCCESS != err)
+    return false;
+
+  *program = cl::Program(raw_program);
+  return true;
+}
 
-  cl_uint single_pdf_mask_size = (single_direction_size / 32)  + 1;
+static void SaveProgramBinaries(
+  const std::string& path,
+  const std::string& key,
+  const std::string& dir,
+  const cl::Program& program)
+{
+  cl_uint n_dev;
+  cl_int err = clGetProgramInfo(program(), CL_PROGRAM_NUM_DEVICES,
+    sizeof(n_dev), &n_dev, NULL);
+  if (CL_SUCCESS != err || 0 == n_dev)
+    return;
+
+  std::vector<size_t> sizes(n_dev);
+  err = clGetProgramInfo(program(), CL_PROGRAM_BINARY_SIZES,
+    n_dev * sizeof(size_t), &sizes[0], NULL);
+  if (CL_SUCCESS != err)
+    return;
+
+  std::vector<std::string> binaries(n_dev);
+  std::vector<unsigned char*> pointers(n_dev);
+  for (cl_uint d = 0; d < n_dev; d++)
+  {
+    // Some platforms won't hand out binaries at all.  Nothing to cache.
+    if (0 == sizes[d])
+      return;
+    binaries[d].resize(sizes[d]);
+    pointers[d] = reinterpret_cast<unsigned char*>(&binaries[d][0]);
+  }
 
-  cl_uint brain_mem_size =
-    single_direction_size * sizeof(unsigned short int);
+  err = clGetProgramInfo(program(), CL_PROGRAM_BINARIES,
+    n_dev * sizeof(unsigned char*), &pointers[0], NULL);
+  if (CL_SUCCESS != err)
+    return;
 
-  this->env_data.mask_mem_size = brain_mem_size;
+  MakeDirs(dir);
 
-  cl_uint single_direction_mem_size =
-    single_direction_size*f_data->ns*sizeof(float);
+  // Write then rename, so that concurrent runs sharing a cache never see a
+  // partial file.
+  char suffix[32];
+  snprintf(suffix, 32, ".tmp%i", static_cast<int>(getpid()));
+  std::string tmp_path = path + suffix;
 
-  this->env_data.single_sample_mem_size = single_direction_mem_size;
+  std::ofstream out(tmp_path.c_str(), std::ios::binary);
+  uint64_t key_size = key.size();
+  uint64_t n_dev64 = n_dev;
 
-  cl_uint num_samp = 2;
-  // Anisotropic Constraint
-  this->env_data.aniso_const = ptx_options.usef.value();
-  if (this->env_data.aniso_const)
+  out.write(kCacheMagic, sizeof(kCacheMagic));
+  out.write(reinterpret_cast<char*>(&key_size), sizeof(key_size));
+  out.write(key.data(), key_size);
+  out.write(reinterpret_cast<char*>(&n_dev64), sizeof(n_dev64));
+  for (cl_uint d = 0; d < n_dev; d++)
   {
-    printf("\nUsing Anisotropic Constraint for Tracking\n");
-    num_samp = 3;
+    uint64_t size = sizes[d];
+    out.write(reinterpret_cast<char*>(&size), sizeof(size));
+    out.write(binaries[d].data(), size);
   }
+  out.close();
 
-  cl_uint total_mem_size =
-    num_samp*single_direction_mem_size * this->env_data.bpx_dirs +
-    brain_mem_size*(1 + n_waypoints);
-
-  if (exclusion_mask != NULL)
+  if (!out || 0 != rename(tmp_path.c_str(), path.c_str()))
   {
-    printf("Exmask\n");
-    total_mem_size += brain_mem_size;
-    this->env_data.exclusion_mask = true;
+    printf("Warning: could not write kernel cache file %s\n", path.c_str());
+    unlink(tmp_path.c_str());
   }
-  else
-    this->env_data.exclusion_mask = false;
+}
+
+//
+// Everything a compiled binary depends on: each device and the driver
+// running it, plus the build options (which carry the source hash).
+//
+std::string OclEnv::CacheKey(const std::string& define_list)
+{
+  std::string key;
+  std::string info;
 
-  if (termination_mask != NULL)
+  for(std::vector<cl::Device>::iterator dit = this->ocl_devices.begin();
+    dit != this->ocl_devices.end(); ++dit)
   {
-    printf("termimask\n");
-    total_mem_size += brain_mem_size;
-    this->env_data.terminate_mask = true;
+    dit->getInfo(CL_DEVICE_NAME, &info);
+    key += info + ";";
+    dit->getInfo(CL_DEVICE_VENDOR, &info);
+    key += info + ";";
+    dit->getInfo(CL_DEVICE_VERSION, &info);
+    key += info + ";";
+    dit->getInfo(CL_DRIVER_VERSION, &info);
+    key += info + "\n";
   }
-  else
-    this->env_data.terminate_mask = false;
+  key += define_list;
 
-  if (ptx_options.waycond.value() == "AND")
-    this->env_data.way_and = true;
-  else
-    this->env_data.way_and = false;
+  return key;
+}
 
-  this->env_data.n_waypts = n_waypoints;
+std::string OclEnv::ProfileKey(uint32_t device, const std::string& extra)
+{
+  std::string key;
+  std::string info;
+  cl::Device *dev = &(this->ocl_devices.at(this->ocl_queue_devices.at(device)));
+
+  dev->getInfo(CL_DEVICE_NAME, &info);
+  key += info + ";";
+  dev->getInfo(CL_DEVICE_VENDOR, &info);
+  key += info + ";";
+  dev->getInfo(CL_DRIVER_VERSION, &info);
+  key += info + "\n";
+  key += this->build_options + "\n" + extra;
 
-  // ***********************************************
-  //  PDFS
-  // ***********************************************
+  char buf[32];
+  snprintf(buf, 32, "%016llx",
+    static_cast<unsigned long long>(Fnv1a(key, kFnvOffset)));
+  return buf;
+}
 
-  this->env_data.global_pdf_size = single_pdf_mask_size * 32;
-  this->env_data.global_pdf_mem_size =
-    this->env_data.global_pdf_size * sizeof(uint32_t);
+cl_int OclEnv::BuildProgram(
+  const std::string& source_file,
+  const std::string& define_list,
+  cl::Program *program
+)
+{
+  cl_int err;
+  char buf[64];
 
-  this->env_data.total_static_gpu_mem =
-    total_mem_size + this->env_data.global_pdf_mem_size;
+  snprintf(buf, 64, " -D OCLPTX_SOURCE_HASH=0x%016llxUL",
+    static_cast<unsigned long long>(
+      HashKernelSource(source_file, kFnvOffset, 0)));
+  std::string options = define_list + buf;
 
-  this->env_data.dynamic_mem_left = useful_gl_mem_size - this->env_data.total_static_gpu_mem;
+  std::string key = this->CacheKey(options);
+  std::string base_name =
+    source_file.substr(source_file.find_last_of(slash) + 1);
+  std::string cache_file;
 
-  // ***********************************************
-  //  Dynamic Particle Containers/Parameters
-  // ***********************************************
+  if (this->kernel_cache_dir != "")
+  {
+    snprintf(buf, 64, "-%016llx.bin",
+      static_cast<unsigned long long>(Fnv1a(key, kFnvOffset)));
+    cache_file = this->kernel_cache_dir + slash + base_name + buf;
 
-  this->env_data.particle_pdf_mask_mem_size =
-    single_pdf_mask_size * sizeof(uint32_t);
-  this->env_data.pdf_entries_per_particle = single_pdf_mask_size;
-  
-  // Loopcheck
-  uint32_t loopcheck_x;
-  uint32_t loopcheck_y;
-  uint32_t loopcheck_z;
-  cl_uint single_loopcheck_size;
-  cl_uint single_loopcheck_mask_size;
+    if (LoadProgramBinaries(cache_file, key, this->ocl_context,
+                            this->ocl_devices, program))
+    {
+      err = program->build(this->ocl_devices, options.c_str());
+      if (CL_SUCCESS == err)
+      {
+        printf("Loaded %s from %s\n", base_name.c_str(), cache_file.c_str());
+        return err;
+      }
+      // The driver rejected it.  Rebuild from source, which replaces the
+      // entry.
+    }
+  }
 
-  // Hard Coded, just like in ptx2
-  uint32_t loopcheck_fraction = 5;
+  std::string code = ReadFile(source_file);
+  cl::Program::Sources source(
+    1,
+    std::make_pair(code.c_str(), code.length())
+  );
 
-  if (ptx_options.loopcheck.value())
-  {
-    this->env_data.loopcheck = true;
-    loopcheck_x = (f_data->nx / loopcheck_fraction) +
-      ((f_data->nx %loopcheck_fraction > 0)? 1 : 0);
-    loopcheck_y = (f_data->ny / loopcheck_fraction) +
-      ((f_data->ny %loopcheck_fraction > 0)? 1 : 0);
-    loopcheck_z = (f_data->nz / loopcheck_fraction) +
-      ((f_data->nz %loopcheck_fraction > 0)? 1 : 0);
+  *program = cl::Program(this->ocl_context, source);
+  err = program->build(this->ocl_devices, options.c_str());
 
-    this->env_data.lx = loopcheck_x;
-    this->env_data.ly = loopcheck_y;
-    this->env_data.lz = loopcheck_z;
+  if (CL_SUCCESS == err && cache_file != "")
+    SaveProgramBinaries(cache_file, key, this->kernel_cache_dir, *program);
 
-    single_loopcheck_size = loopcheck_x * loopcheck_y * loopcheck_z;
-    single_loopcheck_mask_size = (single_loopcheck_size / 32)  +
-      ((single_loopcheck_size%32 > 0)? 1 : 0);
+  return err;
+}
 
-    this->env_data.loopcheck_dir_size = single_loopcheck_size;
-    this->env_data.loopcheck_location_size = single_loopcheck_mask_size;
+//*********************************************************************
+//
+// Resource Allocation
+//
+//*********************************************************************
 
-    this->env_data.particle_loopcheck_location_mem_size =
-      single_loopcheck_mask_size * sizeof(uint32_t);
-    this->env_data.particle_loopcheck_dir_mem_size =
-      loopcheck_x * loopcheck_y *loopcheck_z * sizeof(float4);
+void OclEnv::ProcessOptions(
+  const oclptxOptions& ptx_options,
+  uint32_t n_fibers,
+  uint32_t n_waypoints,
+  uint32_t n_targets,
+  const SampleGeometry& geometry
+)
+{
+  this->env_data.bpx_dirs = std::max<uint32_t>(1,
+    std::min(n_fibers, kMaxFibers));
+  if (n_fibers > kMaxFibers)
+    printf("Tracking along the first %u of %u fibres\n", kMaxFibers,
+      n_fibers);
+
+  if (ptx_options.randfib.value() < 0 || ptx_options.randfib.value() > 3)
+  {
+    printf("--randfib must be 0, 1, 2 or 3.\n");
+    exit(EXIT_FAILURE);
   }
-  else
+  // Local rules, packed into the brain mask by SampleManager.
+  this->env_data.local_rules = ptx_options.loccurvthresh.value() != ""
+                            || ptx_options.locfibchoice.value() != "";
+  if (this->env_data.local_rules && ptx_options.cpu.value())
   {
-    this->env_data.loopcheck = false;
-    this->env_data.particle_loopcheck_location_mem_size = 0;
-    this->env_data.particle_loopcheck_dir_mem_size = 0;
+    printf("--loccurvthresh and --locfibchoice are not supported with "
+      "--cpu.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (ptx_options.fibst.value() < 1
+   || ptx_options.fibst.value() > static_cast<int>(this->env_data.bpx_dirs))
+  {
+    printf("--fibst must be between 1 and %u.\n", this->env_data.bpx_dirs);
+    exit(EXIT_FAILURE);
   }
 
-  // Modified Euler
+  // Anisotropic Constraint
+  this->env_data.aniso_const = ptx_options.usef.value();
+  if (this->env_data.aniso_const)
+    printf("\nUsing Anisotropic Constraint for Tracking\n");
 
-  this->env_data.euler_streamline = ptx_options.modeuler.value();
+  this->env_data.exclusion_mask = (ptx_options.rubbishfile.value() != "");
+  this->env_data.terminate_mask = (ptx_options.stopfile.value() != "");
+
+  if (ptx_options.waycond.value() == "AND")
+    this->env_data.way_and = true;
+  else
+    this->env_data.way_and = false;
+
+  // The two halves of a streamline are separate particles, which may finish
+  // in different launches or on different devices, so each is judged on its
+  // own.  That is --onewaycondition; judging the whole streamline, as
+  // probtrackx does by default, is not supported, so the default runs as
+  // --onewaycondition.
+  if (0 < n_waypoints && !ptx_options.onewaycondition.value())
+    printf("Warning: waypoints are checked per half streamline, as with "
+      "--onewaycondition.\n");
+  this->env_data.way_order = ptx_options.wayorder.value() && 0 < n_waypoints;
+  if (this->env_data.way_order && !this->env_data.way_and)
+  {
+    printf("--wayorder needs --waycond AND.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  this->env_data.n_waypts = n_waypoints;
+
+  this->env_data.loopcheck = ptx_options.loopcheck.value();
+
+  // Modified Euler
+
+  this->env_data.euler_streamline = ptx_options.modeuler.value();
   if (this->env_data.euler_streamline)
     printf("\nUsing Modified Euler Integration Method\n");
 
@@ -745,36 +1266,445 @@ uint32_t OclEnv::AvailableGPUMem(
   // paths?
   this->env_data.max_steps = ptx_options.nsteps.value();
   this->env_data.save_paths = ptx_options.save_paths.value();
-  
+
   if (this->env_data.save_paths)
     printf("Saving Path Data\n");
 
+  // Device type
+  if (ptx_options.device.value() == "gpu")
+    this->device_type = CL_DEVICE_TYPE_GPU;
+  else if (ptx_options.device.value() == "cpu")
+    this->device_type = CL_DEVICE_TYPE_CPU;
+  else if (ptx_options.device.value() == "all")
+    this->device_type = CL_DEVICE_TYPE_ALL;
+  else
+  {
+    printf("Unknown --device '%s', expected gpu, cpu or all.\n",
+      ptx_options.device.value().c_str());
+    exit(EXIT_FAILURE);
+  }
+
+  // Specialization
+  this->specialize = ptx_options.specialize.value();
+  this->sample_geometry = geometry;
+  this->step_length = ptx_options.steplength.value();
+  this->curvature_threshold = ptx_options.c_thr.value();
+
+  if (this->specialize)
+    printf("Specializing kernels for %ux%ux%u volume, %u samples\n",
+      geometry.nx, geometry.ny, geometry.nz, geometry.ns);
+
+  // Out-of-core bricks, as x-slabs of equal width.
+  if (1 < ptx_options.bricks.value() && 1 < geometry.nx)
+  {
+    if (ptx_options.cpu.value())
+    {
+      printf("--bricks is not supported with --cpu.\n");
+      exit(EXIT_FAILURE);
+    }
+    // Bricks carry a halo of two voxels, enough for lookups up to a step
+    // ahead as long as a step stays within a voxel.
+    if (this->step_length > geometry.xdim)
+    {
+      printf("--bricks needs --steplength no longer than a voxel (%f).\n",
+        geometry.xdim);
+      exit(EXIT_FAILURE);
+    }
+
+    uint32_t n_bricks = std::min<uint32_t>(ptx_options.bricks.value(),
+                                           geometry.nx);
+    this->env_data.brick_width = (geometry.nx + n_bricks - 1) / n_bricks;
+    this->env_data.n_bricks =
+      (geometry.nx + this->env_data.brick_width - 1)
+      / this->env_data.brick_width;
+    printf("Tracking out of core in %u bricks of %u slices\n",
+      this->env_data.n_bricks, this->env_data.brick_width);
+  }
+
+  // In-kernel refill.  Paths are dumped per slot and launch, and parked
+  // particles must keep their slot, so neither mixes with it.
+  this->env_data.kernel_refill = ptx_options.kernelrefill.value();
+  if (this->env_data.kernel_refill
+   && (ptx_options.cpu.value() || this->env_data.save_paths
+    || 1 < this->env_data.n_bricks))
+  {
+    printf("--kernelrefill is not supported with --cpu, --savepaths or "
+      "--bricks.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Bricks are reloaded buffer by buffer, so they stay buffers.
+  this->env_data.image_samples = ptx_options.imagesamples.value();
+  if (this->env_data.image_samples
+   && (ptx_options.cpu.value() || 1 < this->env_data.n_bricks))
+  {
+    printf("--imagesamples is not supported with --cpu or --bricks.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Connectivity matrices, accumulated on the device.
+  this->env_data.matrix1 = ptx_options.matrix1out.value();
+  this->env_data.matrix3 = ptx_options.matrix3out.value();
+  this->env_data.n_matrices = (this->env_data.matrix1 ? 1 : 0)
+                            + (this->env_data.matrix3 ? 1 : 0);
+  if (0 < this->env_data.n_matrices)
+  {
+    if (ptx_options.cpu.value())
+    {
+      printf("--omatrix1 and --omatrix3 are not supported with --cpu.\n");
+      exit(EXIT_FAILURE);
+    }
+    if (ptx_options.matrixslots.value() < 1
+     || ptx_options.matrixslots.value() > (1 << 30))
+    {
+      printf("--matrixslots must be between 1 and %i.\n", 1 << 30);
+      exit(EXIT_FAILURE);
+    }
+
+    this->env_data.matrix_slots = 1;
+    while (this->env_data.matrix_slots
+         < static_cast<uint32_t>(ptx_options.matrixslots.value()))
+      this->env_data.matrix_slots <<= 1;
+
+    this->matrix1_min_steps =
+      std::ceil(ptx_options.distthresh1.value() / this->step_length);
+    this->matrix3_min_steps =
+      std::ceil(ptx_options.distthresh3.value() / this->step_length);
+  }
+
+  // Seeds to targets and network mode, also on the device.
+  this->env_data.n_targets = n_targets;
+  this->env_data.network = ptx_options.network.value();
+  if (0 < n_targets && ptx_options.cpu.value())
+  {
+    printf("%s is not supported with --cpu.\n",
+      this->env_data.network ? "--network" : "--os2t");
+    exit(EXIT_FAILURE);
+  }
+  // The other seed masks act as waypoints, and like them are judged per
+  // half streamline.
+  if (this->env_data.network && !ptx_options.onewaycondition.value())
+    printf("Warning: --network checks the other seed masks per half "
+      "streamline, as with --onewaycondition.\n");
+
+  // Path length sums (--pd), also on the device.
+  this->env_data.path_dist = ptx_options.pathdist.value();
+  if (this->env_data.path_dist && ptx_options.cpu.value())
+  {
+    printf("--pd is not supported with --cpu.\n");
+    exit(EXIT_FAILURE);
+  }
+  this->env_data.path_dirs = ptx_options.opathdir.value();
+  if (this->env_data.path_dirs && ptx_options.cpu.value())
+  {
+    printf("--opathdir is not supported with --cpu.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Seed space (--xfm).  Tracking, and every output but the seed space pdf,
+  // stays on the brain mask grid.
+  if (ptx_options.seeds_to_dti.value() != ""
+   && ptx_options.seedref.value() == "")
+  {
+    printf("--xfm needs --seedref.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Kernel binary cache
+  this->kernel_cache_dir = ptx_options.kernelcache.value();
+  if (this->kernel_cache_dir == "none")
+  {
+    this->kernel_cache_dir = "";
+  }
+  else if (this->kernel_cache_dir == "")
+  {
+    const char *xdg_cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+
+    if (NULL != xdg_cache && '\0' != xdg_cache[0])
+      this->kernel_cache_dir = std::string(xdg_cache) + slash + "oclptx";
+    else if (NULL != home)
+      this->kernel_cache_dir =
+        std::string(home) + slash + ".cache" + slash + "oclptx";
+  }
+}
+
+//
+// Sizes derived from the loaded samples alone.  AvailableGPUMem() calls this;
+// the CPU engine, which never touches a device, calls it directly.
+//
+void OclEnv::SetSampleSizes(const BedpostXData* f_data)
+{
+  this->env_data.nx = f_data->nx;
+  this->env_data.ny = f_data->ny;
+  this->env_data.nz = f_data->nz;
+  this->env_data.ns = f_data->ns;
+
+  // The kernels were built from the headers; make sure the data agrees.
+  if (this->specialize && (f_data->nx != this->sample_geometry.nx
+                        || f_data->ny != this->sample_geometry.ny
+                        || f_data->nz != this->sample_geometry.nz
+                        || f_data->ns != this->sample_geometry.ns))
+  {
+    printf("Loaded samples don't match the dimensions the kernels were "
+      "specialized for.  Rerun without --specialize.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  cl_uint single_direction_size =
+    f_data->nx * f_data->ny * f_data->nz;
+
+  cl_uint single_pdf_mask_size = (single_direction_size / 32)  + 1;
+
+  this->env_data.mask_mem_size =
+    single_direction_size * sizeof(unsigned short int);
+
+  this->env_data.single_sample_mem_size =
+    static_cast<cl_ulong>(single_direction_size)*f_data->ns*sizeof(float);
+
+  this->env_data.global_pdf_size = single_pdf_mask_size * 32;
+  this->env_data.global_pdf_mem_size =
+    this->env_data.global_pdf_size * sizeof(uint32_t);
+
+  this->env_data.particle_pdf_mask_mem_size =
+    single_pdf_mask_size * sizeof(uint32_t);
+  this->env_data.pdf_entries_per_particle = single_pdf_mask_size;
+
+  // Loopcheck
+  uint32_t loopcheck_x;
+  uint32_t loopcheck_y;
+  uint32_t loopcheck_z;
+  cl_uint single_loopcheck_size;
+  cl_uint single_loopcheck_mask_size;
+
+  // Hard Coded, just like in ptx2
+  uint32_t loopcheck_fraction = 5;
+
+  if (this->env_data.loopcheck)
+  {
+    loopcheck_x = (f_data->nx / loopcheck_fraction) +
+      ((f_data->nx %loopcheck_fraction > 0)? 1 : 0);
+    loopcheck_y = (f_data->ny / loopcheck_fraction) +
+      ((f_data->ny %loopcheck_fraction > 0)? 1 : 0);
+    loopcheck_z = (f_data->nz / loopcheck_fraction) +
+      ((f_data->nz %loopcheck_fraction > 0)? 1 : 0);
+
+    this->env_data.lx = loopcheck_x;
+    this->env_data.ly = loopcheck_y;
+    this->env_data.lz = loopcheck_z;
+
+    single_loopcheck_size = loopcheck_x * loopcheck_y * loopcheck_z;
+    single_loopcheck_mask_size = (single_loopcheck_size / 32)  +
+      ((single_loopcheck_size%32 > 0)? 1 : 0);
+
+    this->env_data.loopcheck_dir_size = single_loopcheck_size;
+    this->env_data.loopcheck_location_size = single_loopcheck_mask_size;
+
+    this->env_data.particle_loopcheck_location_mem_size =
+      single_loopcheck_mask_size * sizeof(uint32_t);
+    this->env_data.particle_loopcheck_dir_mem_size =
+      loopcheck_x * loopcheck_y *loopcheck_z * sizeof(float4);
+  }
+  else
+  {
+    this->env_data.lx = 0;
+    this->env_data.ly = 0;
+    this->env_data.lz = 0;
+    this->env_data.particle_loopcheck_location_mem_size = 0;
+    this->env_data.particle_loopcheck_dir_mem_size = 0;
+  }
+}
+
+// TODO @STEVE
+// Right now I've just kluged together AllocateSamples, but really
+// AvailableGPUMem should run more thoroughly and calculate a lot of the vallues
+// currently bneing calculated in AllocateSamples
+//
+uint32_t OclEnv::AvailableGPUMem(
+  const BedpostXData* f_data,
+  const oclptxOptions& ptx_options
+)
+{
+  // ***********************************************
+  //  BPX Sample Parameters + Masks
+  // ***********************************************
+
+  this->SetSampleSizes(f_data);
+
+  cl_uint brain_mem_size = this->env_data.mask_mem_size;
+  cl_ulong single_direction_mem_size = this->env_data.single_sample_mem_size;
+
+  // Direction and f of every fibre, see PackSamples.
+  cl_uint num_samp = 4;
+
+  cl_ulong total_mem_size =
+    num_samp*single_direction_mem_size * this->env_data.bpx_dirs +
+    brain_mem_size*(1 + this->env_data.n_waypts);
+
+  if (this->env_data.exclusion_mask)
+  {
+    printf("Exmask\n");
+    total_mem_size += brain_mem_size;
+  }
+
+  if (this->env_data.terminate_mask)
+  {
+    printf("termimask\n");
+    total_mem_size += brain_mem_size;
+  }
+
+  cl_ulong tile_mem_size = static_cast<cl_ulong>(
+    this->env_data.samples_per_tile) * f_data->nx * f_data->ny * f_data->nz
+    * num_samp * this->env_data.bpx_dirs * sizeof(float);
+
+  // Out of core, a device only holds one brick.
+  if (1 < this->env_data.n_bricks)
+  {
+    uint32_t max_nx = 0;
+    for (uint32_t b = 0; b < this->env_data.n_bricks; b++)
+      max_nx = std::max(max_nx, this->GetBrickInfo(b).nx);
+
+    cl_ulong slab = static_cast<cl_ulong>(max_nx) * f_data->ny * f_data->nz;
+    cl_uint num_masks = 1 + this->env_data.n_waypts
+      + (this->env_data.exclusion_mask ? 1 : 0)
+      + (this->env_data.terminate_mask ? 1 : 0);
+
+    tile_mem_size = slab * f_data->ns * num_samp * this->env_data.bpx_dirs
+      * sizeof(float);
+    total_mem_size = tile_mem_size
+      + num_masks * slab * sizeof(unsigned short int);
+    printf("Resident brick: %u slices, %.4f (MB) of samples\n",
+      max_nx, tile_mem_size/1e6);
+  }
+
+  // A label volume and a table per connectivity matrix.  Labels cover the
+  // whole volume, bricks or not.
+  cl_ulong matrix_table_mem_size =
+    MatrixTableSize(this->env_data.matrix_slots) * sizeof(cl_uint);
+  if (0 < this->env_data.n_matrices)
+  {
+    total_mem_size += this->env_data.n_matrices * (matrix_table_mem_size
+      + static_cast<cl_ulong>(f_data->nx) * f_data->ny * f_data->nz
+        * sizeof(cl_uint));
+    printf("Connectivity matrices: %u of %u slots, %.4f (MB) each\n",
+      this->env_data.n_matrices, this->env_data.matrix_slots,
+      matrix_table_mem_size/1e6);
+  }
+
+  // Seeds to targets: target bits, plus a volume of counts per target.
+  cl_ulong s2t_mem_size = CountsSize() * sizeof(cl_uint);
+  if (0 < this->env_data.n_targets)
+  {
+    total_mem_size += s2t_mem_size
+      + static_cast<cl_ulong>(f_data->nx) * f_data->ny * f_data->nz
+        * sizeof(cl_uint);
+    printf("%s %u %s: %.4f (MB) of counts\n",
+      this->env_data.network ? "Network of" : "Seeds to",
+      this->env_data.n_targets,
+      this->env_data.network ? "seed masks" : "targets",
+      s2t_mem_size/1e6);
+  }
+
+  // ***********************************************
+  //  PDFS
+  // ***********************************************
+
+  this->env_data.total_static_gpu_mem =
+    total_mem_size + this->env_data.global_pdf_mem_size;
+  // --pd sums path lengths in 64 bits, as two volumes like the pdf.
+  if (this->env_data.path_dist)
+    this->env_data.total_static_gpu_mem +=
+      2 * this->env_data.global_pdf_mem_size;
+  // --opathdir sums kPathDirComponents of them, also in 64 bits.
+  if (this->env_data.path_dirs)
+    this->env_data.total_static_gpu_mem +=
+      2 * kPathDirComponents * this->env_data.global_pdf_mem_size;
+
   printf("Voxel Dims (x,y,z): %u, %u, %u\n",
     f_data->nx, f_data->ny, f_data->nz);
   printf("Num Samples: %u\n", f_data->ns);
-  printf("Single Dir Sample Mem Size: %u (B), %.4f (MB), \n",
+  printf("Single Dir Sample Mem Size: %lu (B), %.4f (MB), \n",
   single_direction_mem_size, single_direction_mem_size/1e6);
   printf("Num_directions: %u \n", this->env_data.bpx_dirs);
-  printf("Total GPU Device Memory: %.4f (MB) \n", gl_mem_size/1e6);
-  printf("Total Attempted Use of GPU Device Memory: %.4f (MB) \n",
-    useful_gl_mem_size/1e6);
+  if (1 < this->env_data.sample_tiles)
+    printf("Split into %u tiles of %u samples\n",
+      this->env_data.sample_tiles, this->env_data.samples_per_tile);
   printf("Total Static Data Memory Requirement: %.4f (MB) \n",
     this->env_data.total_static_gpu_mem/1e6);
-  printf("Remaining GPU Device Memory: %.4f (MB) \n",
-    this->env_data.dynamic_mem_left/1e6);
 
-  if (single_direction_mem_size > max_buff_size){
-    printf("ERROR: BPX DATA > MAX BUFFER SIZE: %.4f (MB) vs %.4f (MB)\n",
-      single_direction_mem_size/1e6, max_buff_size/1e6);
-    printf("TERMINATING PROGRAM...\n");
-    exit(EXIT_FAILURE);
-  }
+  // ***********************************************
+  //  Hardware Parameters
+  // ***********************************************
 
-  // Check for OOM before going any further
-  if (this->env_data.dynamic_mem_left < 0)
+  // Every device holds its own copy of the static data, and whatever is left
+  // goes to that device's particles.
+  this->mem_plans.clear();
+  for (uint32_t k = 0; k < this->ocl_queue_devices.size(); k++)
   {
-      printf("Not enough device memory to support static buffers.\n");
+    cl::Device *dev = &(this->ocl_devices.at(this->ocl_queue_devices.at(k)));
+    DeviceMemPlan plan;
+
+    plan.name = dev->getInfo<CL_DEVICE_NAME>();
+    plan.global_mem_size = dev->getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    plan.max_buffer_size = dev->getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+    plan.usable_mem_size =
+      std::floor(plan.global_mem_size * ptx_options.mem_risk_frac.value());
+    plan.dynamic_mem_left =
+      plan.usable_mem_size - this->env_data.total_static_gpu_mem;
+    plan.particle_size = 0;
+    plan.num_wg = 0;
+    plan.particles_per_side = 0;
+
+    if (tile_mem_size > plan.max_buffer_size){
+      printf("ERROR: BPX DATA > %u x MAX BUFFER SIZE ON DEVICE %u (%s): "
+        "%.4f (MB) vs %.4f (MB)\n", kMaxSampleTiles, k, plan.name.c_str(),
+        num_samp * single_direction_mem_size * this->env_data.bpx_dirs/1e6,
+        plan.max_buffer_size/1e6);
+      printf("Rerun with (more) --bricks to track out of core.\n");
+      printf("TERMINATING PROGRAM...\n");
+      exit(EXIT_FAILURE);
+    }
+
+    if (0 < this->env_data.n_matrices
+     && matrix_table_mem_size > plan.max_buffer_size)
+    {
+      printf("--matrixslots %u is too many for device %u (%s), at most "
+        "%.4f (MB) per table.\n", this->env_data.matrix_slots, k,
+        plan.name.c_str(), plan.max_buffer_size/1e6);
+      exit(EXIT_FAILURE);
+    }
+
+    if (s2t_mem_size > plan.max_buffer_size)
+    {
+      printf("Seeds to targets counts need %.4f (MB) in one buffer, device "
+        "%u (%s) allows %.4f (MB).  Rerun with fewer %s.\n",
+        s2t_mem_size/1e6, k, plan.name.c_str(), plan.max_buffer_size/1e6,
+        this->env_data.network ? "seed masks" : "--targetmasks");
+      exit(EXIT_FAILURE);
+    }
+
+    // Check for OOM before going any further
+    if (plan.dynamic_mem_left < 0)
+    {
+      printf("Not enough memory on device %u (%s) to support static "
+        "buffers.  Rerun with (more) --bricks to track out of core.\n",
+        k, plan.name.c_str());
       exit(-1);
+    }
+
+    this->mem_plans.push_back(plan);
+  }
+
+  // Smallest device, for anything not yet planned per device.
+  for (uint32_t k = 0; k < this->mem_plans.size(); k++)
+  {
+    DeviceMemPlan *plan = &(this->mem_plans[k]);
+    if (0 == k || plan->max_buffer_size < this->env_data.max_buffer_size)
+      this->env_data.max_buffer_size = plan->max_buffer_size;
+    if (0 == k || plan->global_mem_size < this->env_data.global_mem_size)
+      this->env_data.global_mem_size = plan->global_mem_size;
+    if (0 == k || plan->dynamic_mem_left < this->env_data.dynamic_mem_left)
+      this->env_data.dynamic_mem_left = plan->dynamic_mem_left;
   }
 
   return 1;
@@ -791,53 +1721,62 @@ void OclEnv::AllocateSamples(
   std::vector<unsigned short int*>* waypoint_masks
 )
 {
-  uint32_t n_dirs = this->env_data.bpx_dirs;
   cl_int ret;
 
-  this->env_data.f_samples_buffers = new cl::Buffer*[2];
-  this->env_data.phi_samples_buffers = new cl::Buffer*[2];
-  this->env_data.theta_samples_buffers = new cl::Buffer*[2];
+  this->PackSamples(f_data, phi_data, theta_data);
 
-  for (uint32_t n = 0; n < 2; n++)
+  if (1 < this->env_data.n_bricks)
   {
-    this->env_data.f_samples_buffers[n] = NULL;
-    this->env_data.phi_samples_buffers[n] = NULL;
-    this->env_data.theta_samples_buffers[n] = NULL;
+    this->AllocateBricks(brain_mask, exclusion_mask, termination_mask,
+      waypoint_masks);
+    this->AllocatePdfs();
+    return;
   }
 
-  for (uint32_t s = 0; s < n_dirs; s++)
+  // Devices working out of host memory (CPUs, integrated GPUs) read the
+  // samples in place rather than from a second copy of every volume.  The
+  // host arrays must then outlive the buffers, which they do: the packed
+  // samples are ours and main() keeps the masks until exit.
+  bool zc = this->env_data.zero_copy;
+  cl_mem_flags read_flags = CL_MEM_READ_ONLY;
+  if (zc)
   {
-    if (this->env_data.aniso_const)
-    {
-      this->env_data.f_samples_buffers[s] = new
-        cl::Buffer(
-          this->ocl_context,
-          CL_MEM_READ_ONLY,
-          this->env_data.single_sample_mem_size,
-          NULL,
-          &ret
-        );
-      if (CL_SUCCESS != ret)
-        die(ret);
-    }
+    read_flags |= CL_MEM_USE_HOST_PTR;
+
+    // The kernel indexes the waypoint masks as one array.
+    this->waypoint_masks_host.clear();
+    for (uint32_t w = 0; w < this->env_data.n_waypts; w++)
+      this->waypoint_masks_host.insert(this->waypoint_masks_host.end(),
+        waypoint_masks->at(w),
+        waypoint_masks->at(w)
+          + this->env_data.mask_mem_size / sizeof(unsigned short int));
+  }
 
-    this->env_data.theta_samples_buffers[s] = new
-      cl::Buffer(
-        this->ocl_context,
-        CL_MEM_READ_ONLY,
-        this->env_data.single_sample_mem_size,
-        NULL,
-        &ret
-      );
-    if (CL_SUCCESS != ret)
-      die(ret);
+  // One buffer per tile.
+  uint32_t spt = this->env_data.samples_per_tile;
+  size_t texels = static_cast<size_t>(this->env_data.nx) * this->env_data.ny
+    * this->env_data.nz * this->env_data.bpx_dirs;
+
+  this->env_data.samples_buffers = new cl::Buffer*[kMaxSampleTiles];
+  for (uint32_t t = 0; t < kMaxSampleTiles; t++)
+    this->env_data.samples_buffers[t] = NULL;
 
-    this->env_data.phi_samples_buffers[s] = new
+  bool images = this->env_data.image_samples;
+  if (images)
+    this->AllocateSampleImages();
+
+  for (uint32_t t = 0; t < this->env_data.sample_tiles && !images; t++)
+  {
+    size_t offset = 4 * static_cast<size_t>(t) * spt * texels;
+    size_t tile_mem_size = std::min(spt, this->env_data.ns - t * spt)
+      * texels * 4 * sizeof(float);
+
+    this->env_data.samples_buffers[t] = new
       cl::Buffer(
         this->ocl_context,
-        CL_MEM_READ_ONLY,
-        this->env_data.single_sample_mem_size,
-        NULL,
+        read_flags,
+        tile_mem_size,
+        zc ? &(this->packed_samples[offset]) : NULL,
         &ret
       );
     if (CL_SUCCESS != ret)
@@ -847,9 +1786,9 @@ void OclEnv::AllocateSamples(
   this->env_data.brain_mask_buffer = new
     cl::Buffer(
       this->ocl_context,
-      CL_MEM_READ_ONLY,
+      read_flags,
       this->env_data.mask_mem_size,
-      NULL,
+      zc ? const_cast<unsigned short int*>(brain_mask) : NULL,
       &ret
     );
   if (CL_SUCCESS != ret)
@@ -860,9 +1799,9 @@ void OclEnv::AllocateSamples(
       this->env_data.exclusion_mask_buffer = new
         cl::Buffer(
           this->ocl_context,
-          CL_MEM_READ_ONLY,
+          read_flags,
           this->env_data.mask_mem_size,
-          NULL,
+          zc ? const_cast<unsigned short int*>(exclusion_mask) : NULL,
           &ret
         );
       if (CL_SUCCESS != ret)
@@ -874,9 +1813,9 @@ void OclEnv::AllocateSamples(
       this->env_data.termination_mask_buffer = new
         cl::Buffer(
           this->ocl_context,
-          CL_MEM_READ_ONLY,
+          read_flags,
           this->env_data.mask_mem_size,
-          NULL,
+          zc ? const_cast<unsigned short int*>(termination_mask) : NULL,
           &ret
         );
       if (CL_SUCCESS != ret)
@@ -888,9 +1827,9 @@ void OclEnv::AllocateSamples(
       this->env_data.waypoint_masks_buffer = new
         cl::Buffer(
           this->ocl_context,
-          CL_MEM_READ_ONLY,
+          read_flags,
           this->env_data.n_waypts * this->env_data.mask_mem_size,
-          NULL,
+          zc ? &(this->waypoint_masks_host[0]) : NULL,
           &ret
         );
       if (CL_SUCCESS != ret)
@@ -899,59 +1838,34 @@ void OclEnv::AllocateSamples(
 
     for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
     {
-      this->device_global_pdf_buffers.push_back(
-        new cl::Buffer(
-          this->ocl_context,
-          CL_MEM_WRITE_ONLY,
-          this->env_data.global_pdf_mem_size,
-          NULL,
-          NULL
-        )
-      );
-    }
-
-    uint32_t *global_init =
-      new uint32_t[this->env_data.global_pdf_size];
-    for (uint32_t j = 0; j < this->env_data.global_pdf_size; j++)
-      global_init[j] = 0;
-
-    for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
-    {
-      for (uint32_t s = 0; s < n_dirs; s++)
+      for (uint32_t t = 0; t < this->env_data.sample_tiles && !zc && !images;
+           t++)
       {
-        if (this->env_data.aniso_const)
-        {
-          ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
-            *(this->env_data.f_samples_buffers[s]),
-            CL_FALSE,
-            static_cast<unsigned int>(0),
-            this->env_data.single_sample_mem_size,
-            f_data->data.at(s),
-            NULL,
-            NULL
-          );
-          if (CL_SUCCESS != ret)
-            die(ret);
-        }
+        size_t offset = 4 * static_cast<size_t>(t) * spt * texels;
+        size_t tile_mem_size = std::min(spt, this->env_data.ns - t * spt)
+          * texels * 4 * sizeof(float);
 
         ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
-          *(this->env_data.theta_samples_buffers[s]),
+          *(this->env_data.samples_buffers[t]),
           CL_FALSE,
           static_cast<unsigned int>(0),
-          this->env_data.single_sample_mem_size,
-          theta_data->data.at(s),
+          tile_mem_size,
+          &(this->packed_samples[offset]),
           NULL,
           NULL
         );
         if (CL_SUCCESS != ret)
           die(ret);
+      }
 
+      if (!zc)
+      {
         ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
-          *(this->env_data.phi_samples_buffers[s]),
+          *(this->env_data.brain_mask_buffer),
           CL_FALSE,
           static_cast<unsigned int>(0),
-          this->env_data.single_sample_mem_size,
-          phi_data->data.at(s),
+          this->env_data.mask_mem_size,
+          const_cast<unsigned short int*>(brain_mask),
           NULL,
           NULL
         );
@@ -959,19 +1873,7 @@ void OclEnv::AllocateSamples(
           die(ret);
       }
 
-      ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
-        *(this->env_data.brain_mask_buffer),
-        CL_FALSE,
-        static_cast<unsigned int>(0),
-        this->env_data.mask_mem_size,
-        const_cast<unsigned short int*>(brain_mask),
-        NULL,
-        NULL
-      );
-      if (CL_SUCCESS != ret)
-        die(ret);
-
-      if (exclusion_mask != NULL)
+      if (exclusion_mask != NULL && !zc)
       {
         ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
           *(this->env_data.exclusion_mask_buffer),
@@ -986,7 +1888,7 @@ void OclEnv::AllocateSamples(
           die(ret);
       }
 
-      if (termination_mask != NULL)
+      if (termination_mask != NULL && !zc)
       {
         ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
           *(this->env_data.termination_mask_buffer),
@@ -1001,7 +1903,7 @@ void OclEnv::AllocateSamples(
           die(ret);
       }
 
-      for (uint32_t w = 0; w < this->env_data.n_waypts; w++)
+      for (uint32_t w = 0; w < this->env_data.n_waypts && !zc; w++)
       {
         printf("w: %u, addr:  %hu\n", w, waypoint_masks->at(w));
         ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
@@ -1017,45 +1919,674 @@ void OclEnv::AllocateSamples(
           die(ret);
       }
 
-      this->ocl_device_queues.at(d).enqueueWriteBuffer(
-        *(this->device_global_pdf_buffers.at(d)),
-        CL_FALSE,
-        static_cast<unsigned int>(0),
-        this->env_data.global_pdf_mem_size,
-        global_init,
+      ret = this->ocl_device_queues.at(d).flush();
+      if (CL_SUCCESS != ret)
+        die(ret);
+    }
+
+    this->AllocatePdfs();
+}
+
+// Direction and f of every fibre as a float4, fibres of a voxel adjacent:
+// [(((s * nx + x) * ny + y) * nz + z) * n_fibres + fibre].  The kernel then
+// reads everything about a voxel in one go, and skips the trigonometry.
+void OclEnv::PackSamples(
+  const BedpostXData* f_data,
+  const BedpostXData* phi_data,
+  const BedpostXData* theta_data
+)
+{
+  uint32_t n_fibers = this->env_data.bpx_dirs;
+  size_t count = static_cast<size_t>(this->env_data.nx) * this->env_data.ny
+    * this->env_data.nz * this->env_data.ns;
+
+  this->packed_samples.resize(4 * count * n_fibers);
+
+  for (uint32_t fib = 0; fib < n_fibers; fib++)
+  {
+    const float *f = f_data ? f_data->data.at(fib) : NULL;
+    const float *theta = theta_data->data.at(fib);
+    const float *phi = phi_data->data.at(fib);
+
+    for (size_t i = 0; i < count; i++)
+    {
+      float *texel = &(this->packed_samples[4 * (i * n_fibers + fib)]);
+      texel[0] = cos(phi[i]) * sin(theta[i]);
+      texel[1] = sin(phi[i]) * sin(theta[i]);
+      texel[2] = cos(theta[i]);
+      texel[3] = f ? f[i] : 0.f;
+    }
+  }
+}
+
+const float* OclEnv::GetPackedSamples()
+{
+  return &(this->packed_samples[0]);
+}
+
+// Samples as RGBA float images, one per tile, texel (z * n_fibres + fibre,
+// y, sample * nx + x).  That is the packed buffer layout, so the images are
+// filled straight from it, which also uploads them to every device.
+void OclEnv::AllocateSampleImages()
+{
+  uint32_t n_fibers = this->env_data.bpx_dirs;
+  size_t texels = static_cast<size_t>(this->env_data.nx) * this->env_data.ny
+    * this->env_data.nz * n_fibers;
+  uint32_t spt = this->env_data.samples_per_tile;
+  cl::ImageFormat format(CL_RGBA, CL_FLOAT);
+  cl_int ret;
+
+  this->env_data.sample_images = new cl::Image3D*[kMaxSampleTiles];
+  for (uint32_t t = 0; t < kMaxSampleTiles; t++)
+    this->env_data.sample_images[t] = NULL;
+
+  for (uint32_t t = 0; t < this->env_data.sample_tiles; t++)
+  {
+    uint32_t tile_samples = std::min(spt, this->env_data.ns - t * spt);
+    size_t offset = 4 * static_cast<size_t>(t) * spt * texels;
+
+    this->env_data.sample_images[t] = new
+      cl::Image3D(
+        this->ocl_context,
+        CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+        format,
+        this->env_data.nz * n_fibers,
+        this->env_data.ny,
+        tile_samples * this->env_data.nx,
+        0,
+        0,
+        &(this->packed_samples[offset]),
+        &ret
+      );
+    if (CL_SUCCESS != ret)
+      die(ret);
+  }
+}
+
+// Zeroed global pdf, one per device.  Waits for every queue, so also
+// completes any sample uploads still in flight.
+void OclEnv::AllocatePdfs()
+{
+  cl_int ret;
+
+  for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
+  {
+    this->device_global_pdf_buffers.push_back(
+      new cl::Buffer(
+        this->ocl_context,
+        CL_MEM_WRITE_ONLY,
+        this->env_data.global_pdf_mem_size,
         NULL,
         NULL
+      )
+    );
+    if (this->env_data.path_dist)
+      this->device_path_dist_buffers.push_back(
+        new cl::Buffer(
+          this->ocl_context,
+          CL_MEM_READ_WRITE,
+          2 * this->env_data.global_pdf_mem_size,
+          NULL,
+          NULL
+        )
       );
+  }
 
-      ret = this->ocl_device_queues.at(d).flush();
+  uint32_t *global_init =
+    new uint32_t[this->env_data.global_pdf_size];
+  for (uint32_t j = 0; j < this->env_data.global_pdf_size; j++)
+    global_init[j] = 0;
+
+  for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
+  {
+    ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
+      *(this->device_global_pdf_buffers.at(d)),
+      CL_FALSE,
+      static_cast<unsigned int>(0),
+      this->env_data.global_pdf_mem_size,
+      global_init,
+      NULL,
+      NULL
+    );
+    if (CL_SUCCESS != ret)
+      die(ret);
+  }
+
+  for (uint32_t d = 0; d < this->device_path_dist_buffers.size(); d++)
+  {
+    for (uint32_t half = 0; half < 2; half++)
+    {
+      ret = this->ocl_device_queues.at(d).enqueueWriteBuffer(
+        *(this->device_path_dist_buffers.at(d)),
+        CL_FALSE,
+        half * this->env_data.global_pdf_mem_size,
+        this->env_data.global_pdf_mem_size,
+        global_init,
+        NULL,
+        NULL
+      );
       if (CL_SUCCESS != ret)
         die(ret);
     }
+  }
 
-    // can maybe move this to oclptxhandler, for slight performance improvement
+  if (this->env_data.path_dirs)
+  {
+    std::vector<cl_int> zeros(2 * kPathDirComponents * this->env_data.nx
+      * this->env_data.ny * this->env_data.nz, 0);
     for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
     {
-      ret = this->ocl_device_queues.at(d).finish();
+      this->device_path_dir_buffers.push_back(new cl::Buffer(
+        this->ocl_context,
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+        zeros.size() * sizeof(cl_int),
+        &zeros[0],
+        &ret));
       if (CL_SUCCESS != ret)
         die(ret);
     }
+  }
+
+  // can maybe move this to oclptxhandler, for slight performance improvement
+  for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
+  {
+    ret = this->ocl_device_queues.at(d).finish();
+    if (CL_SUCCESS != ret)
+      die(ret);
+  }
+
+  delete[] global_init;
 }
 
-void OclEnv::PdfsToFile(std::string filename)
+//
+// Connectivity matrices.  Every voxel gets a label per matrix, 0 for none,
+// else one more than the row and column it stands for.  The kernel finds the
+// rows of a particle's seed voxel and the columns of its end voxel, and counts
+// the pair in that device's table.
+//
+void OclEnv::AllocateMatrices(
+  const std::vector<cl_uint>& seed_voxels,
+  const unsigned short int* target3_mask
+)
 {
-  uint32_t *temp_pdf = new uint32_t[this->env_data.global_pdf_size];
-  uint32_t *total_pdf = new uint32_t[this->env_data.global_pdf_size];
+  if (0 == this->env_data.n_matrices)
+    return;
 
-  for (uint32_t i = 0; i < this->env_data.global_pdf_size; i++)
+  cl_int ret;
+  size_t voxels = static_cast<size_t>(this->env_data.nx) * this->env_data.ny
+    * this->env_data.nz;
+  std::vector<cl_uint> labels(this->env_data.n_matrices * voxels, 0);
+  this->matrix_voxels.assign(this->env_data.n_matrices,
+                             std::vector<cl_uint>());
+
+  uint32_t m = 0;
+  if (this->env_data.matrix1)
+  {
+    cl_uint *seed_labels = &labels[m * voxels];
+    for (size_t i = 0; i < seed_voxels.size(); i++)
+    {
+      cl_uint v = seed_voxels[i];
+      if (v < voxels && 0 == seed_labels[v])
+      {
+        this->matrix_voxels[m].push_back(v);
+        seed_labels[v] = this->matrix_voxels[m].size();
+      }
+    }
+    m++;
+  }
+  if (this->env_data.matrix3)
+  {
+    cl_uint *target3_labels = &labels[m * voxels];
+    for (size_t v = 0; v < voxels; v++)
+    {
+      if (target3_mask[v])
+      {
+        this->matrix_voxels[m].push_back(v);
+        target3_labels[v] = this->matrix_voxels[m].size();
+      }
+    }
+    m++;
+  }
+
+  std::vector<cl_uint> tables(
+    this->env_data.n_matrices * MatrixTableSize(this->env_data.matrix_slots),
+    0);
+  for (m = 0; m < this->env_data.n_matrices; m++)
   {
-    temp_pdf[i] = 0;
-    total_pdf[i] = 0;
+    if (this->matrix_voxels[m].size() > kMaxMatrixLabels)
+    {
+      printf("A connectivity matrix may have at most %u rows, this one "
+        "has %lu.\n", kMaxMatrixLabels, this->matrix_voxels[m].size());
+      exit(EXIT_FAILURE);
+    }
+    printf("Connectivity matrix %u: %lu x %lu\n", m,
+      this->matrix_voxels[m].size(), this->matrix_voxels[m].size());
+    tables[m * MatrixTableSize(this->env_data.matrix_slots) + kMatrixColumns]
+      = this->matrix_voxels[m].size();
   }
 
+  this->env_data.matrix_labels_buffer = new cl::Buffer(
+    this->ocl_context,
+    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    labels.size() * sizeof(cl_uint),
+    &labels[0],
+    &ret);
+  if (CL_SUCCESS != ret)
+    die(ret);
+
   for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
+  {
+    this->device_matrix_buffers.push_back(new cl::Buffer(
+      this->ocl_context,
+      CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+      tables.size() * sizeof(cl_uint),
+      &tables[0],
+      &ret));
+    if (CL_SUCCESS != ret)
+      die(ret);
+  }
+}
+
+//
+// Seeds to targets.  Particles collect the bits of the voxels they cross, and
+// count once per target at their seed voxel when they finish.  In network
+// mode the targets are the seed masks, and the counts are the matrix between
+// them followed by a path distribution per seed mask.
+//
+size_t OclEnv::CountsSize()
+{
+  size_t voxels = static_cast<size_t>(this->env_data.nx) * this->env_data.ny
+    * this->env_data.nz;
+  size_t n = this->env_data.n_targets;
+  if (this->env_data.network)
+    return n * n + n * voxels;
+  return n * voxels;
+}
+
+void OclEnv::AllocateTargets(const cl_uint* target_bits)
+{
+  cl_int ret;
+  size_t voxels = static_cast<size_t>(this->env_data.nx) * this->env_data.ny
+    * this->env_data.nz;
+
+  this->env_data.target_masks_buffer = new cl::Buffer(
+    this->ocl_context,
+    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    voxels * sizeof(cl_uint),
+    const_cast<cl_uint*>(target_bits),
+    &ret);
+  if (CL_SUCCESS != ret)
+    die(ret);
+
+  std::vector<cl_uint> zeros(CountsSize(), 0);
+  for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
+  {
+    this->device_s2t_buffers.push_back(new cl::Buffer(
+      this->ocl_context,
+      CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+      zeros.size() * sizeof(cl_uint),
+      &zeros[0],
+      &ret));
+    if (CL_SUCCESS != ret)
+      die(ret);
+  }
+}
+
+void OclEnv::ReadSeedsToTargets(std::vector<uint32_t>* counts)
+{
+  size_t size = CountsSize();
+  std::vector<uint32_t> device_counts(size);
+
+  counts->assign(size, 0);
+  for (uint32_t d = 0; d < this->device_s2t_buffers.size(); d++)
+  {
+    cl_int ret = this->ocl_device_queues.at(d).enqueueReadBuffer(
+      *(this->device_s2t_buffers.at(d)),
+      CL_TRUE,
+      0,
+      size * sizeof(uint32_t),
+      &device_counts[0]);
+    if (CL_SUCCESS != ret)
+      die(ret);
+
+    for (size_t i = 0; i < size; i++)
+      (*counts)[i] += device_counts[i];
+  }
+}
+
+//
+// Out-of-core tracking.  Each device gets buffers for one brick plus halo,
+// filled from the host copies on demand.
+//
+BrickInfo OclEnv::GetBrickInfo(uint32_t brick)
+{
+  // Lookups reach at most one vertex past a particle, plus one step (checked
+  // to be under a voxel in ProcessOptions).
+  const uint32_t kHalo = 2;
+  BrickInfo info;
+
+  info.width = this->env_data.brick_width;
+  info.first_x = brick * info.width;
+  info.last_x = std::min(info.first_x + info.width, this->env_data.nx);
+  info.base_x = (info.first_x > kHalo) ? info.first_x - kHalo : 0;
+  info.nx = std::min(info.last_x + kHalo, this->env_data.nx) - info.base_x;
+
+  return info;
+}
+
+void OclEnv::AllocateBricks(
+  const unsigned short int* brain_mask,
+  const unsigned short int* exclusion_mask,
+  const unsigned short int* termination_mask,
+  std::vector<unsigned short int*>* waypoint_masks
+)
+{
+  cl_int ret;
+
+  this->brick_brain_mask = brain_mask;
+  this->brick_exclusion_mask = exclusion_mask;
+  this->brick_termination_mask = termination_mask;
+  this->brick_waypoint_masks = waypoint_masks;
+
+  // Size for the widest brick.
+  uint32_t max_nx = 0;
+  for (uint32_t b = 0; b < this->env_data.n_bricks; b++)
+    max_nx = std::max(max_nx, this->GetBrickInfo(b).nx);
+
+  size_t voxels = static_cast<size_t>(max_nx)
+                * this->env_data.ny * this->env_data.nz;
+  size_t sample_size = voxels * this->env_data.ns * this->env_data.bpx_dirs
+                     * 4 * sizeof(float);
+  size_t mask_size = voxels * sizeof(unsigned short int);
+
+  for (uint32_t d = 0; d < this->ocl_device_queues.size(); d++)
+  {
+    BrickBuffers bufs;
+    bufs.waypoint_masks = NULL;
+    bufs.termination_mask = NULL;
+    bufs.exclusion_mask = NULL;
+    bufs.resident = -1;
+
+    bufs.samples = new cl::Buffer(
+      this->ocl_context, CL_MEM_READ_ONLY, sample_size, NULL, &ret);
+    if (CL_SUCCESS != ret)
+      die(ret);
+
+    bufs.brain_mask = new cl::Buffer(
+      this->ocl_context, CL_MEM_READ_ONLY, mask_size, NULL, &ret);
+    if (CL_SUCCESS != ret)
+      die(ret);
+
+    if (0 < this->env_data.n_waypts)
+    {
+      bufs.waypoint_masks = new cl::Buffer(
+        this->ocl_context, CL_MEM_READ_ONLY,
+        this->env_data.n_waypts * mask_size, NULL, &ret);
+      if (CL_SUCCESS != ret)
+        die(ret);
+    }
+
+    if (NULL != termination_mask)
+    {
+      bufs.termination_mask = new cl::Buffer(
+        this->ocl_context, CL_MEM_READ_ONLY, mask_size, NULL, &ret);
+      if (CL_SUCCESS != ret)
+        die(ret);
+    }
+
+    if (NULL != exclusion_mask)
+    {
+      bufs.exclusion_mask = new cl::Buffer(
+        this->ocl_context, CL_MEM_READ_ONLY, mask_size, NULL, &ret);
+      if (CL_SUCCESS != ret)
+        die(ret);
+    }
+
+    this->brick_buffers.push_back(bufs);
+  }
+}
+
+BrickBuffers * OclEnv::GetBrickBuffers(uint32_t device_num)
+{
+  return &(this->brick_buffers.at(device_num));
+}
+
+BrickInfo OclEnv::LoadBrick(uint32_t device, uint32_t brick)
+{
+  cl_int ret;
+  BrickInfo info = this->GetBrickInfo(brick);
+  BrickBuffers *bufs = &(this->brick_buffers.at(device));
+  cl::CommandQueue *cq = &(this->ocl_device_queues.at(device));
+
+  if (bufs->resident == static_cast<int>(brick))
+    return info;
+
+  size_t plane = static_cast<size_t>(this->env_data.ny) * this->env_data.nz;
+  size_t volume = plane * this->env_data.nx;
+  size_t slab = plane * info.nx;
+
+  // Samples are stored sample by sample, so the slab is one row per sample.
+  size_t texel_size = this->env_data.bpx_dirs * 4 * sizeof(float);
+  cl::size_t<3> buffer_origin;
+  cl::size_t<3> host_origin;
+  cl::size_t<3> region;
+  buffer_origin[0] = 0;
+  buffer_origin[1] = 0;
+  buffer_origin[2] = 0;
+  host_origin[0] = info.base_x * plane * texel_size;
+  host_origin[1] = 0;
+  host_origin[2] = 0;
+  region[0] = slab * texel_size;
+  region[1] = this->env_data.ns;
+  region[2] = 1;
+
+  ret = cq->enqueueWriteBufferRect(
+    *(bufs->samples),
+    CL_FALSE,
+    buffer_origin,
+    host_origin,
+    region,
+    slab * texel_size,
+    0,
+    volume * texel_size,
+    0,
+    &(this->packed_samples[0]),
+    NULL,
+    NULL
+  );
+  if (CL_SUCCESS != ret)
+    die(ret);
+
+  // Masks are a single volume, so the slab is contiguous.
+  const unsigned short int *masks[3] = {
+    this->brick_brain_mask,
+    this->brick_termination_mask,
+    this->brick_exclusion_mask};
+  cl::Buffer *mask_bufs[3] = {
+    bufs->brain_mask, bufs->termination_mask, bufs->exclusion_mask};
+
+  for (int i = 0; i < 3; i++)
+  {
+    if (NULL == masks[i])
+      continue;
+
+    ret = cq->enqueueWriteBuffer(
+      *(mask_bufs[i]),
+      CL_FALSE,
+      0,
+      slab * sizeof(unsigned short int),
+      const_cast<unsigned short int*>(masks[i]) + info.base_x * plane,
+      NULL,
+      NULL
+    );
+    if (CL_SUCCESS != ret)
+      die(ret);
+  }
+
+  // The kernel indexes waypoint masks with the resident volume as stride.
+  for (uint32_t w = 0; w < this->env_data.n_waypts; w++)
+  {
+    ret = cq->enqueueWriteBuffer(
+      *(bufs->waypoint_masks),
+      CL_FALSE,
+      w * slab * sizeof(unsigned short int),
+      slab * sizeof(unsigned short int),
+      this->brick_waypoint_masks->at(w) + info.base_x * plane,
+      NULL,
+      NULL
+    );
+    if (CL_SUCCESS != ret)
+      die(ret);
+  }
+
+  ret = cq->finish();
+  if (CL_SUCCESS != ret)
+    die(ret);
+
+  bufs->resident = brick;
+  return info;
+}
+
+void OclEnv::PrintMemPlans()
+{
+  printf("Device memory plan (MB):\n");
+  printf("  %-3s %-24s %10s %10s %10s %10s %9s %7s %10s\n",
+    "#", "device", "global", "usable", "static", "particles",
+    "B/ptcl", "groups", "ptcl/side");
+  for (uint32_t k = 0; k < this->mem_plans.size(); k++)
+  {
+    DeviceMemPlan *plan = &(this->mem_plans[k]);
+    // Both sides of the double buffer.
+    size_t particle_mem = 2 * plan->particles_per_side * plan->particle_size;
+
+    printf("  %-3u %-24.24s %10.1f %10.1f %10.1f %10.1f %9lu %7i %10i\n",
+      k, plan->name.c_str(),
+      plan->global_mem_size/1e6,
+      plan->usable_mem_size/1e6,
+      this->env_data.total_static_gpu_mem/1e6,
+      particle_mem/1e6,
+      plan->particle_size,
+      plan->num_wg,
+      plan->particles_per_side);
+  }
+}
+
+// On the first queue's device, or on the host without one (--cpu).
+void OclEnv::TransformSeeds(const SeedTransform& xfm, float *xyz, int count)
+{
+  if (this->ocl_device_queues.empty() || 0 == count)
+  {
+    xfm.Apply(xyz, count);
+    return;
+  }
+
+  cl_int err;
+  if (!this->transform_built)
+  {
+    std::string source = std::string("oclkernels") + slash + "transform.cl";
+    err = this->BuildProgram(source, "-I ./oclkernels",
+      &this->transform_program);
+    if (err != CL_SUCCESS)
+    {
+      std::cout<<"ERROR: " <<
+        " ( " << this->OclErrorStrings(err) << ")\n";
+
+      std::vector<cl::Device>::iterator dit = this->ocl_devices.begin();
+
+      std::cout<<"BUILD LOG: \n" <<
+        this->transform_program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(*dit)
+        <<"\n";
+
+      exit(EXIT_FAILURE);
+    }
+    this->transform_built = true;
+  }
+
+  std::vector<cl_float4> points(count);
+  for (int n = 0; n < count; n++)
+  {
+    points[n].s[0] = xyz[3*n];
+    points[n].s[1] = xyz[3*n+1];
+    points[n].s[2] = xyz[3*n+2];
+    points[n].s[3] = 0.;
+  }
+
+  cl::CommandQueue *cq = &this->ocl_device_queues.at(0);
+  cl::Buffer seeds(this->ocl_context,
+                   CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+                   count * sizeof(cl_float4),
+                   &points[0],
+                   &err);
+  if (CL_SUCCESS != err)
+    die(err);
+
+  cl::Buffer field;
+  cl::Kernel kernel;
+  if (xfm.is_warp())
+  {
+    field = cl::Buffer(this->ocl_context,
+                       CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                       xfm.field().size() * sizeof(cl_float4),
+                       const_cast<cl_float4*>(&xfm.field()[0]),
+                       &err);
+    if (CL_SUCCESS != err)
+      die(err);
+    kernel = cl::Kernel(this->transform_program, "WarpSeeds", &err);
+    if (CL_SUCCESS != err)
+      die(err);
+    kernel.setArg(2, field);
+    kernel.setArg(3, xfm.seed_size());
+    kernel.setArg(4, xfm.seed_dims());
+    kernel.setArg(5, xfm.dti_dims());
+  }
+  else
+  {
+    kernel = cl::Kernel(this->transform_program, "AffineSeeds", &err);
+    if (CL_SUCCESS != err)
+      die(err);
+    kernel.setArg(2, xfm.affine_rows()[0]);
+    kernel.setArg(3, xfm.affine_rows()[1]);
+    kernel.setArg(4, xfm.affine_rows()[2]);
+  }
+  kernel.setArg(0, seeds);
+  kernel.setArg(1, static_cast<cl_uint>(count));
+
+  err = cq->enqueueNDRangeKernel(kernel,
+                                 cl::NullRange,
+                                 cl::NDRange(count),
+                                 cl::NullRange);
+  if (CL_SUCCESS != err)
+    die(err);
+  err = cq->enqueueReadBuffer(seeds,
+                              CL_TRUE,
+                              0,
+                              count * sizeof(cl_float4),
+                              &points[0]);
+  if (CL_SUCCESS != err)
+    die(err);
+
+  for (int n = 0; n < count; n++)
+  {
+    xyz[3*n] = points[n].s[0];
+    xyz[3*n+1] = points[n].s[1];
+    xyz[3*n+2] = points[n].s[2];
+  }
+}
+
+// Sums a volume over every device's copy.
+void OclEnv::SumDeviceVolumes(
+  const std::vector<cl::Buffer*>& buffers,
+  uint32_t* total)
+{
+  uint32_t *temp_pdf = new uint32_t[this->env_data.global_pdf_size];
+
+  for (uint32_t i = 0; i < this->env_data.global_pdf_size; i++)
+    total[i] = 0;
+
+  for (uint32_t d = 0; d < buffers.size(); d++)
   {
     this->ocl_device_queues.at(d).enqueueReadBuffer(
-      *(this->device_global_pdf_buffers.at(d)),
+      *(buffers.at(d)),
       CL_TRUE,
       static_cast<unsigned int>(0),
       this->env_data.global_pdf_mem_size,
@@ -1063,30 +2594,38 @@ void OclEnv::PdfsToFile(std::string filename)
     );
     for (uint32_t i = 0; i < this->env_data.global_pdf_size; i++)
     {
-      total_pdf[i] += temp_pdf[i];
+      total[i] += temp_pdf[i];
     }
   }
 
-  //
-  // now write to file
-  //
+  delete[] temp_pdf;
+}
 
+// Text, a row per (y, z) with x across, as the pdf has always been written.
+template <typename T>
+static void VolumeToFile(
+  const std::string& filename,
+  uint32_t nx,
+  uint32_t ny,
+  uint32_t nz,
+  const T* volume,
+  const char* format)
+{
   FILE * pdf_file;
   pdf_file = fopen(filename.c_str(), "wb");
 
   uint32_t index = 0;
 
-  for (uint32_t k = 0; k < this->env_data.nz; k++)
+  for (uint32_t k = 0; k < nz; k++)
   {
-    for (uint32_t j = 0; j < this->env_data.ny; j++)
+    for (uint32_t j = 0; j < ny; j++)
     {
-      for (uint32_t i = 0; i < this->env_data.nx; i++)
+      for (uint32_t i = 0; i < nx; i++)
       {
-        index =
-          i*(this->env_data.ny*this->env_data.nz) + j*(this->env_data.nz) + k;
-        fprintf(pdf_file, "%u", total_pdf[index]);
+        index = i*(ny*nz) + j*(nz) + k;
+        fprintf(pdf_file, format, volume[index]);
 
-        if (i < this->env_data.nx - 1)
+        if (i < nx - 1)
           fprintf(pdf_file, " ");
       }
       fprintf(pdf_file, "\n");
@@ -1094,9 +2633,241 @@ void OclEnv::PdfsToFile(std::string filename)
   }
 
   fclose(pdf_file);
+}
+
+void OclEnv::SumPdfs(const uint32_t *host_pdf, uint32_t *total)
+{
+  SumDeviceVolumes(this->device_global_pdf_buffers, total);
+
+  if (NULL != host_pdf)
+  {
+    for (uint32_t i = 0; i < this->env_data.global_pdf_size; i++)
+      total[i] += host_pdf[i];
+  }
+}
+
+void OclEnv::PdfsToFile(std::string filename, const uint32_t *host_pdf)
+{
+  uint32_t *total_pdf = new uint32_t[this->env_data.global_pdf_size];
+
+  SumPdfs(host_pdf, total_pdf);
+  VolumeToFile(filename, this->env_data.nx, this->env_data.ny,
+    this->env_data.nz, total_pdf, "%u");
+
+  delete[] total_pdf;
+}
+
+// Pulls every seed space voxel through the seed transform and takes the
+// nearest diffusion space voxel, zero outside the brain mask grid.
+void OclEnv::SeedSpacePdfToFile(
+  std::string filename,
+  const SeedTransform& xfm,
+  const uint32_t *host_pdf)
+{
+  cl_uint4 size = xfm.seed_size();
+  size_t voxels = static_cast<size_t>(size.s[0]) * size.s[1] * size.s[2];
+  std::vector<float> xyz(3 * voxels);
+  std::vector<uint32_t> resampled(voxels, 0);
+  uint32_t *total_pdf = new uint32_t[this->env_data.global_pdf_size];
+
+  for (cl_uint x = 0; x < size.s[0]; x++)
+    for (cl_uint y = 0; y < size.s[1]; y++)
+      for (cl_uint z = 0; z < size.s[2]; z++)
+      {
+        size_t i = (x * size.s[1] + y) * size.s[2] + z;
+        xyz[3*i] = x;
+        xyz[3*i+1] = y;
+        xyz[3*i+2] = z;
+      }
+  TransformSeeds(xfm, &xyz[0], static_cast<int>(voxels));
+
+  SumPdfs(host_pdf, total_pdf);
+  for (size_t i = 0; i < voxels; i++)
+  {
+    int x = static_cast<int>(floor(xyz[3*i] + .5));
+    int y = static_cast<int>(floor(xyz[3*i+1] + .5));
+    int z = static_cast<int>(floor(xyz[3*i+2] + .5));
+    if (x < 0 || y < 0 || z < 0
+     || x >= static_cast<int>(this->env_data.nx)
+     || y >= static_cast<int>(this->env_data.ny)
+     || z >= static_cast<int>(this->env_data.nz))
+      continue;
+    resampled[i] = total_pdf[
+      (x * this->env_data.ny + y) * this->env_data.nz + z];
+  }
+  VolumeToFile(filename, size.s[0], size.s[1], size.s[2], &resampled[0],
+    "%u");
 
-  delete[] temp_pdf;
   delete[] total_pdf;
 }
 
+// The kernel sums steps, from the seed to where each path first entered the
+// voxel, as 32-bit low words followed by a volume of carries.
+void OclEnv::PathDistToFile(
+  std::string pd_filename,
+  std::string length_filename)
+{
+  uint32_t voxels = this->env_data.nx * this->env_data.ny * this->env_data.nz;
+  uint32_t *total_pdf = new uint32_t[this->env_data.global_pdf_size];
+  uint32_t *device_sums = new uint32_t[2 * this->env_data.global_pdf_size];
+  std::vector<uint64_t> total_steps(voxels, 0);
+  double *path_dist = new double[voxels];
+
+  SumDeviceVolumes(this->device_global_pdf_buffers, total_pdf);
+  for (uint32_t d = 0; d < this->device_path_dist_buffers.size(); d++)
+  {
+    this->ocl_device_queues.at(d).enqueueReadBuffer(
+      *(this->device_path_dist_buffers.at(d)),
+      CL_TRUE,
+      static_cast<unsigned int>(0),
+      2 * this->env_data.global_pdf_mem_size,
+      device_sums
+    );
+    for (uint32_t i = 0; i < voxels; i++)
+      total_steps[i] += device_sums[i]
+                      + (static_cast<uint64_t>(device_sums[voxels + i]) << 32);
+  }
+
+  // In mm.
+  for (uint32_t i = 0; i < voxels; i++)
+    path_dist[i] = total_steps[i] * static_cast<double>(this->step_length);
+  VolumeToFile(pd_filename, this->env_data.nx, this->env_data.ny,
+    this->env_data.nz, path_dist, "%g");
+
+  // Mean mm from the seed, over the paths through each voxel.
+  for (uint32_t i = 0; i < voxels; i++)
+    path_dist[i] = total_pdf[i] ? path_dist[i] / total_pdf[i] : 0.;
+  VolumeToFile(length_filename, this->env_data.nx, this->env_data.ny,
+    this->env_data.nz, path_dist, "%g");
+
+  delete[] total_pdf;
+  delete[] device_sums;
+  delete[] path_dist;
+}
+
+// Fixed point, so only the ratios between components mean anything.  Each
+// device sums in 64 bits, as 32-bit low words followed by the high words.
+void OclEnv::ReadPathDirs(std::vector<float>* tensors)
+{
+  size_t size = static_cast<size_t>(kPathDirComponents) * this->env_data.nx
+    * this->env_data.ny * this->env_data.nz;
+  std::vector<cl_uint> device_sums(2 * size);
+  std::vector<int64_t> total(size, 0);
+
+  for (uint32_t d = 0; d < this->device_path_dir_buffers.size(); d++)
+  {
+    cl_int ret = this->ocl_device_queues.at(d).enqueueReadBuffer(
+      *(this->device_path_dir_buffers.at(d)),
+      CL_TRUE,
+      0,
+      2 * size * sizeof(cl_uint),
+      &device_sums[0]);
+    if (CL_SUCCESS != ret)
+      die(ret);
+
+    for (size_t i = 0; i < size; i++)
+      total[i] += static_cast<int64_t>(device_sums[i]
+                + (static_cast<uint64_t>(device_sums[size + i]) << 32));
+  }
+
+  tensors->resize(size);
+  for (size_t i = 0; i < size; i++)
+    (*tensors)[i] = total[i];
+}
+
+// Sparse and row-major: rows and columns (uint32), entries (uint64), then an
+// entry per non-zero as (row, column, count), all uint32.
+void OclEnv::MatricesToFile()
+{
+  size_t table_size = MatrixTableSize(this->env_data.matrix_slots);
+  std::vector<cl_uint> table(table_size);
+
+  uint32_t m = 0;
+  for (int matrix = 1; matrix <= 3; matrix += 2)
+  {
+    if ((1 == matrix && !this->env_data.matrix1)
+     || (3 == matrix && !this->env_data.matrix3))
+      continue;
+
+    // Key - 1 is row * n + column, so sorting by key sorts by row.
+    std::vector<std::pair<cl_uint, cl_uint> > entries;
+    cl_ulong dropped = 0;
+    for (uint32_t d = 0; d < this->device_matrix_buffers.size(); d++)
+    {
+      cl_int ret = this->ocl_device_queues.at(d).enqueueReadBuffer(
+        *(this->device_matrix_buffers.at(d)),
+        CL_TRUE,
+        m * table_size * sizeof(cl_uint),
+        table_size * sizeof(cl_uint),
+        &table[0]);
+      if (CL_SUCCESS != ret)
+        die(ret);
+
+      dropped += table[kMatrixDropped];
+      const cl_uint *keys = &table[kMatrixHeader];
+      const cl_uint *counts = keys + this->env_data.matrix_slots;
+      for (uint32_t i = 0; i < this->env_data.matrix_slots; i++)
+        if (keys[i])
+          entries.push_back(std::make_pair(keys[i] - 1, counts[i]));
+    }
+    std::sort(entries.begin(), entries.end());
+
+    // Devices hold the same entries in tables of their own.
+    size_t nonzero = 0;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+      if (0 < nonzero && entries[nonzero - 1].first == entries[i].first)
+        entries[nonzero - 1].second += entries[i].second;
+      else
+        entries[nonzero++] = entries[i];
+    }
+    entries.resize(nonzero);
+
+    const std::vector<cl_uint>& voxels = this->matrix_voxels[m];
+    cl_uint n = voxels.size();
+    cl_ulong n_entries = entries.size();
+
+    char filename[64];
+    snprintf(filename, 64, "fdt_matrix%i.bin", matrix);
+    FILE *matrix_file = fopen(filename, "wb");
+    if (NULL == matrix_file)
+    {
+      perror("Couldn't open matrix file");
+      exit(EXIT_FAILURE);
+    }
+    fwrite(&n, sizeof(n), 1, matrix_file);
+    fwrite(&n, sizeof(n), 1, matrix_file);
+    fwrite(&n_entries, sizeof(n_entries), 1, matrix_file);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+      cl_uint entry[3] = {entries[i].first / n,
+                          entries[i].first % n,
+                          entries[i].second};
+      fwrite(entry, sizeof(cl_uint), 3, matrix_file);
+    }
+    fclose(matrix_file);
+
+    snprintf(filename, 64, "coords_for_fdt_matrix%i", matrix);
+    FILE *coords_file = fopen(filename, "w");
+    if (NULL == coords_file)
+    {
+      perror("Couldn't open matrix coordinates file");
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < voxels.size(); i++)
+    {
+      cl_uint yz = this->env_data.ny * this->env_data.nz;
+      fprintf(coords_file, "%u %u %u\n", voxels[i] / yz,
+        voxels[i] % yz / this->env_data.nz, voxels[i] % this->env_data.nz);
+    }
+    fclose(coords_file);
+
+    printf("Matrix%i: %lu non-zero of %u x %u\n", matrix, n_entries, n, n);
+    if (0 < dropped)
+      printf("Matrix%i: %lu streamlines found no free slot and were not "
+        "counted.  Rerun with a larger --matrixslots.\n", matrix, dropped);
+    m++;
+  }
+}
+
 //EOF
@@ -45,6 +45,7 @@
 
 #include "customtypes.h"
 #include "oclptxOptions.h"
+#include "seedtransform.h"
 
 class OclEnv{
 
@@ -73,6 +74,16 @@ class OclEnv{
     EnvironmentData * GetEnvData();
 
     cl::Buffer *GetDevicePdf(uint32_t device_num);
+    // NULL without --pd.
+    cl::Buffer *GetDevicePathDist(uint32_t device_num);
+    // NULL without --opathdir.
+    cl::Buffer *GetDevicePathDirs(uint32_t device_num);
+    // NULL without --omatrix1 or --omatrix3.
+    cl::Buffer *GetDeviceMatrices(uint32_t device_num);
+    // NULL without --os2t or --network.
+    cl::Buffer *GetDeviceSeedsToTargets(uint32_t device_num);
+    DeviceMemPlan *GetMemPlan(uint32_t device_num);
+    BrickBuffers *GetBrickBuffers(uint32_t device_num);
     // TODO:
     // not sure if better to generate new cl::kernel  object for
     // every oclptxhandler object, or if can just point to this->kernels
@@ -93,20 +104,54 @@ class OclEnv{
 
     std::string OclErrorStrings(cl_int error);
 
+    // Work-group size for the interpolation kernel on a queue's device.
     size_t GetKernelWorkGroupInfo(uint32_t device);
+    // Upper bound on work-groups per launch, or 0 to size from memory alone.
+    uint32_t GetMaxWorkGroups(uint32_t device);
+    // Work-group sizes should be a multiple of this.
+    size_t GetWorkGroupMultiple(uint32_t device);
+    // CPU devices and integrated GPUs share host memory.
+    bool IsHostMemoryDevice(uint32_t device);
+
+    // Names a queue's device, driver and the kernels built for it, plus
+    // whatever the caller adds, for settings kept across runs.
+    std::string ProfileKey(uint32_t device, const std::string& extra);
+    // Empty if caching is disabled.
+    std::string GetCacheDir();
 
     //
     // Resource Allocation
     //
 
-    uint32_t AvailableGPUMem(
-      const BedpostXData* f_data,
+    // Fills in everything CreateKernels() needs.  Only depends on the
+    // options and on what is on disk, so may run before samples are loaded.
+    void ProcessOptions(
       const oclptxOptions& ptx_options,
+      uint32_t n_fibers,
       uint32_t n_waypoints,
-      const unsigned short int* exclusion_mask,
-      const unsigned short int* termination_mask
+      uint32_t n_targets,
+      const SampleGeometry& geometry
+    );
+
+    // Volume, pdf and loopcheck sizes.  Needs no device.
+    void SetSampleSizes(const BedpostXData* f_data);
+
+    // Plans each queue's device memory.  Exits if a device cannot even hold
+    // the samples.
+    uint32_t AvailableGPUMem(
+      const BedpostXData* f_data,
+      const oclptxOptions& ptx_options
     );
+    // Table of the plans, once the handlers have sized themselves.
+    void PrintMemPlans();
+
+    // Out-of-core tracking (--bricks).  Uploads a brick to a device's
+    // BrickBuffers unless it is already there.
+    BrickInfo GetBrickInfo(uint32_t brick);
+    BrickInfo LoadBrick(uint32_t device, uint32_t brick);
 
+    // Packs the samples (PackSamples) and puts them, and the masks, on every
+    // device.
     void AllocateSamples(
       const BedpostXData* f_data,
       const BedpostXData* phi_data,
@@ -117,14 +162,87 @@ class OclEnv{
       std::vector<unsigned short int*>* waypoint_masks
     );
 
+    // Direction and f of every fibre tracked, as the kernels read them.
+    // Needs SetSampleSizes().  The CPU engine reads the same copy.
+    void PackSamples(
+      const BedpostXData* f_data,
+      const BedpostXData* phi_data,
+      const BedpostXData* theta_data
+    );
+    const float* GetPackedSamples();
+
+    // Labels for --omatrix1 (distinct seed voxels, in seed file order) and
+    // --omatrix3 (target3 voxels), and an empty table per device.
+    void AllocateMatrices(
+      const std::vector<cl_uint>& seed_voxels,
+      const unsigned short int* target3_mask
+    );
+
     //
     // Processing
     //
 
-    void PdfsToFile(std::string filename);
-    //void ProcessOptions( oclptxOptions* options);
+    // Target bits as SampleManager::GetTargetBitsToArray() packs them, and
+    // zeroed counts on every device.
+    void AllocateTargets(const cl_uint* target_bits);
+    // Sums every device's seeds to targets counts, a volume per target, or
+    // in network mode the layout SampleManager::WriteNetwork() expects.
+    void ReadSeedsToTargets(std::vector<uint32_t>* counts);
+
+    // Sums the device pdfs, plus host_pdf (global_pdf_size entries) if
+    // given, and writes the result.
+    void PdfsToFile(std::string filename, const uint32_t *host_pdf = NULL);
+    // --xfm: the same sum, resampled onto the --seedref grid.
+    void SeedSpacePdfToFile(
+      std::string filename,
+      const SeedTransform& xfm,
+      const uint32_t *host_pdf = NULL
+    );
+    // --pd: the pdf weighted by path length, and the mean distance along
+    // the paths from the seed to each voxel, both in mm.  Needs
+    // RunSumKernel() first.
+    void PathDistToFile(std::string pd_filename, std::string length_filename);
+    // --opathdir: the summed direction tensors of every device, as
+    // kPathDirComponents volumes (xx, xy, xz, yy, yz, zz) of x*ny*nz +
+    // y*nz + z.
+    void ReadPathDirs(std::vector<float>* tensors);
+    // Sums the device tables into fdt_matrix1.bin and/or fdt_matrix3.bin,
+    // with the voxel of every row in coords_for_fdt_matrix1/3.
+    void MatricesToFile();
+
+    // --xfm: count (x, y, z) seed voxels to diffusion voxels, in place, on
+    // the first device.  Falls back to SeedTransform::Apply() before
+    // NewCLCommandQueues() and with --cpu.
+    void TransformSeeds(const SeedTransform& xfm, float *xyz, int count);
 
   private:
+    // Build a program for all devices, going through the binary cache in
+    // kernel_cache_dir when possible.
+    cl_int BuildProgram(
+      const std::string& source_file,
+      const std::string& define_list,
+      cl::Program *program
+    );
+    std::string CacheKey(const std::string& define_list);
+    // Entries in each device's seeds to targets buffer.
+    size_t CountsSize();
+    // Sets env_data.sample_tiles and samples_per_tile.
+    void PlanSampleTiles();
+    void AllocatePdfs();
+    // Device pdfs plus host_pdf, if given.
+    void SumPdfs(const uint32_t *host_pdf, uint32_t *total);
+    void SumDeviceVolumes(
+      const std::vector<cl::Buffer*>& buffers,
+      uint32_t* total
+    );
+    void AllocateSampleImages();
+    void AllocateBricks(
+      const unsigned short int* brain_mask,
+      const unsigned short int* exclusion_mask,
+      const unsigned short int* termination_mask,
+      std::vector<unsigned short int*>* waypoint_masks
+    );
+
     //
     // OpenCL Objects
     //
@@ -135,17 +253,64 @@ class OclEnv{
     std::vector<cl::Device> ocl_devices;
     
     std::vector<cl::CommandQueue> ocl_device_queues;
+    // Index into ocl_devices of each queue's device.
+    std::vector<uint32_t> ocl_queue_devices;
     //std::vector<MutexWrapper> ocl_device_queue_mutexs;
 
     std::vector<cl::Kernel> ocl_kernel_set;
     std::vector<cl::Kernel> sum_kernel_set;
     //Every compiled kernel is stored here.
+    // oclkernels/transform.cl, built on first use.
+    cl::Program transform_program;
+    bool transform_built;
 
     std::string ocl_routine_name;
 
+    cl_device_type device_type;
+    // Concatenated waypoint masks, kept for CL_MEM_USE_HOST_PTR.
+    std::vector<unsigned short int> waypoint_masks_host;
+    // See PackSamples.  Kept for CL_MEM_USE_HOST_PTR and for bricks.
+    std::vector<float> packed_samples;
+
+    // Empty if binary caching is disabled.
+    std::string kernel_cache_dir;
+    // Options the interpolation kernel was last built with.
+    std::string build_options;
+
+    // Run constants baked into the kernels with --specialize.
+    bool specialize;
+    SampleGeometry sample_geometry;
+    float step_length;
+    float curvature_threshold;
+
+    // Shortest paths counted in matrix1 and matrix3 (--distthresh1/3).
+    uint32_t matrix1_min_steps;
+    uint32_t matrix3_min_steps;
+
     EnvironmentData env_data;
 
     std::vector<cl::Buffer*> device_global_pdf_buffers;
+    // Path length sums (--pd), per command queue.
+    std::vector<cl::Buffer*> device_path_dist_buffers;
+    // Direction tensor sums (--opathdir), per command queue, 64 bits as
+    // kPathDirComponents volumes of low words then of high words.
+    std::vector<cl::Buffer*> device_path_dir_buffers;
+    // One connectivity table per matrix, per command queue.
+    std::vector<cl::Buffer*> device_matrix_buffers;
+    // Seeds to targets counts, per command queue.
+    std::vector<cl::Buffer*> device_s2t_buffers;
+    // Voxel of each row/column label, per matrix.
+    std::vector<std::vector<cl_uint> > matrix_voxels;
+    // One per command queue.
+    std::vector<DeviceMemPlan> mem_plans;
+
+    // Out of core: one resident brick per command queue, loaded from the
+    // host copies kept here and in packed_samples.
+    std::vector<BrickBuffers> brick_buffers;
+    const unsigned short int* brick_brain_mask;
+    const unsigned short int* brick_exclusion_mask;
+    const unsigned short int* brick_termination_mask;
+    std::vector<unsigned short int*>* brick_waypoint_masks;
 };
 
 #endif
@@ -22,6 +22,33 @@
 #define BREAK_INIT        8
 #define STILL_FINISHED    9
 #define ANISO_BREAK       10
+#define BREAK_WAYORDER    11  // Hit a waypoint out of order
+// BREAK_BRICK + n: left the resident brick for brick n.  Parked, not done.
+#define BREAK_BRICK       16
+
+// In-kernel refill: the reserve's header, RESERVE_HEADER uints.  These must
+// match oclptxhandler.
+#define RESERVE_NEXT      0  // Next particle to take.  Overshoots when empty.
+#define RESERVE_COUNT     1  // Particles the host put in
+#define RESERVE_FINISHED  2  // Particles that stopped and were replaced
+#define RESERVE_HEADER    4
+
+// Brain mask entries with LOCAL_RULES.  These must match customtypes.h.
+#define VOXEL_FIBRE_SHIFT 1  // 2 bits: 1 or 2 for --locfibchoice, 0 for none
+#define VOXEL_CURV_SHIFT  8  // 8 bits: 1 + (threshold + 1) * 127, 0 for none
+
+// Particles stopped as soon as they could no longer be kept, REJECTS_HEADER
+// uints.  Each count is 64 bits, the low word then the high.  These must
+// match oclptxhandler.
+#define REJECTS_COUNT     0  // Particles
+#define REJECTS_STEPS     2  // Steps they had left before max_steps
+#define REJECTS_HEADER    4
+
+// Connectivity matrices: a table per matrix, MATRIX_HEADER uints then
+// MATRIX_SLOTS keys and MATRIX_SLOTS counts.  These must match oclenv.
+#define MATRIX_COLUMNS    0  // Labels per row
+#define MATRIX_DROPPED    1  // Pairs that found no free slot
+#define MATRIX_HEADER     4
 
 // Struct representing the persistent state of a single particle.
 struct particle_data
@@ -29,6 +56,8 @@ struct particle_data
   rng_t rng; //RW
   float3 position;
   float3 dr;
+  uint seed_voxel;
+  uint seed_roi;
 } __attribute__((aligned(64)));
 
 // Struct full of useful constants.
@@ -53,6 +82,54 @@ struct particle_attrs
   int randfib;
   float fibthresh;
   int num_wg;
+  uint brick_width;  // Resident brick, with -D BRICKED
+  uint brick_first_x;
+  uint brick_last_x;
+  uint brick_base_x;
+  uint brick_nx;
 } __attribute__((aligned(16)));
 
+// Run constants.  With --specialize, oclenv passes these as -D flags so the
+// compiler sees literals and can fold the index math; otherwise they are read
+// from attrs at runtime and one binary serves every dataset.
+#ifdef SPECIALIZED
+#define SAMPLE_NX(a)            (kSampleNx)
+#define SAMPLE_NY(a)            (kSampleNy)
+#define SAMPLE_NZ(a)            (kSampleNz)
+#define NUM_SAMPLES(a)          (kNumSamples)
+#define STEP_LENGTH(a)          (kStepLength)
+#define CURVATURE_THRESHOLD(a)  (kCurvatureThreshold)
+#define BRAIN_MASK_DIM(a) \
+  ((float3) (kBrainMaskDimX, kBrainMaskDimY, kBrainMaskDimZ))
+#else
+#define SAMPLE_NX(a)            ((a).sample_nx)
+#define SAMPLE_NY(a)            ((a).sample_ny)
+#define SAMPLE_NZ(a)            ((a).sample_nz)
+#define NUM_SAMPLES(a)          ((a).num_samples)
+#define STEP_LENGTH(a)          ((a).step_length)
+#define CURVATURE_THRESHOLD(a)  ((a).curvature_threshold)
+#define BRAIN_MASK_DIM(a)       ((a).brain_mask_dim)
+#endif  // SPECIALIZED
+
+// Sample and mask buffers hold x in [brick_base_x, brick_base_x + brick_nx)
+// when tracking out of core, and the whole volume otherwise.  GLOBAL_INDEX
+// turns a resident mask index into one for whole-volume buffers.
+#ifdef BRICKED
+#define RESIDENT_NX(a)          ((a).brick_nx)
+#define RESIDENT_X(a, x)        ((x) - (a).brick_base_x)
+#define GLOBAL_INDEX(a, i) \
+  ((i) + (a).brick_base_x * SAMPLE_NY(a) * SAMPLE_NZ(a))
+#else
+#define RESIDENT_NX(a)          SAMPLE_NX(a)
+#define RESIDENT_X(a, x)        (x)
+#define GLOBAL_INDEX(a, i)      (i)
+#endif  // BRICKED
+
+// Samples too big for one buffer are split by sample number into up to
+// MAX_SAMPLE_TILES buffers of kSamplesPerTile samples (OclEnv::PlanSampleTiles).
+#ifndef SAMPLE_TILES
+#define SAMPLE_TILES 1
+#endif
+#define MAX_SAMPLE_TILES 4
+
 #endif  // ATTRS_H_
@@ -0,0 +1,84 @@
+/*  Copyright 2014
+ *    Afshin Haidari
+ *    Steve Novakov
+ *    Jeff Taylor
+ *
+ * Sample lookups for fetch_bench.  Each work-item walks through the volume
+ * like a particle, one lookup per step, with the next position depending on
+ * what was read.  FetchBuffers reads the packed (x, y, z, f) samples the way
+ * interpolate.cl does by default, FetchImage the way it does with
+ * IMAGE_SAMPLES.  One fibre only.
+ */
+
+__constant sampler_t kSampler = CLK_NORMALIZED_COORDS_FALSE
+                              | CLK_ADDRESS_CLAMP_TO_EDGE
+                              | CLK_FILTER_NEAREST;
+
+uint XorShift(uint *state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 17;
+  *state ^= *state << 5;
+  return *state;
+}
+
+float3 StartPosition(uint *rng, float3 dims)
+{
+  float3 r = (float3) (XorShift(rng), XorShift(rng), XorShift(rng));
+  return dims * r / 4294967296.0f;
+}
+
+/* Half a voxel along dr.  Wraps rather than stops, so every lane does the
+ * same number of lookups. */
+float3 Step(float3 pos, float3 dr, float3 dims)
+{
+  pos += 0.5f * dr;
+  return pos - dims * floor(pos / dims);
+}
+
+__kernel void FetchBuffers(
+  __global const float4 *samples,  /* RO, (x, y, z, f) */
+  uint4 dims,  /* nx, ny, nz, ns */
+  int steps,
+  __global float4 *out  /* WO */
+)
+{
+  uint glid = get_global_id(0);
+  uint rng = glid * 2654435761u + 1;
+  float3 fdims = convert_float3(dims.xyz);
+  float3 pos = StartPosition(&rng, fdims);
+
+  for (int i = 0; i < steps; ++i)
+  {
+    uint3 v = min(convert_uint3(pos), dims.xyz - 1);
+    uint sample = XorShift(&rng) % dims.w;
+    uint index = ((sample*dims.x + v.x)*dims.y + v.y)*dims.z + v.z;
+    pos = Step(pos, samples[index].xyz, fdims);
+  }
+
+  out[glid] = (float4) (pos, 0.f);
+}
+
+__kernel void FetchImage(
+  __read_only image3d_t samples,  /* (x, y, z, f) */
+  uint4 dims,  /* nx, ny, nz, ns */
+  int steps,
+  __global float4 *out  /* WO */
+)
+{
+  uint glid = get_global_id(0);
+  uint rng = glid * 2654435761u + 1;
+  float3 fdims = convert_float3(dims.xyz);
+  float3 pos = StartPosition(&rng, fdims);
+
+  for (int i = 0; i < steps; ++i)
+  {
+    uint3 v = min(convert_uint3(pos), dims.xyz - 1);
+    uint sample = XorShift(&rng) % dims.w;
+    int4 texel = (int4) (v.z, v.y, sample*dims.x + v.x, 0);
+    float4 direction = read_imagef(samples, kSampler, texel);
+    pos = Step(pos, direction.xyz, fdims);
+  }
+
+  out[glid] = (float4) (pos, 0.f);
+}
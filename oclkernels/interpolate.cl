@@ -11,38 +11,150 @@
 #include "rbtree.h"
 #include "rng.h"
 
-float3 f_theta_phi_to_xyz(float3 f_theta_phi)
-{
-  float3 xyz;
+/* Samples hold one float4 per fibre: its unit direction in xyz and its
+ * volume fraction f in w (OclEnv::PackSamples).  A voxel's fibres are
+ * adjacent, so one lookup fetches them all. */
+#ifndef N_FIBERS
+#define N_FIBERS 1
+#endif
 
-  xyz.s0 = cos(f_theta_phi.s2) * sin(f_theta_phi.s1);
-  xyz.s1 = sin(f_theta_phi.s2) * sin(f_theta_phi.s1);
-  xyz.s2 = cos(f_theta_phi.s1);
+#ifdef IMAGE_SAMPLES
+/* One RGBA image per tile, texel (z * N_FIBERS + fibre, y, sample * nx + x)
+ * (OclEnv::AllocateSampleImages).  Texel order matches the buffer layout. */
+__constant sampler_t kSampleSampler = CLK_NORMALIZED_COORDS_FALSE
+                                    | CLK_ADDRESS_CLAMP_TO_EDGE
+                                    | CLK_FILTER_NEAREST;
+
+#define SAMPLE_ARG(name) __read_only image3d_t name
+#define SAMPLE_STORE \
+  read_only image3d_t samples_t0, read_only image3d_t samples_t1, \
+  read_only image3d_t samples_t2, read_only image3d_t samples_t3
+#define SAMPLE_STORE_ARGS samples, samples_t1, samples_t2, samples_t3
+#else
+/* One buffer per tile. */
+#define SAMPLE_ARG(name) __global const float4 *name
+#define SAMPLE_STORE global const float4 **sample_tiles
+#define SAMPLE_STORE_ARGS sample_tiles
+#endif  /* IMAGE_SAMPLES */
+
+/* --locfibchoice 2: drawn uniformly from fibres with f > fibthresh within
+ * 40 degrees of the last direction. */
+#define RANDFIB_ANGLE 4
+#define kLocalFibreCos 0.76604444f
+
+#ifdef LOCAL_RULES
+/* The fibre rule for a step in a voxel: its --locfibchoice on every step,
+ * else randfib on the first step only. */
+int voxel_randfib(ushort voxel_info,
+                  bool first_step,
+                  const struct particle_attrs attrs)
+{
+  int choice = (voxel_info >> VOXEL_FIBRE_SHIFT) & 3;
+  if (0 == choice)
+    return first_step ? attrs.randfib : 0;
+  return 1 == choice ? 1 : RANDFIB_ANGLE;
+}
 
-  return xyz;
+/* The curvature threshold for a voxel: its --loccurvthresh if any. */
+float voxel_curvature_threshold(ushort voxel_info,
+                                const struct particle_attrs attrs)
+{
+  uint level = voxel_info >> VOXEL_CURV_SHIFT;
+  return 0 == level ? CURVATURE_THRESHOLD(attrs)
+                    : (level - 1) / 127.f - 1.f;
 }
+#endif  /* LOCAL_RULES */
+
+#if N_FIBERS > 1
+/* probtrackx2's choice of fibre.  A particle's first step follows fibre
+ * fibst and later steps the fibre closest to the last direction, among those
+ * with f > fibthresh.  randfib is the rule for this step, 0 on all but the
+ * first unless --locfibchoice says otherwise (STEP_RANDFIB).  With it, the
+ * fibre is drawn instead: 1 uniformly from those with f > fibthresh, 2 in
+ * proportion to f among them, 3 uniformly from all, RANDFIB_ANGLE as 1 but
+ * near the last direction only.  If nothing qualifies, the first fibre is
+ * used.  Every fibre is looked at whichever wins, so lanes only differ in
+ * data, never in path. */
+float4 pick_fibre(float4 fibres[N_FIBERS],
+                  float3 last_dr,
+                  bool first_step,
+                  int randfib,
+                  const struct particle_attrs attrs,
+                  global rng_t *rng)
+{
+  float4 picked = fibres[0];
+  int i;
+
+  if (0 == randfib)
+  {
+    float best = 0.f;
+    for (i = 0; i < N_FIBERS; ++i)
+    {
+      float closeness = fabs(dot(fibres[i].xyz, last_dr));
+      bool better = fibres[i].w > attrs.fibthresh && closeness > best;
+      best = better ? closeness : best;
+      picked = better ? fibres[i] : picked;
+    }
+    for (i = 0; i < N_FIBERS; ++i)
+      picked = (first_step && i == attrs.fibst) ? fibres[i] : picked;
+  }
+  else
+  {
+    float weight[N_FIBERS];
+    float total = 0.f;
+    for (i = 0; i < N_FIBERS; ++i)
+    {
+      bool eligible = 3 == randfib || fibres[i].w > attrs.fibthresh;
+      eligible &= RANDFIB_ANGLE != randfib
+               || fabs(dot(fibres[i].xyz, last_dr)) > kLocalFibreCos;
+      weight[i] = eligible ? (2 == randfib ? fibres[i].w : 1.f) : 0.f;
+      total += weight[i];
+    }
+
+    float r = total * fmin(convert_float(Rand(rng)) / kRandMax,
+                           0x1.fffffep-1f);
+    float sum = 0.f;
+    bool found = false;
+    for (i = 0; i < N_FIBERS; ++i)
+    {
+      sum += weight[i];
+      bool hit = !found && r < sum;
+      picked = hit ? fibres[i] : picked;
+      found |= hit;
+    }
+  }
 
-float3 get_f_theta_phi(global float *f_samples,
-                       global float *theta_samples,
-                       global float *phi_samples,
-                       float3 particle_pos,
-                       const struct particle_attrs attrs,
-                       global rng_t *rng)
+  return picked;
+}
+#endif  /* N_FIBERS > 1 */
+
+/* Direction (xyz) and f (w) of a fibre at a random sample and a vertex near
+ * particle_pos, drawn in proportion to how close it is. */
+float4 get_direction(SAMPLE_STORE,
+                     float3 particle_pos,
+                     float3 last_dr,
+                     bool first_step,
+                     int randfib,
+                     const struct particle_attrs attrs,
+                     global rng_t *rng)
 {
   /* calculate current index in diffusion space */
   ulong3 rng_output;
-  float f = 0.;
-  float theta = 0.;
-  float phi = 0.;
-  uint diffusion_index;
   uint sample;
+  uint tile = 0;
+  float4 fibres[N_FIBERS];
+  int i;
 
   uint3 current_select_vertex = convert_uint3(floor(particle_pos));
   float3 volume_fraction = particle_pos - convert_float3(current_select_vertex);
   float3 vol_frac = volume_fraction * kRandMax;
 
   /* Pick Sample */
-  sample = Rand(rng) % attrs.num_samples;
+  sample = Rand(rng) % NUM_SAMPLES(attrs);
+#if SAMPLE_TILES > 1
+  tile = sample / kSamplesPerTile;
+  sample -= tile * kSamplesPerTile;
+#endif
 
   /* Volume Fraction Selection */
   rng_output = (ulong3) (Rand(rng), Rand(rng), Rand(rng));
@@ -50,25 +162,205 @@ float3 get_f_theta_phi(global float *f_samples,
   current_select_vertex +=
     convert_uint3((convert_float3(rng_output) > vol_frac)? 1: 0);
 
+#ifdef IMAGE_SAMPLES
+  int4 texel = (int4) (current_select_vertex.s2 * N_FIBERS,
+                       current_select_vertex.s1,
+                       sample*RESIDENT_NX(attrs) +
+                         RESIDENT_X(attrs, current_select_vertex.s0),
+                       0);
+
+  for (i = 0; i < N_FIBERS; ++i, ++texel.s0)
+  {
+    if (0 == tile)
+      fibres[i] = read_imagef(samples_t0, kSampleSampler, texel);
+#if SAMPLE_TILES > 1
+    else if (1 == tile)
+      fibres[i] = read_imagef(samples_t1, kSampleSampler, texel);
+    else if (2 == tile)
+      fibres[i] = read_imagef(samples_t2, kSampleSampler, texel);
+    else
+      fibres[i] = read_imagef(samples_t3, kSampleSampler, texel);
+#endif
+  }
+#else
   /* pick flow vertex */
-  diffusion_index =
-    sample*(attrs.sample_nz*attrs.sample_ny*attrs.sample_nx)+
-    current_select_vertex.s0*(attrs.sample_nz*attrs.sample_ny) +
-    current_select_vertex.s1*(attrs.sample_nz) +
+  uint diffusion_index =
+    sample*(SAMPLE_NZ(attrs)*SAMPLE_NY(attrs)*RESIDENT_NX(attrs))+
+    RESIDENT_X(attrs, current_select_vertex.s0)*(SAMPLE_NZ(attrs)*SAMPLE_NY(attrs)) +
+    current_select_vertex.s1*(SAMPLE_NZ(attrs)) +
     current_select_vertex.s2;
 
-  if (f_samples)
-    f = f_samples[diffusion_index];
-  theta = theta_samples[diffusion_index];
-  phi = phi_samples[diffusion_index];
+  for (i = 0; i < N_FIBERS; ++i)
+    fibres[i] = sample_tiles[tile][diffusion_index * N_FIBERS + i];
+#endif  /* IMAGE_SAMPLES */
+
+#if N_FIBERS > 1
+  return pick_fibre(fibres, last_dr, first_step, randfib, attrs, rng);
+#else
+  return fibres[0];
+#endif
+}
+
+#if defined(MATRIX1) || defined(MATRIX3)
+/* Slots probed before a pair is given up on and counted as dropped. */
+#define MATRIX_PROBES 32
+
+#ifdef MATRIX1
+#define MATRIX3_TABLE 1
+#else
+#define MATRIX3_TABLE 0
+#endif
+
+/* Count one streamline from row to column, both labels (0 for none).  Open
+ * addressing: the first lane to claim a slot writes its key, later ones with
+ * the same key only count. */
+void matrix_add(global uint *table, uint row_label, uint col_label)
+{
+  global uint *keys = table + MATRIX_HEADER;
+  global uint *counts = keys + MATRIX_SLOTS;
+  uint key;
+  uint slot;
+  uint old;
+  int probe;
+
+  if (0 == row_label || 0 == col_label)
+    return;
+
+  key = (row_label - 1) * table[MATRIX_COLUMNS] + col_label;
+  slot = (key * 2654435761u) & (MATRIX_SLOTS - 1);
+  for (probe = 0; probe < MATRIX_PROBES; ++probe)
+  {
+    old = atomic_cmpxchg(&keys[slot], 0, key);
+    if (0 == old || key == old)
+    {
+      atomic_inc(&counts[slot]);
+      return;
+    }
+    slot = (slot + 1) & (MATRIX_SLOTS - 1);
+  }
+  atomic_inc(&table[MATRIX_DROPPED]);
+}
+
+/* Seed voxel to end voxel, in each matrix the path is long enough for. */
+void do_matrix_finish(const struct particle_attrs attrs,
+                      ushort steps,
+                      float3 end_pos,
+                      uint seed_voxel,
+                      global const uint *matrix_labels,
+                      global uint *matrix_tables)
+{
+  uint voxels = SAMPLE_NX(attrs) * SAMPLE_NY(attrs) * SAMPLE_NZ(attrs);
+  /* The voxel the pdf and rbtree last counted the path in. */
+  uint3 end = min(convert_uint3(floor(fmax(end_pos, 0.f))),
+                  (uint3) (SAMPLE_NX(attrs) - 1,
+                           SAMPLE_NY(attrs) - 1,
+                           SAMPLE_NZ(attrs) - 1));
+  uint end_voxel = (end.s0 * SAMPLE_NY(attrs) + end.s1) * SAMPLE_NZ(attrs)
+                 + end.s2;
+
+#ifdef MATRIX1
+  if (steps >= kMatrix1MinSteps)
+    matrix_add(matrix_tables,
+               matrix_labels[seed_voxel],
+               matrix_labels[end_voxel]);
+#endif
+#ifdef MATRIX3
+  global const uint *target3_labels = matrix_labels + MATRIX3_TABLE * voxels;
+  global uint *target3_table =
+    matrix_tables + MATRIX3_TABLE * (MATRIX_HEADER + 2 * MATRIX_SLOTS);
+  if (steps >= kMatrix3MinSteps)
+    matrix_add(target3_table,
+               target3_labels[seed_voxel],
+               target3_labels[end_voxel]);
+#endif
+}
+#endif  /* MATRIX1 || MATRIX3 */
+
+/* A 64-bit count from 32-bit atomics: the add that wraps the low word
+ * carries into the high one. */
+void wide_add(global uint *count, uint value)
+{
+  uint old = atomic_add(&count[0], value);
+  if (old + value < old)
+    atomic_inc(&count[1]);
+}
+
+/* A particle that can no longer be kept stops at once.  Counts the steps it
+ * could still have taken, an upper bound on those saved. */
+void count_early_reject(global uint *rejects,
+                        const struct particle_attrs attrs,
+                        ushort steps)
+{
+  wide_add(&rejects[REJECTS_COUNT], 1);
+  wide_add(&rejects[REJECTS_STEPS], attrs.max_steps - 1 - steps);
+}
+
+#ifdef PATH_DIST
+/* 64-bit sums from 32-bit atomics: low words, then a volume of the carries
+ * out of them.  The add that wraps a low word carries. */
+void path_dist_add(global uint *path_dist,
+                   int num_entries,
+                   int index,
+                   uint steps)
+{
+  uint old = atomic_add(&path_dist[index], steps);
+  if (old + steps < old)
+    atomic_inc(&path_dist[num_entries + index]);
+}
+#endif  /* PATH_DIST */
+
+#ifdef PATH_DIRS
+/* Products of directions scaled to 127 reach 127^2; dropping 6 bits keeps
+ * each one within 252. */
+#define PATH_DIR_SHIFT 6
+#define PATH_DIR_COMPONENTS 6  /* kPathDirComponents */
+
+int path_dir_product(int a, int b)
+{
+  return (a * b + (1 << (PATH_DIR_SHIFT - 1))) >> PATH_DIR_SHIFT;
+}
+
+/* Sums are 64-bit two's complement, PATH_DIR_COMPONENTS volumes of 32-bit
+ * low words followed by as many of high words.  A negative value adds all
+ * ones to the high word, and the add that wraps a low word carries. */
+void path_dir_sum(global int *path_dirs,
+                  int num_entries,
+                  int component,
+                  int index,
+                  int value)
+{
+  global uint *low = (global uint *) path_dirs;
+  uint old = atomic_add(&low[component * num_entries + index], (uint) value);
+  int high = (value < 0 ? -1 : 0) + (old + (uint) value < old ? 1 : 0);
+  if (0 != high)
+    atomic_add(&path_dirs[(PATH_DIR_COMPONENTS + component) * num_entries
+                          + index], high);
+}
 
-  return (float3) (f, theta, phi);
+/* Add the outer product of dir with itself, so that paths going either way
+ * along a tract agree.  Upper triangle, a volume per component. */
+void path_dir_add(global int *path_dirs,
+                  int num_entries,
+                  int index,
+                  char4 dir)
+{
+  int3 d = convert_int3(dir.xyz);
+
+  path_dir_sum(path_dirs, num_entries, 0, index, path_dir_product(d.x, d.x));
+  path_dir_sum(path_dirs, num_entries, 1, index, path_dir_product(d.x, d.y));
+  path_dir_sum(path_dirs, num_entries, 2, index, path_dir_product(d.x, d.z));
+  path_dir_sum(path_dirs, num_entries, 3, index, path_dir_product(d.y, d.y));
+  path_dir_sum(path_dirs, num_entries, 4, index, path_dir_product(d.y, d.z));
+  path_dir_sum(path_dirs, num_entries, 5, index, path_dir_product(d.z, d.z));
 }
+#endif  /* PATH_DIRS */
 
 #if WAYAND
 #define WAYOP(chk, pts) ((chk) &= (pts))
+#define WAYINIT 1
 #else  /* WAYOR */
 #define WAYOP(chk, pts) ((chk) |= (pts))
+#define WAYINIT 0
 #endif
 
 void do_particle_finish(uint glid,
@@ -78,10 +370,24 @@ void do_particle_finish(uint glid,
                         global ushort *particle_exclusion,
                         global ushort *particle_waypoints,
                         global struct rbtree *position_set,
-                        global uint *local_pdf)
+                        global uint *local_pdf,
+                        global const struct particle_data *particle,
+                        global const uint *matrix_labels,
+                        global uint *matrix_tables,
+                        global const uint *particle_targets,
+                        global uint *s2t_counts,
+                        global const ushort *particle_visit_steps,
+                        global uint *path_dist,
+                        global const char4 *particle_visit_dirs,
+                        global int *path_dirs)
 {
   int i;
+#if defined(WAYPOINTS) && !defined(WAYORDER)
   int waypoint_check;
+#endif
+#ifdef NETWORK
+  uint network_hits;
+#endif
   if (steps < attrs.min_steps)
     return;
 
@@ -90,9 +396,13 @@ void do_particle_finish(uint glid,
     return;
 #endif  /* EXCLUSION */
 
-#if WAYPOINTS
-  /* TODO(jeff/steve): double check this code.  WAYOR seems broken to Jeff. */
-  waypoint_check = 1;
+#if defined(WAYPOINTS) && defined(WAYORDER)
+  /* Every waypoint, in order. */
+  if (particle_waypoints[glid] != attrs.n_waypoint_masks)
+    return;
+#elif defined(WAYPOINTS)
+  /* All waypoints for AND, any for OR. */
+  waypoint_check = WAYINIT;
   for (i = 0; i < attrs.n_waypoint_masks; i++)
     WAYOP(waypoint_check, particle_waypoints[glid*attrs.n_waypoint_masks + i]);
 
@@ -100,7 +410,15 @@ void do_particle_finish(uint glid,
     return;
 #endif  /* WAYPOINTS */
 
+#ifdef NETWORK
+  /* Only paths through another seed mask count, in any output. */
+  network_hits = particle_targets[glid] & ~(1u << particle->seed_roi);
+  if (0 == network_hits)
+    return;
+#endif  /* NETWORK */
+
   if ((done)
+   && (BREAK_BRICK    >  done)
    && (BREAK_INVALID  != done)
    && (BREAK_INIT     != done)
    && (STILL_FINISHED != done)) {
@@ -108,13 +426,122 @@ void do_particle_finish(uint glid,
     for (i = 0; i < position_set->num_entries; ++i) {
       /* position = x*ny*nz + y*nz + z */
       int index = rbtree_data(position_set, i);
-      int num_entries = attrs.sample_nx * attrs.sample_ny * attrs.sample_nz;
+      int num_entries =
+        SAMPLE_NX(attrs) * SAMPLE_NY(attrs) * SAMPLE_NZ(attrs);
 
       atomic_inc(&local_pdf[index + num_entries * get_group_id(0)]);
+#ifdef PATH_DIST
+      if (path_dist)
+        path_dist_add(path_dist, num_entries, index,
+                      particle_visit_steps[glid * kMaxSize + i]);
+#endif
+#ifdef PATH_DIRS
+      if (path_dirs)
+        path_dir_add(path_dirs, num_entries, index,
+                     particle_visit_dirs[glid * kMaxSize + i]);
+#endif
     }
+
+#if defined(MATRIX1) || defined(MATRIX3)
+    if (matrix_tables)
+      do_matrix_finish(attrs, steps, particle->position, particle->seed_voxel,
+                       matrix_labels, matrix_tables);
+#endif
+
+#if defined(TARGETS) && defined(NETWORK)
+    /* One count per other seed mask hit, in the seed mask's row, then the
+     * path into the seed mask's own pdf. */
+    if (s2t_counts)
+    {
+      int num_entries =
+        SAMPLE_NX(attrs) * SAMPLE_NY(attrs) * SAMPLE_NZ(attrs);
+      global uint *roi_pdf = s2t_counts + N_TARGETS * N_TARGETS
+                           + particle->seed_roi * num_entries;
+      for (i = 0; i < N_TARGETS; ++i)
+        if ((network_hits >> i) & 1)
+          atomic_inc(&s2t_counts[particle->seed_roi * N_TARGETS + i]);
+      for (i = 0; i < position_set->num_entries; ++i)
+        atomic_inc(&roi_pdf[rbtree_data(position_set, i)]);
+    }
+#elif defined(TARGETS)
+    /* One count per target hit, at the seed voxel. */
+    if (s2t_counts)
+    {
+      int num_entries =
+        SAMPLE_NX(attrs) * SAMPLE_NY(attrs) * SAMPLE_NZ(attrs);
+      for (i = 0; i < N_TARGETS; ++i)
+        if ((particle_targets[glid] >> i) & 1)
+          atomic_inc(&s2t_counts[i * num_entries + particle->seed_voxel]);
+    }
+#endif
   }
 }
 
+#ifdef KERNEL_REFILL
+/* Put reserve particle `next` in the lane, clearing its per-particle state as
+ * oclptxhandler does for a particle written by the host. */
+void load_reserve_particle(uint glid,
+                           uint next,
+                           const struct particle_attrs attrs,
+                           global struct particle_data *state,
+                           global struct particle_data *reserve,
+                           global ushort *particle_steps,
+                           global ushort *particle_done,
+                           global struct rbtree *position_set,
+                           global ushort *particle_waypoints,
+                           global ushort *particle_exclusion,
+                           global float3 *particle_loopcheck_lastdir,
+                           global uint *particle_targets)
+{
+  uint i;
+
+  state[glid] = reserve[next];
+  particle_steps[glid] = 0;
+  particle_done[glid] = 0;
+  rbtree_init(&position_set[glid]);
+#if defined(WAYPOINTS) && defined(WAYORDER)
+  particle_waypoints[glid] = 0;
+#elif defined(WAYPOINTS)
+  for (i = 0; i < attrs.n_waypoint_masks; i++)
+    particle_waypoints[glid*attrs.n_waypoint_masks + i] = 0;
+#endif
+#ifdef EXCLUSION
+  particle_exclusion[glid] = 0;
+#endif
+#ifdef TARGETS
+  particle_targets[glid] = 0;
+#endif
+#ifdef LOOPCHECK
+  uint loopcheck_dir_size = attrs.lx * attrs.ly * attrs.lz;
+  for (i = 0; i < loopcheck_dir_size; i++)
+    particle_loopcheck_lastdir[glid*loopcheck_dir_size + i] = (float3) (0.0f);
+#endif
+}
+
+#define LOAD_RESERVE_PARTICLE(next) \
+  load_reserve_particle(glid, next, attrs, state, reserve, particle_steps, \
+                        particle_done, position_set, particle_waypoints, \
+                        particle_exclusion, particle_loopcheck_lastdir, \
+                        particle_targets)
+
+/* A particle that stops frees its lane for the next one in the reserve. */
+#define STOP_PARTICLE continue
+#else
+/* A particle that stops ends the launch for its lane. */
+#define STOP_PARTICLE break
+#endif  /* KERNEL_REFILL */
+
+/* The rules of the voxel a particle is in, with LOCAL_RULES.  The brain mask
+ * entry is read once per particle per launch, then carried over from each
+ * step's brain mask test.  randfib only draws the first fibre. */
+#ifdef LOCAL_RULES
+#define STEP_RANDFIB(first_step) voxel_randfib(voxel_info, first_step, attrs)
+#define STEP_CURVATURE_THRESHOLD voxel_curvature_threshold(voxel_info, attrs)
+#else
+#define STEP_RANDFIB(first_step) ((first_step) ? attrs.randfib : 0)
+#define STEP_CURVATURE_THRESHOLD CURVATURE_THRESHOLD(attrs)
+#endif
+
 __kernel void OclPtxInterpolate(
   struct particle_attrs attrs,  /* RO */
   __global struct particle_data *state,  /* RW */
@@ -131,17 +558,44 @@ __kernel void OclPtxInterpolate(
   __global ushort *particle_exclusion, //W
   __global float3 *particle_loopcheck_lastdir, //RW
 
-  // Global Data
-  __global float *f_samples, //R
-  __global float *phi_samples, //R
-  __global float *theta_samples, //R
-  __global float *f_samples_2,  //R
-  __global float *phi_samples_2,  //R
-  __global float *theta_samples_2,  //R
+  // Global Data.  Samples come in up to MAX_SAMPLE_TILES tiles, NULL past
+  // SAMPLE_TILES (images: repeats of the first).
+  SAMPLE_ARG(samples), //R
+  SAMPLE_ARG(samples_t1), //R
+  SAMPLE_ARG(samples_t2), //R
+  SAMPLE_ARG(samples_t3), //R
   __global ushort *brain_mask, //R
   __global ushort *waypoint_masks,  //R
   __global ushort *termination_mask,  //R
-  __global ushort *exclusion_mask //R
+  __global ushort *exclusion_mask, //R
+
+  // In-kernel refill, NULL without KERNEL_REFILL
+  __global struct particle_data *reserve, //R
+  __global uint *reserve_head, //RW, RESERVE_HEADER entries
+
+  // Outputs below are also NULL in calibration runs, which leave them be.
+
+  // Connectivity matrices, NULL without MATRIX1 or MATRIX3
+  __global const uint *matrix_labels, //R, a volume per matrix
+  __global uint *matrix_tables, //RW, see attrs.h
+
+  // Seeds to targets, NULL without TARGETS
+  __global const uint *target_masks, //R, a bit per target per voxel
+  __global uint *particle_targets, //RW, targets hit so far
+  __global uint *s2t_counts, //RW, a volume per target, or with NETWORK the
+                            //  seed mask matrix then a pdf per seed mask
+
+  // Path lengths, NULL without PATH_DIST
+  __global ushort *particle_visit_steps, //RW, kMaxSize per particle
+  __global uint *path_dist, //RW, steps to each voxel, summed over paths,
+                            //  as low words then carries
+
+  // Path directions, NULL without PATH_DIRS
+  __global char4 *particle_visit_dirs, //RW, kMaxSize per particle
+  __global int *path_dirs, //RW, 6 volumes of direction tensor sums, as
+                           //  low words then high words
+
+  __global uint *rejects //RW, REJECTS_HEADER entries
 )
 {
   uint glid = get_global_id(0);
@@ -154,16 +608,31 @@ __kernel void OclPtxInterpolate(
   uint vertex_num;
   uint entry_num;
   uint shift_num;
-  float3 f_theta_phi;
+  float4 direction;
   float3 temp_pos = state[glid].position;
   float3 new_dr = (float3) (0.0f);
   float3 min = (float3) (0.0f);
-  float3 max = (float3) (attrs.sample_nx * 1.0,
-                         attrs.sample_ny * 1.0,
-                         attrs.sample_nz * 1.0);
+  float3 max = (float3) (SAMPLE_NX(attrs) * 1.0,
+                         SAMPLE_NY(attrs) * 1.0,
+                         SAMPLE_NZ(attrs) * 1.0);
+#ifndef IMAGE_SAMPLES
+  global const float4 *sample_tiles[MAX_SAMPLE_TILES] =
+    {samples, samples_t1, samples_t2, samples_t3};
+#endif
 
 #ifdef WAYPOINTS
-  uint mask_size = attrs.sample_nx * attrs.sample_ny * attrs.sample_nz;
+  uint mask_size = RESIDENT_NX(attrs) * SAMPLE_NY(attrs) * SAMPLE_NZ(attrs);
+#endif
+#ifdef BRICKED
+  int brick_x;
+#endif
+#ifdef KERNEL_REFILL
+  uint next;
+#endif
+#ifdef LOCAL_RULES
+  ushort voxel_info = 0;
+  bool voxel_info_valid = false;
+  uint3 voxel;
 #endif
 #ifdef EULER_STREAMLINE
   float3 dr2 = (float3) (0.0f);
@@ -178,12 +647,31 @@ __kernel void OclPtxInterpolate(
   float loopcheck_product;
 #endif // LOOPCHECK
 
+#ifdef BRICKED
+  /* Parked, waiting for its brick.  Keep everything as it is. */
+  if (particle_done[glid] >= BREAK_BRICK)
+    return;
+#endif
+
   /* No new valid data.  Likely the host is out of data.  Signal that. */
   if (particle_done[glid])
   {
-    particle_done[glid] = STILL_FINISHED;
-    particle_steps[glid] = 0;
-    return;
+#ifdef KERNEL_REFILL
+    /* Its last particle was handed over at the end of an earlier launch, so
+     * the lane is free for one from the reserve. */
+    next = atomic_inc(&reserve_head[RESERVE_NEXT]);
+    if (next < reserve_head[RESERVE_COUNT])
+    {
+      LOAD_RESERVE_PARTICLE(next);
+      temp_pos = state[glid].position;
+    }
+    else
+#endif  /* KERNEL_REFILL */
+    {
+      particle_done[glid] = STILL_FINISHED;
+      particle_steps[glid] = 0;
+      return;
+    }
   }
 
   /* New particle.  Do any in-kernel initialization here. */
@@ -195,23 +683,87 @@ __kernel void OclPtxInterpolate(
   /* Main loop */
   for (step = 0; step < attrs.steps_per_kernel; ++step)
   {
-    f_theta_phi = get_f_theta_phi(f_samples, theta_samples, phi_samples,
-                                  temp_pos, attrs, &(state[glid].rng));
+#ifdef KERNEL_REFILL
+    /* Stopped earlier in this launch.  Hand its result over now and carry on
+     * with a particle from the reserve, rather than idle until the end. */
+    if (particle_done[glid])
+    {
+      next = atomic_inc(&reserve_head[RESERVE_NEXT]);
+      if (next >= reserve_head[RESERVE_COUNT])
+        break;
+
+      do_particle_finish(glid,
+                         attrs,
+                         particle_done[glid],
+                         particle_steps[glid],
+                         particle_exclusion,
+                         particle_waypoints,
+                         &position_set[glid],
+                         local_pdf,
+                         &state[glid],
+                         matrix_labels,
+                         matrix_tables,
+                         particle_targets,
+                         s2t_counts,
+                         particle_visit_steps,
+                         path_dist,
+                         particle_visit_dirs,
+                         path_dirs);
+      atomic_inc(&reserve_head[RESERVE_FINISHED]);
+
+      LOAD_RESERVE_PARTICLE(next);
+      temp_pos = state[glid].position;
+#ifdef LOCAL_RULES
+      voxel_info_valid = false;
+#endif
+    }
+#endif  /* KERNEL_REFILL */
+
+#ifdef BRICKED
+    /* Outside the resident brick?  Park until the host loads ours.  Nothing
+     * has been drawn from the rng yet, so the step is simply redone. */
+    brick_x = clamp((int) floor(temp_pos.s0), 0, (int) SAMPLE_NX(attrs) - 1);
+    if (brick_x < attrs.brick_first_x || brick_x >= attrs.brick_last_x)
+    {
+      particle_done[glid] = BREAK_BRICK + brick_x / attrs.brick_width;
+      break;
+    }
+#endif  /* BRICKED */
+
+#ifdef LOCAL_RULES
+    if (!voxel_info_valid)
+    {
+      voxel = min(convert_uint3(round(fmax(temp_pos, 0.f))),
+                  (uint3) (SAMPLE_NX(attrs) - 1,
+                           SAMPLE_NY(attrs) - 1,
+                           SAMPLE_NZ(attrs) - 1));
+      voxel_info = brain_mask[
+        RESIDENT_X(attrs, voxel.s0)*(SAMPLE_NZ(attrs)*SAMPLE_NY(attrs)) +
+        voxel.s1*(SAMPLE_NZ(attrs)) + voxel.s2];
+      voxel_info_valid = true;
+    }
+#endif  /* LOCAL_RULES */
+
+    direction = get_direction(SAMPLE_STORE_ARGS,
+                              temp_pos, state[glid].dr,
+                              0 == particle_steps[glid],
+                              STEP_RANDFIB(0 == particle_steps[glid]),
+                              attrs, &(state[glid].rng));
+
+    new_dr = direction.xyz;
 
-    new_dr = f_theta_phi_to_xyz(f_theta_phi);
-    
     /* Align direction to keep angle under 90 degrees */
     if (dot(new_dr, state[glid].dr) < 0.0 )
       new_dr *= -1;
 
-    new_dr = new_dr / attrs.brain_mask_dim;
-    new_dr = new_dr * attrs.step_length;
+    new_dr = new_dr / BRAIN_MASK_DIM(attrs);
+    new_dr = new_dr * STEP_LENGTH(attrs);
 
 #ifdef ANISOTROPIC
-    if (f_theta_phi.s0 * kRandMax < Rand(&(state[glid].rng)))
+    if (direction.w * kRandMax < Rand(&(state[glid].rng)))
     {
       particle_done[glid] = ANISO_BREAK;
-      break;
+      STOP_PARTICLE;
     }
 #endif /* ANISOTROPIC */
 
@@ -219,25 +771,28 @@ __kernel void OclPtxInterpolate(
     // update particle position
     temp_pos = state[glid].position + new_dr;
 
-    f_theta_phi = get_f_theta_phi(f_samples, theta_samples, phi_samples,
-                                  temp_pos, &attrs, &(state[glid].rng));
+    direction = get_direction(SAMPLE_STORE_ARGS,
+                              temp_pos, state[glid].dr,
+                              0 == particle_steps[glid],
+                              STEP_RANDFIB(0 == particle_steps[glid]),
+                              attrs, &(state[glid].rng));
 
 #ifdef ANISOTROPIC
-    if (f_theta_phi.s0 * kRandMax < Rand(&(state[glid].rng)))
+    if (direction.w * kRandMax < Rand(&(state[glid].rng)))
     {
       particle_done[glid] = ANISO_BREAK;
-      break;
+      STOP_PARTICLE;
     }
 #endif // ANISOTROPIC
     
-    dr2 = f_theta_phi_to_xyz(f_theta_phi);
+    dr2 = direction.xyz;
 
     /* Keep angle under 90 degrees */
     if (dot(dr2, state[glid].dr) < 0.0 )
       dr2 *= -1;
 
-    dr2 = dr2 / attrs.brain_mask_dim;
-    dr2 = dr2 * attrs.step_length;
+    dr2 = dr2 / BRAIN_MASK_DIM(attrs);
+    dr2 = dr2 * STEP_LENGTH(attrs);
 
     new_dr = 0.5 * (new_dr + dr2);
 #endif  /* EULER_STREAMLINE */
@@ -247,37 +802,40 @@ __kernel void OclPtxInterpolate(
     /* Curvature threshold check */
     new_dr = normalize(new_dr);
     if (particle_steps[glid] > 1
-      && dot(new_dr, state[glid].dr) < attrs.curvature_threshold)
+      && dot(new_dr, state[glid].dr) < STEP_CURVATURE_THRESHOLD)
     {
       particle_done[glid] = BREAK_CURV;
-      break;
+      STOP_PARTICLE;
     }
 
     /* Out of bounds? */
     if (any(temp_pos > max || min > temp_pos))
     {
       particle_done[glid] = BREAK_INVALID;
-      break;
+      STOP_PARTICLE;
     }
 
     /* Brain Mask Test - Checks NEAREST vertex. */
     mask_index =
-      round(temp_pos.s0)*(attrs.sample_nz*attrs.sample_ny) +
-      round(temp_pos.s1)*(attrs.sample_nz) + round(temp_pos.s2);
+      RESIDENT_X(attrs, round(temp_pos.s0))*(SAMPLE_NZ(attrs)*SAMPLE_NY(attrs)) +
+      round(temp_pos.s1)*(SAMPLE_NZ(attrs)) + round(temp_pos.s2);
 
     bounds_test = brain_mask[mask_index];
     if (bounds_test == 0)
     {
       particle_done[glid] = BREAK_BRAIN_MASK;
-      break;
+      STOP_PARTICLE;
     }
+#ifdef LOCAL_RULES
+    voxel_info = bounds_test;
+#endif
 
 #ifdef TERMINATION
     bounds_test = termination_mask[mask_index];
     if (bounds_test == 1)
     {
-      particle_done[glid] = BREAK_TERM;
-      break;
+      particle_done[glid] = BREAK_TERMINATE;
+      STOP_PARTICLE;
     }
 #endif  /* TERMINATION */
 
@@ -287,11 +845,34 @@ __kernel void OclPtxInterpolate(
     {
       particle_exclusion[glid] = 1;
       particle_done[glid] = BREAK_EXCLUSION;
-      break;
+      count_early_reject(rejects, attrs, particle_steps[glid]);
+      STOP_PARTICLE;
     }
 #endif  /* EXCLUSION */
 
-#ifdef WAYPOINTS
+#if defined(WAYPOINTS) && defined(WAYORDER)
+    /* particle_waypoints holds the next waypoint expected.  Reaching one
+     * further on can never be put right, so stop there. */
+    {
+      ushort next_waypoint = particle_waypoints[glid];
+      int out_of_order = 0;
+      for (uint w = 0; w < attrs.n_waypoint_masks; w++)
+      {
+        bounds_test = waypoint_masks[w*mask_size + mask_index];
+        if (bounds_test > 0 && w == next_waypoint)
+          next_waypoint++;
+        else if (bounds_test > 0 && w > next_waypoint)
+          out_of_order = 1;
+      }
+      particle_waypoints[glid] = next_waypoint;
+      if (out_of_order)
+      {
+        particle_done[glid] = BREAK_WAYORDER;
+        count_early_reject(rejects, attrs, particle_steps[glid]);
+        STOP_PARTICLE;
+      }
+    }
+#elif defined(WAYPOINTS)
     for (uint w = 0; w < attrs.n_waypoint_masks; w++)
     {
       bounds_test = waypoint_masks[w*mask_size + mask_index];
@@ -300,6 +881,10 @@ __kernel void OclPtxInterpolate(
     }
 #endif  /* WAYPOINTS */
 
+#ifdef TARGETS
+    particle_targets[glid] |= target_masks[GLOBAL_INDEX(attrs, mask_index)];
+#endif  /* TARGETS */
+
 #ifdef LOOPCHECK
   loopcheck_voxel = convert_uint3(round(temp_pos) / 5);
 
@@ -316,7 +901,7 @@ __kernel void OclPtxInterpolate(
   if (loopcheck_product < 0)
   {
     particle_done[glid] = BREAK_LOOPCHECK;
-    break;
+    STOP_PARTICLE;
   }
 
   particle_loopcheck_lastdir[glid*loopcheck_dir_size +
@@ -337,14 +922,31 @@ __kernel void OclPtxInterpolate(
       particle_paths[path_index] = temp_pos;
   
     /* Add position to position list */
-    uint index = floor(temp_pos.x) * attrs.sample_ny * attrs.sample_nz
-               + floor(temp_pos.y) * attrs.sample_nz
+    uint index = floor(temp_pos.x) * SAMPLE_NY(attrs) * SAMPLE_NZ(attrs)
+               + floor(temp_pos.y) * SAMPLE_NZ(attrs)
                + floor(temp_pos.z);
+#if defined(PATH_DIST) || defined(PATH_DIRS)
+    /* Nodes are appended, so a new voxel is node num_entries. */
+    short visited = position_set[glid].num_entries;
+    rbtree_insert(&position_set[glid], index);
+    if (position_set[glid].num_entries != visited)
+    {
+#ifdef PATH_DIST
+      particle_visit_steps[glid * kMaxSize + visited] =
+        particle_steps[glid] + 1;
+#endif
+#ifdef PATH_DIRS
+      particle_visit_dirs[glid * kMaxSize + visited] =
+        convert_char4_sat_rte((float4) (127.f * normalize(new_dr), 0.f));
+#endif
+    }
+#else
     rbtree_insert(&position_set[glid], index);
+#endif  /* PATH_DIST || PATH_DIRS */
     
     if (particle_steps[glid] + 1 == attrs.max_steps) {
       particle_done[glid] = BREAK_MAXSTEPS;
-      break;
+      STOP_PARTICLE;
     }
 
     if (!particle_done[glid])
@@ -356,7 +958,7 @@ __kernel void OclPtxInterpolate(
   /* If the host is reading path data, no new data has been added.  We need to
    * signal that.
    */
-  if (0 == step)
+  if (0 == step && BREAK_BRICK > particle_done[glid])
     particle_steps[glid] = 0;
 
   /* If finished, add steps to global pdf by walking the set out-of-order */
@@ -367,5 +969,14 @@ __kernel void OclPtxInterpolate(
                      particle_exclusion,
                      particle_waypoints,
                      &position_set[glid],
-                     local_pdf);
+                     local_pdf,
+                     &state[glid],
+                     matrix_labels,
+                     matrix_tables,
+                     particle_targets,
+                     s2t_counts,
+                     particle_visit_steps,
+                     path_dist,
+                     particle_visit_dirs,
+                     path_dirs);
 }
@@ -15,18 +15,18 @@ __kernel void PdfSum(
   global uint* global_pdf
 )
 {
-  uint index = get_global_id(0) * attrs.sample_ny * attrs.sample_nz
-             + get_global_id(1) * attrs.sample_nz
+  uint index = get_global_id(0) * SAMPLE_NY(attrs) * SAMPLE_NZ(attrs)
+             + get_global_id(1) * SAMPLE_NZ(attrs)
              + get_global_id(2);
   int running_total = 0;
   int i;
-  int num_entries = attrs.sample_nx * attrs.sample_ny * attrs.sample_nz;
+  int num_entries = SAMPLE_NX(attrs) * SAMPLE_NY(attrs) * SAMPLE_NZ(attrs);
 
-  if (get_global_id(0) >= attrs.sample_nx)
+  if (get_global_id(0) >= SAMPLE_NX(attrs))
     return;
-  if (get_global_id(1) >= attrs.sample_ny)
+  if (get_global_id(1) >= SAMPLE_NY(attrs))
     return;
-  if (get_global_id(2) >= attrs.sample_nz)
+  if (get_global_id(2) >= SAMPLE_NZ(attrs))
     return;
 
   for (i = 0; i < attrs.num_wg; ++i)
@@ -0,0 +1,59 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ *
+ * Seed space to diffusion space, one point per work item, in place.  See
+ * seedtransform.h; SeedTransform::Apply() is the host copy.
+ */
+
+__kernel void AffineSeeds(
+  global float4 *seeds,
+  uint count,
+  float4 row0,
+  float4 row1,
+  float4 row2
+)
+{
+  uint i = get_global_id(0);
+  if (i >= count)
+    return;
+
+  float4 p = (float4)(seeds[i].xyz, 1.f);
+  seeds[i] = (float4)(dot(row0, p), dot(row1, p), dot(row2, p), 0.f);
+}
+
+__kernel void WarpSeeds(
+  global float4 *seeds,
+  uint count,
+  global const float4 *field,  /* seed grid, mm */
+  uint4 seed_size,
+  float4 seed_dims,
+  float4 dti_dims
+)
+{
+  uint i = get_global_id(0);
+  if (i >= count)
+    return;
+
+  float4 p = seeds[i];
+  int4 last = (int4)(convert_int3(seed_size.xyz) - 1, 0);
+  float4 f = clamp(p, (float4)(0.f), convert_float4(last));
+  int4 lo = convert_int4(floor(f));
+  int4 hi = min(lo + 1, last);
+  float4 t = f - convert_float4(lo);
+
+#define FIELD(X, Y, Z) field[((X) * seed_size.y + (Y)) * seed_size.z + (Z)]
+  float4 d =
+      (1.f - t.x) * (1.f - t.y) * (1.f - t.z) * FIELD(lo.x, lo.y, lo.z)
+    + (1.f - t.x) * (1.f - t.y) * t.z         * FIELD(lo.x, lo.y, hi.z)
+    + (1.f - t.x) * t.y         * (1.f - t.z) * FIELD(lo.x, hi.y, lo.z)
+    + (1.f - t.x) * t.y         * t.z         * FIELD(lo.x, hi.y, hi.z)
+    + t.x         * (1.f - t.y) * (1.f - t.z) * FIELD(hi.x, lo.y, lo.z)
+    + t.x         * (1.f - t.y) * t.z         * FIELD(hi.x, lo.y, hi.z)
+    + t.x         * t.y         * (1.f - t.z) * FIELD(hi.x, hi.y, lo.z)
+    + t.x         * t.y         * t.z         * FIELD(hi.x, hi.y, hi.z);
+#undef FIELD
+
+  seeds[i] = (float4)((p.xyz * seed_dims.xyz + d.xyz) / dti_dims.xyz, 0.f);
+}
@@ -150,6 +150,21 @@ class oclptxOptions {
     Option<bool>              norng;
 
     Option<std::string>       gpuselect;
+    Option<std::string>       device;
+    Option<std::string>       kernelcache;
+    Option<bool>              specialize;
+    Option<bool>              cpu;
+    Option<int>               cputhreads;
+    Option<int>               bricks;
+    Option<std::string>       autotune;
+    Option<int>               stepsperkernel;
+    Option<int>               wgsize;
+    Option<int>               particlesperside;
+    Option<int>               reducers;
+    Option<std::string>       benchmark;
+    Option<bool>              kernelrefill;
+    Option<bool>              imagesamples;
+    Option<int>               matrixslots;
 
     // hidden options
     FmribOption<std::string>      prefdirfile;
@@ -224,7 +239,8 @@ inline oclptxOptions::oclptxOptions():
     coordinates)"), false, no_argument),
   network(std::string("--network"), false,
    std::string("Activate network mode - only keep paths going through at\
-    least one of the other seed masks"), false, no_argument),
+    least one of the other seed masks.  Each half of a path is judged on its\
+    own, as with --onewaycondition"), false, no_argument),
   simpleout(std::string("--opd"), false,
     std::string("\tOutput path distribution"),
       false, no_argument),
@@ -371,6 +387,75 @@ inline oclptxOptions::oclptxOptions():
     std::string("Run with specified gpu devices ONLY."),
       false, requires_argument),
 
+  device(std::string("--device"), "gpu",
+    std::string("OpenCL device type to track on: gpu (default), cpu or all."),
+      false, requires_argument),
+
+  kernelcache(std::string("--kernelcache"), "",
+    std::string("Directory for compiled kernel binaries (default \
+      $XDG_CACHE_HOME/oclptx or ~/.cache/oclptx). 'none' disables caching."),
+      false, requires_argument),
+
+  specialize(std::string("--specialize"), false,
+    std::string("Compile volume dimensions, step length and curvature \
+      threshold into the kernel. Faster tracking, but cached kernels are \
+      only reused for identical datasets and settings."),
+      false, no_argument),
+
+  cpu(std::string("--cpu"), false,
+    std::string("Track on the host CPUs instead of OpenCL devices."),
+      false, no_argument),
+
+  cputhreads(std::string("--cputhreads"), 0,
+    std::string("Number of tracking threads with --cpu (default: one per \
+      core)."), false, requires_argument),
+
+  bricks(std::string("--bricks"), 0,
+    std::string("Out-of-core tracking: split the volume into this many \
+      x-slabs and keep one resident per device at a time. For volumes too \
+      big for device memory."), false, requires_argument),
+
+  autotune(std::string("--autotune"), "auto",
+    std::string("Pick batch length, work-group size, particle count and \
+      reducer threads per device: 'auto' (default) reuses the profile saved \
+      in the kernel cache or calibrates, 'force' always calibrates, 'off' \
+      uses the built-in defaults."), false, requires_argument),
+
+  stepsperkernel(std::string("--stepsperkernel"), 0,
+    std::string("Steps per particle per kernel launch (default: tuned)."),
+      false, requires_argument),
+
+  wgsize(std::string("--wgsize"), 0,
+    std::string("OpenCL work-group size (default: tuned)."),
+      false, requires_argument),
+
+  particlesperside(std::string("--particlesperside"), 0,
+    std::string("Upper bound on particles in flight per device and side \
+      (default: tuned, at most what fits in memory)."),
+      false, requires_argument),
+
+  reducers(std::string("--reducers"), 0,
+    std::string("Host threads handling finished particles per device \
+      (default: tuned)."), false, requires_argument),
+
+  benchmark(std::string("--benchmark"), "",
+    std::string("Write throughput and per-stage timings, once a second, \
+      to this CSV file."), false, requires_argument),
+
+  kernelrefill(std::string("--kernelrefill"), false,
+    std::string("Let a work-item whose particle stops take a new one from \
+      a reserve on the device, instead of idling until the launch ends."),
+      false, no_argument),
+
+  imagesamples(std::string("--imagesamples"), false,
+    std::string("Keep samples in 3D images rather than buffers, so lookups \
+      go through the texture cache."), false, no_argument),
+
+  matrixslots(std::string("--matrixslots"), 1 << 20,
+    std::string("Non-zero entries each device can hold per connectivity \
+      matrix (--omatrix1, --omatrix3), rounded up to a power of two."),
+      false, requires_argument),
+
   prefdirfile(std::string("--prefdir"), std::string(""),
        std::string("Prefered orientation preset in a 4D mask"),
        false, requires_argument),
@@ -483,6 +568,21 @@ inline oclptxOptions::oclptxOptions():
     options.add(mem_risk_frac);
     options.add(norng);
     options.add(gpuselect);
+    options.add(device);
+    options.add(kernelcache);
+    options.add(specialize);
+    options.add(cpu);
+    options.add(cputhreads);
+    options.add(bricks);
+    options.add(autotune);
+    options.add(stepsperkernel);
+    options.add(wgsize);
+    options.add(particlesperside);
+    options.add(reducers);
+    options.add(benchmark);
+    options.add(kernelrefill);
+    options.add(imagesamples);
+    options.add(matrixslots);
   }
   catch(X_OptionError& e)
   {
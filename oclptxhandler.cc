@@ -5,20 +5,46 @@
  */
 
 #include "oclptxhandler.h"
+#include "oclenv.h"
 
 #include <assert.h>
 #include <math.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #ifdef __APPLE__
 #include <OpenCL/opencl.hpp>
 #else
 #include <CL/cl.hpp>
 #endif
 
+// Reserve header, must match oclkernels/attrs.h.
+enum
+{
+  kReserveNext = 0,
+  kReserveCount = 1,
+  kReserveFinished = 2,
+  kReserveHeader = 4
+};
+
+// Early rejection counts, must match oclkernels/attrs.h.  64 bits each, low
+// word first.
+enum
+{
+  kRejectsCount = 0,
+  kRejectsSteps = 2,
+  kRejectsHeader = 4
+};
+
+// With --kernelrefill, the reserve holds this fraction of a side.  A launch
+// only needs particles for the lanes that stop during it.
+static const int kReserveDivisor = 4;
+
 static void die(int reason)
 {
   if (CL_MEM_OBJECT_ALLOCATION_FAILURE == reason)
@@ -43,35 +69,78 @@ void OclPtxHandler::Init(
   struct OclPtxHandler::particle_attrs *attrs,
   FILE *path_dump_fd,
   int wg_size,
+  int max_wgs,
   EnvironmentData *env_dat,
-  cl::Buffer *global_pdf)
+  DeviceMemPlan *mem_plan,
+  cl::Buffer *global_pdf,
+  cl::Buffer *matrices,
+  cl::Buffer *s2t_counts,
+  cl::Buffer *path_dist,
+  cl::Buffer *path_dirs)
 {
   context_ = cc;
   cq_ = cq;
   ptx_kernel_ = ptx_kernel;
   sum_kernel_ = sum_kernel;
   first_time_ = 1;
+  launches_ = 0;
   path_dump_fd_ = path_dump_fd;
   env_dat_ = env_dat;
   attrs_ = *attrs;
 
   gpu_global_pdf_ = global_pdf;
+  gpu_matrices_ = matrices;
+  gpu_s2t_counts_ = s2t_counts;
+  gpu_path_dist_ = path_dist;
+  gpu_path_dirs_ = path_dirs;
 
   // TODO(steve): Make it possible to get workgroup size
   // (CL_KERNEL_WORKGROUP_SIZE I think) from oclenv.
   wg_size_ = wg_size;
 
-  // TODO(jeff): Check if we can actually allocate buffers this big.
-  int max_particles = env_dat->dynamic_mem_left / ParticleSize();
+  size_t particle_size = ParticleSize(attrs_, env_dat_, wg_size_);
+  int max_particles = mem_plan->dynamic_mem_left / particle_size;
+  printf("Particle size %liB\n", particle_size);
 
-  attrs_.num_wg = max_particles / wg_size_ / 2;
+  attrs_.num_wg =
+    PlanWorkGroups(attrs_, env_dat_, *mem_plan, wg_size_, max_wgs);
+
+  // The plan is only an estimate: drivers reserve memory of their own, and
+  // some limits only show up at launch.  Rather than exit after the samples
+  // are loaded, back off until the device accepts the particles.
+  cl_int ret;
+  while (1)
+  {
+    attrs_.particles_per_side = wg_size_ * attrs_.num_wg;
+    assert(attrs_.particles_per_side <= max_particles);
+    printf("Allocating %i particles in %i groups.\n",
+        attrs_.particles_per_side, attrs_.num_wg);
+
+    ret = InitParticles();
+    if (CL_SUCCESS == ret)
+      ret = ProbeLaunch();
+    if (CL_SUCCESS == ret)
+      break;
+
+    FreeParticles();
+    if ((CL_MEM_OBJECT_ALLOCATION_FAILURE != ret
+      && CL_OUT_OF_RESOURCES != ret)
+     || 1 == attrs_.num_wg)
+      die(ret);
 
-  attrs_.particles_per_side = wg_size_ * attrs_.num_wg;
-  assert(attrs_.particles_per_side <= max_particles);
-  printf("Allocating %i particles in %i groups.\n",
+    int num_wg = attrs_.num_wg * 3 / 4;
+    if (num_wg == attrs_.num_wg)
+      num_wg--;
+    printf("Device refused %i groups (error %i), retrying with %i.\n",
+        attrs_.num_wg, ret, num_wg);
+    attrs_.num_wg = num_wg;
+  }
+  printf("Settled on %i particles per side in %i groups.\n",
       attrs_.particles_per_side, attrs_.num_wg);
 
-  InitParticles();
+  mem_plan->particle_size = particle_size;
+  mem_plan->num_wg = attrs_.num_wg;
+  mem_plan->particles_per_side = attrs_.particles_per_side;
 }
 
 static size_t rbtree_size(const struct OclPtxHandler::particle_attrs attrs_)
@@ -86,7 +155,19 @@ static size_t rbtree_size(const struct OclPtxHandler::particle_attrs attrs_)
   return size;
 }
 
-size_t OclPtxHandler::ParticleSize()
+// With --wayorder a particle only keeps the next waypoint it expects.
+static size_t waypoints_size(const struct OclPtxHandler::particle_attrs attrs_,
+                             const EnvironmentData *env_dat_)
+{
+  if (env_dat_->way_order)
+    return sizeof(cl_ushort);
+  return attrs_.n_waypoint_masks * sizeof(cl_ushort);
+}
+
+size_t OclPtxHandler::ParticleSize(
+    const struct particle_attrs &attrs,
+    const EnvironmentData *env_dat,
+    int wg_size)
 {
   size_t size = 0;
   size += sizeof(struct particle_data);
@@ -94,56 +175,135 @@ size_t OclPtxHandler::ParticleSize()
   size += sizeof(cl_ushort);  // complete
   size += sizeof(cl_ushort);  // step_count
 
-  size += rbtree_size(attrs_);
+  size += rbtree_size(attrs);
 
   // Per workgroup brain.
-  size += ((attrs_.sample_nx 
-          * attrs_.sample_ny
-          * attrs_.sample_nz
-          / wg_size_
+  size += ((attrs.sample_nx 
+          * attrs.sample_ny
+          * attrs.sample_nz
+          / wg_size
           / 2) + 1) * sizeof(cl_int);
 
-  if (env_dat_->save_paths)
-    size += attrs_.steps_per_kernel * sizeof(cl_float4);
+  if (env_dat->save_paths)
+    size += attrs.steps_per_kernel * sizeof(cl_float4);
 
-  if (0 < env_dat_->n_waypts)
-    size += attrs_.n_waypoint_masks * sizeof(cl_ushort);
+  if (0 < env_dat->n_waypts)
+    size += waypoints_size(attrs, env_dat);
 
-  if (env_dat_->exclusion_mask)
+  if (env_dat->exclusion_mask)
     size += sizeof(cl_ushort);
 
-  if (env_dat_->loopcheck)
-    size += attrs_.lx * attrs_.ly * attrs_.lz * sizeof(float4);
+  if (0 < env_dat->n_targets)
+    size += sizeof(cl_uint);
+
+  if (env_dat->path_dist)
+    size += attrs.max_steps * sizeof(cl_ushort);
 
-  printf("Particle size %liB\n", size);
+  if (env_dat->path_dirs)
+    size += attrs.max_steps * sizeof(cl_char4);
+
+  if (env_dat->loopcheck)
+    size += attrs.lx * attrs.ly * attrs.lz * sizeof(float4);
+
+  if (env_dat->kernel_refill)
+    size += sizeof(struct particle_data) / kReserveDivisor / 2 + 1;
 
   return size;
 }
 
-void OclPtxHandler::InitParticles()
+size_t OclPtxHandler::LargestBufferPerGroup(
+    const struct particle_attrs &attrs,
+    const EnvironmentData *env_dat,
+    int wg_size)
+{
+  // Per-particle buffers hold both sides.
+  size_t per_particle = std::max(sizeof(struct particle_data),
+                                 rbtree_size(attrs));
+  if (env_dat->save_paths)
+    per_particle = std::max(per_particle,
+                            attrs.steps_per_kernel * sizeof(cl_float4));
+  if (env_dat->loopcheck)
+    per_particle = std::max(per_particle,
+                            attrs.lx * attrs.ly * attrs.lz * sizeof(float4));
+
+  size_t local_pdf = attrs.sample_nx
+                   * attrs.sample_ny
+                   * attrs.sample_nz
+                   * sizeof(cl_int);
+
+  return std::max(2 * wg_size * per_particle, local_pdf);
+}
+
+int OclPtxHandler::PlanWorkGroups(
+    const struct particle_attrs &attrs,
+    const EnvironmentData *env_dat,
+    const DeviceMemPlan &mem_plan,
+    int wg_size,
+    int max_wgs)
+{
+  int max_particles =
+    mem_plan.dynamic_mem_left / ParticleSize(attrs, env_dat, wg_size);
+
+  int num_wg = max_particles / wg_size / 2;
+  if (0 < max_wgs && max_wgs < num_wg)
+    num_wg = max_wgs;
+
+  // No single buffer may exceed the device's allocation limit.
+  int max_buffer_wgs = mem_plan.max_buffer_size
+                     / LargestBufferPerGroup(attrs, env_dat, wg_size);
+  if (max_buffer_wgs < num_wg)
+    num_wg = max_buffer_wgs;
+
+  return num_wg;
+}
+
+cl_int OclPtxHandler::InitParticles()
 {
   cl_int ret;
 
+  gpu_data_ = NULL;
+  gpu_sets_ = NULL;
+  gpu_complete_ = NULL;
+  gpu_local_pdf_ = NULL;
+  gpu_path_ = NULL;
+  gpu_step_count_ = NULL;
+  gpu_waypoints_ = NULL;
+  gpu_exclusion_ = NULL;
+  gpu_targets_ = NULL;
+  gpu_visit_steps_ = NULL;
+  gpu_visit_dirs_ = NULL;
+  gpu_loopcheck_ = NULL;
+  gpu_reserve_ = NULL;
+  gpu_reserve_head_ = NULL;
+  gpu_rejects_ = NULL;
+  reserve_size_ = 0;
+
   gpu_data_ = new cl::Buffer(
       *context_,
       CL_MEM_READ_WRITE,
-      2 * attrs_.particles_per_side * sizeof(struct particle_data));
-  if (!gpu_data_)
-    abort();
+      2 * attrs_.particles_per_side * sizeof(struct particle_data),
+      NULL,
+      &ret);
+  if (CL_SUCCESS != ret)
+    return ret;
 
   gpu_sets_ = new cl::Buffer(
       *context_,
       CL_MEM_READ_WRITE,
-      2 * attrs_.particles_per_side * rbtree_size(attrs_));
-  if (!gpu_sets_)
-    abort();
+      2 * attrs_.particles_per_side * rbtree_size(attrs_),
+      NULL,
+      &ret);
+  if (CL_SUCCESS != ret)
+    return ret;
 
   gpu_complete_ = new cl::Buffer(
       *context_,
       CL_MEM_READ_WRITE,
-      2 * attrs_.particles_per_side * sizeof(cl_ushort));
-  if (!gpu_complete_)
-    abort();
+      2 * attrs_.particles_per_side * sizeof(cl_ushort),
+      NULL,
+      &ret);
+  if (CL_SUCCESS != ret)
+    return ret;
 
   int local_pdf_size = attrs_.sample_nx
                      * attrs_.sample_ny
@@ -153,9 +313,11 @@ void OclPtxHandler::InitParticles()
   gpu_local_pdf_ = new cl::Buffer(
       *context_,
       CL_MEM_READ_WRITE,
-      local_pdf_size * sizeof(cl_int));
-  if (!gpu_local_pdf_)
-    abort();
+      local_pdf_size * sizeof(cl_int),
+      NULL,
+      &ret);
+  if (CL_SUCCESS != ret)
+    return ret;
 
   if (env_dat_->save_paths)
   {
@@ -163,60 +325,132 @@ void OclPtxHandler::InitParticles()
         *context_,
         CL_MEM_WRITE_ONLY,
         2 * attrs_.particles_per_side *
-          attrs_.steps_per_kernel * sizeof(cl_float4));
-    if (!gpu_path_)
-      abort();
+          attrs_.steps_per_kernel * sizeof(cl_float4),
+        NULL,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
   }
-  else
-    gpu_path_ = NULL;
 
   gpu_step_count_ = new cl::Buffer(
       *context_,
       CL_MEM_READ_WRITE,
-      2 * attrs_.particles_per_side * sizeof(cl_ushort));
-  if (!gpu_step_count_)
-    abort();
+      2 * attrs_.particles_per_side * sizeof(cl_ushort),
+      NULL,
+      &ret);
+  if (CL_SUCCESS != ret)
+    return ret;
 
   if (0 < env_dat_->n_waypts)
   {
     gpu_waypoints_ = new cl::Buffer(
         *context_,
         CL_MEM_READ_WRITE,
-        2 * attrs_.particles_per_side * attrs_.n_waypoint_masks * sizeof(cl_ushort));
-    if (!gpu_waypoints_)
-      abort();
+        2 * attrs_.particles_per_side * waypoints_size(attrs_, env_dat_),
+        NULL,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
   }
-  else
-    gpu_waypoints_ = NULL;
 
   if (env_dat_->exclusion_mask)
   {
     gpu_exclusion_ = new cl::Buffer(
         *context_,
         CL_MEM_READ_WRITE,
-        2 * attrs_.particles_per_side * sizeof(cl_ushort));
-    if (!gpu_exclusion_)
-      abort();
+        2 * attrs_.particles_per_side * sizeof(cl_ushort),
+        NULL,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
+  }
+
+  if (0 < env_dat_->n_targets)
+  {
+    gpu_targets_ = new cl::Buffer(
+        *context_,
+        CL_MEM_READ_WRITE,
+        2 * attrs_.particles_per_side * sizeof(cl_uint),
+        NULL,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
+  }
+
+  if (env_dat_->path_dist)
+  {
+    gpu_visit_steps_ = new cl::Buffer(
+        *context_,
+        CL_MEM_READ_WRITE,
+        2 * attrs_.particles_per_side * attrs_.max_steps * sizeof(cl_ushort),
+        NULL,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
+  }
+
+  if (env_dat_->path_dirs)
+  {
+    gpu_visit_dirs_ = new cl::Buffer(
+        *context_,
+        CL_MEM_READ_WRITE,
+        2 * attrs_.particles_per_side * attrs_.max_steps * sizeof(cl_char4),
+        NULL,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
   }
-  else
-    gpu_exclusion_ = NULL;
 
   if (env_dat_->loopcheck)
   {
     gpu_loopcheck_ = new cl::Buffer(
         *context_,
         CL_MEM_READ_WRITE,
-        2 * attrs_.particles_per_side * attrs_.lx * attrs_.ly * attrs_.lz * sizeof(float4));
-    if (!gpu_loopcheck_)
-      abort();
+        2 * attrs_.particles_per_side * attrs_.lx * attrs_.ly * attrs_.lz * sizeof(float4),
+        NULL,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
+  }
+
+  cl_uint rejects[kRejectsHeader] = {0,};
+  gpu_rejects_ = new cl::Buffer(
+      *context_,
+      CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+      sizeof(rejects),
+      rejects,
+      &ret);
+  if (CL_SUCCESS != ret)
+    return ret;
+
+  if (env_dat_->kernel_refill)
+  {
+    reserve_size_ = std::max(1, attrs_.particles_per_side / kReserveDivisor);
+    gpu_reserve_ = new cl::Buffer(
+        *context_,
+        CL_MEM_READ_ONLY,
+        reserve_size_ * sizeof(struct particle_data),
+        NULL,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
+
+    // Starts out empty.
+    cl_uint head[kReserveHeader] = {0,};
+    gpu_reserve_head_ = new cl::Buffer(
+        *context_,
+        CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+        sizeof(head),
+        head,
+        &ret);
+    if (CL_SUCCESS != ret)
+      return ret;
   }
-  else
-    gpu_loopcheck_ = NULL;
 
   // Initialize "completion" buffer.
   cl_ushort *temp_completion = new cl_ushort[2*attrs_.particles_per_side];
   for (int i = 0; i < 2 * attrs_.particles_per_side; ++i)
-    temp_completion[i] = 8;  // BREAK_INIT
+    temp_completion[i] = kBreakInit;
 
   ret = cq_->enqueueWriteBuffer(
       *gpu_complete_,
@@ -224,10 +458,10 @@ void OclPtxHandler::InitParticles()
       0,
       2 * attrs_.particles_per_side * sizeof(cl_ushort),
       reinterpret_cast<void*>(temp_completion));
-  if (CL_SUCCESS != ret)
-    die(ret);
 
   delete[] temp_completion;
+  if (CL_SUCCESS != ret)
+    return ret;
 
   // Initialize "local_pdfs" buffer.
   cl_int *temp_local_pdf = new cl_int[local_pdf_size];
@@ -239,149 +473,217 @@ void OclPtxHandler::InitParticles()
       0,
       local_pdf_size * sizeof(cl_int),
       reinterpret_cast<void*>(temp_local_pdf));
-  if (CL_SUCCESS != ret)
-    die(ret);
 
   delete[] temp_local_pdf;
+  return ret;
 }
 
-OclPtxHandler::~OclPtxHandler()
+// One launch on each side while every slot is empty, so the kernel returns
+// straight away.  Surfaces CL_OUT_OF_RESOURCES (too many groups, or memory
+// the driver only commits at launch) while it can still be retried.
+cl_int OclPtxHandler::ProbeLaunch()
+{
+  cl_int ret;
+
+  for (int side = 0; side < 2; ++side)
+  {
+    ret = EnqueueInterpKernel(side);
+    if (CL_SUCCESS != ret)
+      return ret;
+  }
+  ret = cq_->finish();
+  if (CL_SUCCESS != ret)
+    return ret;
+
+  // The probe marked every slot STILL_FINISHED, put them back.
+  cl_ushort *temp_completion = new cl_ushort[2*attrs_.particles_per_side];
+  for (int i = 0; i < 2 * attrs_.particles_per_side; ++i)
+    temp_completion[i] = kBreakInit;
+
+  ret = cq_->enqueueWriteBuffer(
+      *gpu_complete_,
+      true,
+      0,
+      2 * attrs_.particles_per_side * sizeof(cl_ushort),
+      reinterpret_cast<void*>(temp_completion));
+
+  delete[] temp_completion;
+  return ret;
+}
+
+void OclPtxHandler::FreeParticles()
 {
   delete gpu_data_;
   delete gpu_sets_;
   delete gpu_complete_;
   delete gpu_local_pdf_;
-  if (gpu_waypoints_)
-    delete gpu_waypoints_;
-  if (gpu_exclusion_)
-    delete gpu_exclusion_;
-  if (gpu_loopcheck_)
-    delete gpu_loopcheck_;
+  delete gpu_path_;
+  delete gpu_step_count_;
+  delete gpu_waypoints_;
+  delete gpu_exclusion_;
+  delete gpu_targets_;
+  delete gpu_visit_steps_;
+  delete gpu_visit_dirs_;
+  delete gpu_loopcheck_;
+  delete gpu_reserve_;
+  delete gpu_reserve_head_;
+  delete gpu_rejects_;
   // we let OclEnv delete gpu_global_pdf_
 }
 
+OclPtxHandler::~OclPtxHandler()
+{
+  FreeParticles();
+}
+
 int OclPtxHandler::particles_per_side()
 {
   return attrs_.particles_per_side;
 }
 
+int OclPtxHandler::launches()
+{
+  return launches_;
+}
+
 void OclPtxHandler::WriteParticle(
     struct particle_data *data,
     int offset)
+{
+  WriteParticles(data, &offset, 1);
+}
+
+void OclPtxHandler::WriteParticles(
+    struct particle_data *data,
+    const int *offsets,
+    int count)
 {
   // Note: locking.  This function is technically thread-unsafe, but that
   // shouldn't matter because threading is set up for only one thread to ever
   // call these methods.
   cl_int ret;
-  cl_ushort zero = 0;
-  assert(offset < 2 * attrs_.particles_per_side);
+  int run_start = 0;
 
-  if (NULL != path_dump_fd_)
-    fprintf(path_dump_fd_, "%i:%f,%f,%fn\n",
-        offset,
-        data->position.s[0],
-        data->position.s[1],
-        data->position.s[2]);
+  // One set of writes per run of neighbouring slots, and a single wait at
+  // the end.  Blocking writes per particle cost a round trip each.
+  for (int i = 1; i <= count; ++i)
+  {
+    if (i < count && offsets[i] == offsets[i - 1] + 1)
+      continue;
+
+    ret = EnqueueParticleRun(
+        data + run_start, offsets[run_start], i - run_start);
+    if (CL_SUCCESS != ret)
+    {
+      puts("Write failed!");
+      die(ret);
+    }
+    run_start = i;
+  }
+
+  ret = cq_->finish();
+  if (CL_SUCCESS != ret)
+    die(ret);
+}
+
+cl_int OclPtxHandler::EnqueueParticleRun(
+    struct particle_data *data,
+    int offset,
+    int count)
+{
+  cl_int ret;
+  assert(offset + count <= 2 * attrs_.particles_per_side);
+
+  if (env_dat_->save_paths)
+    for (int i = 0; i < count; ++i)
+      fprintf(path_dump_fd_, "%i:%f,%f,%fn\n",
+          offset + i,
+          data[i].position.s[0],
+          data[i].position.s[1],
+          data[i].position.s[2]);
 
   // Write particle_data
   ret = cq_->enqueueWriteBuffer(
       *gpu_data_,
-      true,
+      false,
       offset * sizeof(struct particle_data),
-      sizeof(struct particle_data),
+      count * sizeof(struct particle_data),
       reinterpret_cast<void*>(data));
   if (CL_SUCCESS != ret)
-  {
-    puts("Write failed!");
-    die(ret);
-  }
+    return ret;
 
-  // gpu_complete_ = 0
-  ret = cq_->enqueueWriteBuffer(
-      *gpu_complete_,
-      true,
-      offset * sizeof(cl_ushort),
-      sizeof(cl_ushort),
-      reinterpret_cast<void*>(&zero));
+  // gpu_complete_ = 0, step_count = 0
+  ret = EnqueueZeros(gpu_complete_, offset * sizeof(cl_ushort),
+                     count * sizeof(cl_ushort));
   if (CL_SUCCESS != ret)
-  {
-    puts("Write failed!");
-    die(ret);
-  }
+    return ret;
 
-  // step_count = 0
-  ret = cq_->enqueueWriteBuffer(
-      *gpu_step_count_,
-      true,
-      offset * sizeof(cl_ushort),
-      sizeof(cl_ushort),
-      reinterpret_cast<void*>(&zero));
+  ret = EnqueueZeros(gpu_step_count_, offset * sizeof(cl_ushort),
+                     count * sizeof(cl_ushort));
   if (CL_SUCCESS != ret)
-  {
-    puts("Write failed!");
-    die(ret);
-  }
+    return ret;
 
   // Initialize particle loopcheck
   if (gpu_loopcheck_)
   {
-    int loopcheck_entries_per_particle = (attrs_.lx
-                              * attrs_.ly
-                              * attrs_.lz);
-    cl_float4 *temp_loopcheck = new cl_float4[loopcheck_entries_per_particle];
-    cl_float4 zero_f4;
-    zero_f4.s[0] = 0.;
-    zero_f4.s[1] = 0.;
-    zero_f4.s[2] = 0.;
-    zero_f4.s[3] = 0.;
-    for (int i = 0; i < loopcheck_entries_per_particle; ++i)
-      temp_loopcheck[i] = zero_f4;
-
-    ret = cq_->enqueueWriteBuffer(
-        *gpu_loopcheck_,
-        true,
-        offset * loopcheck_entries_per_particle * sizeof(cl_float4),
-        loopcheck_entries_per_particle * sizeof(cl_float4),
-        temp_loopcheck);
+    size_t loopcheck_size = attrs_.lx * attrs_.ly * attrs_.lz
+                          * sizeof(cl_float4);
+    ret = EnqueueZeros(gpu_loopcheck_, offset * loopcheck_size,
+                       count * loopcheck_size);
     if (CL_SUCCESS != ret)
-      die(ret);
-
-    delete[] temp_loopcheck;
+      return ret;
   }
 
-  //TODO(jeff): Can we allocate in Init?
   if (gpu_waypoints_)
   {
-    cl_ushort *temp_waypoints = new cl_ushort[attrs_.n_waypoint_masks];
-    for (cl_uint i = 0; i < attrs_.n_waypoint_masks; ++i)
-      temp_waypoints[i] = 0;
-
-    ret = cq_->enqueueWriteBuffer(
-        *gpu_waypoints_,
-        true,
-        offset * attrs_.n_waypoint_masks * sizeof(cl_ushort),
-        attrs_.n_waypoint_masks * sizeof(cl_ushort),
-        temp_waypoints);
+    size_t particle_waypoints = waypoints_size(attrs_, env_dat_);
+    ret = EnqueueZeros(gpu_waypoints_, offset * particle_waypoints,
+                       count * particle_waypoints);
     if (CL_SUCCESS != ret)
-      die(ret);
-
-    delete[] temp_waypoints;
+      return ret;
   }
 
   if (gpu_exclusion_)
   {
-    cl_ushort temp_zero = 0;
+    ret = EnqueueZeros(gpu_exclusion_, offset * sizeof(cl_ushort),
+                       count * sizeof(cl_ushort));
+    if (CL_SUCCESS != ret)
+      return ret;
+  }
 
-    ret = cq_->enqueueWriteBuffer(
-      *gpu_exclusion_,
-      true,
-      offset * sizeof(cl_ushort),
-      sizeof(cl_ushort),
-      &temp_zero
-    );
+  if (gpu_targets_)
+  {
+    ret = EnqueueZeros(gpu_targets_, offset * sizeof(cl_uint),
+                       count * sizeof(cl_uint));
     if (CL_SUCCESS != ret)
-      die(ret);
+      return ret;
+  }
+
+  return CL_SUCCESS;
+}
+
+cl_int OclPtxHandler::EnqueueZeros(cl::Buffer *buf, size_t offset, size_t size)
+{
+  // Writes are non-blocking, so this buffer must never change once written
+  // from.  Large runs go in pieces rather than growing it without bound.
+  if (zeros_.empty())
+    zeros_.resize(kZeroChunk, 0);
+
+  while (size)
+  {
+    size_t piece = std::min(size, zeros_.size());
+    cl_int ret = cq_->enqueueWriteBuffer(
+        *buf,
+        false,
+        offset,
+        piece,
+        reinterpret_cast<void*>(&zeros_[0]));
+    if (CL_SUCCESS != ret)
+      return ret;
+    offset += piece;
+    size -= piece;
   }
+  return CL_SUCCESS;
 }
 
 void OclPtxHandler::SetInterpArg(int pos, cl::Buffer *buf)
@@ -400,9 +702,8 @@ void OclPtxHandler::SetSumArg(int pos, cl::Buffer *buf)
     sum_kernel_->setArg(pos, NULL);
 }
 
-void OclPtxHandler::RunInterpKernel(int side)
+cl_int OclPtxHandler::EnqueueInterpKernel(int side)
 {
-  cl_int ret;
   cl::NDRange particles_to_compute(attrs_.particles_per_side);
   cl::NDRange particle_workgroups(wg_size_);
   cl::NDRange particle_offset(attrs_.particles_per_side * side);
@@ -420,31 +721,77 @@ void OclPtxHandler::RunInterpKernel(int side)
   SetInterpArg(7, gpu_waypoints_);
   SetInterpArg(8, gpu_exclusion_);
   SetInterpArg(9, gpu_loopcheck_);
+  SetInterpArg(18, gpu_reserve_);
+  SetInterpArg(19, gpu_reserve_head_);
+  SetInterpArg(20, env_dat_->matrix_labels_buffer);
+  SetInterpArg(21, gpu_matrices_);
+  SetInterpArg(22, env_dat_->target_masks_buffer);
+  SetInterpArg(23, gpu_targets_);
+  SetInterpArg(24, gpu_s2t_counts_);
+  SetInterpArg(25, gpu_visit_steps_);
+  SetInterpArg(26, gpu_path_dist_);
+  SetInterpArg(27, gpu_visit_dirs_);
+  SetInterpArg(28, gpu_path_dirs_);
+  SetInterpArg(29, gpu_rejects_);
+
+  if (env_)
+  {
+    // Out of core: the resident brick, in one tile.
+    BrickBuffers *bricks = env_->GetBrickBuffers(device_);
+    SetInterpArg(10, bricks->samples);
+    for (int i = 11; i <= 13; ++i)
+      SetInterpArg(i, NULL);
+    SetInterpArg(14, bricks->brain_mask);
+    SetInterpArg(15, bricks->waypoint_masks);
+    SetInterpArg(16, bricks->termination_mask);
+    SetInterpArg(17, bricks->exclusion_mask);
+
+    return cq_->enqueueNDRangeKernel(
+      *(ptx_kernel_),
+      particle_offset,
+      particles_to_compute,
+      particle_workgroups,
+      NULL,
+      NULL);
+  }
 
-  SetInterpArg(10, env_dat_->f_samples_buffers[0]);
-  SetInterpArg(11, env_dat_->phi_samples_buffers[0]);
-  SetInterpArg(12, env_dat_->theta_samples_buffers[0]);
-  SetInterpArg(13, env_dat_->f_samples_buffers[1]);
-  SetInterpArg(14, env_dat_->phi_samples_buffers[1]);
-  SetInterpArg(15, env_dat_->theta_samples_buffers[1]);
-  SetInterpArg(16, env_dat_->brain_mask_buffer);
-  SetInterpArg(17, env_dat_->waypoint_masks_buffer);
-  SetInterpArg(18, env_dat_->termination_mask_buffer);
-  SetInterpArg(19, env_dat_->exclusion_mask_buffer);
+  // One argument per tile.  Images past the last tile are never read but
+  // must still be set.
+  for (uint32_t t = 0; t < kMaxSampleTiles; ++t)
+  {
+    if (env_dat_->image_samples)
+      ptx_kernel_->setArg(10 + t, *env_dat_->sample_images[
+          t < env_dat_->sample_tiles ? t : 0]);
+    else
+      SetInterpArg(10 + t, env_dat_->samples_buffers[t]);
+  }
+  SetInterpArg(14, env_dat_->brain_mask_buffer);
+  SetInterpArg(15, env_dat_->waypoint_masks_buffer);
+  SetInterpArg(16, env_dat_->termination_mask_buffer);
+  SetInterpArg(17, env_dat_->exclusion_mask_buffer);
 
-  ret = cq_->enqueueNDRangeKernel(
+  return cq_->enqueueNDRangeKernel(
     *(ptx_kernel_),
     particle_offset,
     particles_to_compute,
     particle_workgroups,
     NULL,
     NULL);
+}
+
+void OclPtxHandler::RunInterpKernel(int side)
+{
+  cl_int ret;
+
+  ret = EnqueueInterpKernel(side);
   if (CL_SUCCESS != ret)
     die(ret);
 
   ret = cq_->finish();
   if (CL_SUCCESS != ret)
     die(ret);
+
+  launches_++;
 }
 
 void OclPtxHandler::RunSumKernel()
@@ -481,6 +828,135 @@ void OclPtxHandler::RunKernel(int side)
   RunInterpKernel(side);
 }
 
+int OclPtxHandler::reserve_size()
+{
+  return reserve_size_;
+}
+
+void OclPtxHandler::WriteReserve(struct particle_data *data, int count)
+{
+  cl_int ret;
+  cl_uint head[kReserveHeader] = {0,};
+  assert(count <= reserve_size_);
+  head[kReserveCount] = count;
+
+  if (count)
+  {
+    ret = cq_->enqueueWriteBuffer(
+        *gpu_reserve_,
+        false,
+        0,
+        count * sizeof(struct particle_data),
+        reinterpret_cast<void*>(data));
+    if (CL_SUCCESS != ret)
+    {
+      puts("Write failed!");
+      die(ret);
+    }
+  }
+
+  ret = cq_->enqueueWriteBuffer(
+      *gpu_reserve_head_,
+      true,
+      0,
+      sizeof(head),
+      reinterpret_cast<void*>(head));
+  if (CL_SUCCESS != ret)
+  {
+    puts("Write failed!");
+    die(ret);
+  }
+}
+
+void OclPtxHandler::ReadReserve(int *taken, int *finished)
+{
+  cl_uint head[kReserveHeader];
+
+  cl_int ret = cq_->enqueueReadBuffer(
+      *gpu_reserve_head_,
+      true,
+      0,
+      sizeof(head),
+      reinterpret_cast<void*>(head));
+  if (CL_SUCCESS != ret)
+  {
+    puts("Read failed!");
+    die(ret);
+  }
+
+  // Lanes that found it empty still bumped kReserveNext.
+  *taken = std::min(head[kReserveNext], head[kReserveCount]);
+  *finished = head[kReserveFinished];
+}
+
+void OclPtxHandler::PrintRejects()
+{
+  cl_uint rejects[kRejectsHeader];
+
+  cl_int ret = cq_->enqueueReadBuffer(
+      *gpu_rejects_,
+      true,
+      0,
+      sizeof(rejects),
+      reinterpret_cast<void*>(rejects));
+  if (CL_SUCCESS != ret)
+  {
+    puts("Read failed!");
+    die(ret);
+  }
+
+  uint64_t count = rejects[kRejectsCount]
+                 + (static_cast<uint64_t>(rejects[kRejectsCount + 1]) << 32);
+  uint64_t steps = rejects[kRejectsSteps]
+                 + (static_cast<uint64_t>(rejects[kRejectsSteps + 1]) << 32);
+  if (0 < count)
+    printf("Stopped %llu rejected particles early, saving at most %llu steps "
+        "(an upper bound, from the steps left before --nsteps).\n",
+        static_cast<unsigned long long>(count),
+        static_cast<unsigned long long>(steps));
+}
+
+void OclPtxHandler::SetBricks(OclEnv *env, int device)
+{
+  env_ = env;
+  device_ = device;
+}
+
+int OclPtxHandler::num_bricks()
+{
+  return env_ ? env_dat_->n_bricks : 1;
+}
+
+void OclPtxHandler::LoadBrick(int brick)
+{
+  BrickInfo info = env_->LoadBrick(device_, brick);
+
+  attrs_.brick_width = info.width;
+  attrs_.brick_first_x = info.first_x;
+  attrs_.brick_last_x = info.last_x;
+  attrs_.brick_base_x = info.base_x;
+  attrs_.brick_nx = info.nx;
+}
+
+void OclPtxHandler::ResumeParticle(int offset)
+{
+  cl_int ret;
+  cl_ushort zero = 0;
+  assert(offset < 2 * attrs_.particles_per_side);
+
+  ret = cq_->enqueueWriteBuffer(
+      *gpu_complete_,
+      true,
+      offset * sizeof(cl_ushort),
+      sizeof(cl_ushort),
+      reinterpret_cast<void*>(&zero));
+  if (CL_SUCCESS != ret)
+  {
+    puts("Write failed!");
+    die(ret);
+  }
+}
+
 void OclPtxHandler::ReadStatus(int offset, int count, cl_ushort *ret)
 {
   cl_int err = cq_->enqueueReadBuffer(
@@ -13,41 +13,17 @@
 #include <CL/cl.hpp>
 #endif
 
+#include <atomic>
+#include <vector>
+
 #include "customtypes.h"
+#include "ptxhandler.h"
+
+class OclEnv;
 
-class OclPtxHandler{
+class OclPtxHandler : public PtxHandler{
  public:
-  struct particle_data
-  {
-    cl_ulong8 rng;
-    cl_float4 position;
-    cl_float4 dr;
-  } __attribute__((aligned(64)));
-
-  struct particle_attrs
-  {
-    cl_float4 brain_mask_dim;
-    cl_int steps_per_kernel;
-    cl_int max_steps;
-    cl_int min_steps;
-    cl_int particles_per_side;
-    cl_uint sample_nx;
-    cl_uint sample_ny;
-    cl_uint sample_nz;
-    cl_uint num_samples;
-    cl_float curvature_threshold;
-    cl_uint n_waypoint_masks;
-    cl_float step_length;
-    cl_uint lx;  // Loopcheck sizes
-    cl_uint ly;
-    cl_uint lz;
-    cl_int fibst;
-    cl_int randfib;
-    cl_float fibthresh;
-    cl_int num_wg;
-  } __attribute__((aligned(16)));
-
-  OclPtxHandler() {}
+  OclPtxHandler(): env_(NULL), device_(0) {}
   void Init(
       cl::Context *cc,
       cl::CommandQueue *cq,
@@ -56,14 +32,39 @@ class OclPtxHandler{
       struct particle_attrs *attrs,
       FILE *path_dump_fd,
       int num_wgs,
+      int max_wgs,  // Cap on work groups per side, 0 for none
       EnvironmentData *env_dat,
-      cl::Buffer *global_pdf);
+      DeviceMemPlan *mem_plan,  // This device's.  Sizing is filled in.
+      cl::Buffer *global_pdf,
+      // Connectivity tables, seeds to targets counts, path length and
+      // direction sums, NULL to leave them be.
+      cl::Buffer *matrices,
+      cl::Buffer *s2t_counts,
+      cl::Buffer *path_dist,
+      cl::Buffer *path_dirs);
   ~OclPtxHandler();
+  // Track out of core, on device's BrickBuffers.  Call before Init.
+  void SetBricks(OclEnv *env, int device);
+
+  // Work-groups per side Init() starts from, before backing off for a
+  // device that refuses them.  Allocates nothing.
+  static int PlanWorkGroups(
+      const struct particle_attrs &attrs,
+      const EnvironmentData *env_dat,
+      const DeviceMemPlan &mem_plan,
+      int wg_size,
+      int max_wgs);
 
   int particles_per_side();
+  // Number of interpolation kernels that have run to completion.
+  int launches();
 
   // Write a single particle
   void WriteParticle(struct particle_data *data, int offset);
+  void WriteParticles(
+      struct particle_data *data,
+      const int *offsets,
+      int count);
   // Run Kernel asyncronously
   void RunKernel(int side);
   // Read the "completion" buffer back into the vector pointed to by ret.
@@ -73,11 +74,37 @@ class OclPtxHandler{
   // Aggregate the paths.
   void RunSumKernel();
 
+  int reserve_size();
+  void WriteReserve(struct particle_data *data, int count);
+  void ReadReserve(int *taken, int *finished);
+
+  void PrintRejects();
+
+  int num_bricks();
+  void LoadBrick(int brick);
+  void ResumeParticle(int offset);
+
  private:
-  size_t ParticleSize();
-  void InitParticles();
+  static size_t ParticleSize(
+      const struct particle_attrs &attrs,
+      const EnvironmentData *env_dat,
+      int wg_size);
+  // Largest single buffer, per work group of particles.
+  static size_t LargestBufferPerGroup(
+      const struct particle_attrs &attrs,
+      const EnvironmentData *env_dat,
+      int wg_size);
+  // Returns the first OpenCL error, leaving FreeParticles() to clean up.
+  cl_int InitParticles();
+  cl_int ProbeLaunch();
+  void FreeParticles();
   void SetInterpArg(int pos, cl::Buffer *buf);
   void SetSumArg(int pos, cl::Buffer *buf);
+  cl_int EnqueueInterpKernel(int side);
+  // Writes count particles into neighbouring slots from offset, and clears
+  // their per-particle state.  Doesn't wait.
+  cl_int EnqueueParticleRun(struct particle_data *data, int offset, int count);
+  cl_int EnqueueZeros(cl::Buffer *buf, size_t offset, size_t size);
   void RunInterpKernel(int side);
 
   struct particle_attrs attrs_;
@@ -96,18 +123,38 @@ class OclPtxHandler{
   cl::Buffer *gpu_waypoints_;
   cl::Buffer *gpu_exclusion_;
   cl::Buffer *gpu_loopcheck_;
+  cl::Buffer *gpu_reserve_;  // Type particle_data, with --kernelrefill
+  cl::Buffer *gpu_reserve_head_;  // RESERVE_HEADER uints, see attrs.h
+  cl::Buffer *gpu_rejects_;  // REJECTS_HEADER uints, see attrs.h
+  int reserve_size_;
   cl::Buffer *gpu_global_pdf_;
   cl::Buffer *gpu_local_pdf_;
+  cl::Buffer *gpu_matrices_;  // Owned by OclEnv, may be NULL
+  cl::Buffer *gpu_s2t_counts_;  // Owned by OclEnv, may be NULL
+  cl::Buffer *gpu_targets_;  // Targets hit, a uint per particle
+  cl::Buffer *gpu_path_dist_;  // Owned by OclEnv, may be NULL
+  cl::Buffer *gpu_visit_steps_;  // Steps to each rbtree node, with --pd
+  cl::Buffer *gpu_path_dirs_;  // Owned by OclEnv, may be NULL
+  cl::Buffer *gpu_visit_dirs_;  // Direction into each rbtree node, char4s
 
   // Debug Data
   cl::Buffer *gpu_path_;  // Type ulong
   cl::Buffer *gpu_step_count_; // Type ushort
 
+  static const size_t kZeroChunk = 1 << 20;
+  std::vector<char> zeros_;
+
   FILE *path_dump_fd_;
   bool first_time_;
+  // Read by main's progress loop.
+  std::atomic<int> launches_;
 
   // TODO(jeff) avoid keeping this pointer, instead keep pointer to real env.
   EnvironmentData * env_dat_;
+
+  // Out of core only, else NULL.
+  OclEnv *env_;
+  int device_;
 };
 
 #endif  // OCLPTXHANDLER_H_
@@ -9,11 +9,20 @@
 #include "fifo.h"
 #include "newimage/newimageall.h"
 #include "miscmaths/miscmaths.h"
-#include "oclptxhandler.h"
+#include "ptxhandler.h"
+#include "oclenv.h"
 #include "oclptxOptions.h"
 #include "customtypes.h"
+#include "seedtransform.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <fstream>
+#include <random>
 #include <thread>
+#include <vector>
 
 uint64_t Rand64()
 {
@@ -42,9 +51,18 @@ cl_ulong8 NewRng()
   return rng;
 }
 
+static int NearestVoxel(float p, int n)
+{
+  int v = static_cast<int>(floor(p + .5));
+  return std::min(std::max(v, 0), n - 1);
+}
+
 ParticleGenerator::ParticleGenerator():
   particle_fifo_(NULL),
-  particlegen_thread_(NULL)
+  particlegen_thread_(NULL),
+  env_(NULL),
+  seed_transform_(NULL),
+  seeds_(NULL)
 {}
 
 ParticleGenerator::~ParticleGenerator()
@@ -53,30 +71,74 @@ ParticleGenerator::~ParticleGenerator()
     particlegen_thread_->join();
   delete particlegen_thread_;
   delete particle_fifo_;
+  delete seed_transform_;
+  if (seeds_)
+  {
+    delete[] seeds_->newSeeds;
+    delete[] seeds_->seedVoxels;
+    delete[] seeds_->seedRois;
+  }
+  delete seeds_;
 }
 
 struct ParticleGenerator::add_particle_args {
   float *newSeeds;
+  cl_uint *seedVoxels;
+  cl_uint *seedRois;
   int count;
   float xdim;
   float ydim;
   float zdim;
 };
 
-Fifo<struct OclPtxHandler::particle_data> *ParticleGenerator::Init(int fifo_size)
+// Every pass over the seeds (CountParticles, SeedVoxels, Sample and Init)
+// starts here, so the seed file or network masks are only read once.
+struct ParticleGenerator::add_particle_args ParticleGenerator::ReadSeeds()
+{
+  if (NULL == seeds_)
+    seeds_ = new struct add_particle_args(LoadSeeds());
+
+  struct add_particle_args args = *seeds_;
+  args.newSeeds = new float[3 * args.count];
+  args.seedVoxels = new cl_uint[args.count];
+  args.seedRois = new cl_uint[args.count];
+  std::copy(seeds_->newSeeds, seeds_->newSeeds + 3 * args.count,
+            args.newSeeds);
+  std::copy(seeds_->seedVoxels, seeds_->seedVoxels + args.count,
+            args.seedVoxels);
+  std::copy(seeds_->seedRois, seeds_->seedRois + args.count, args.seedRois);
+  return args;
+}
+
+struct ParticleGenerator::add_particle_args ParticleGenerator::LoadSeeds()
 {
   oclptxOptions& opts = oclptxOptions::getInstance();
   NEWIMAGE::volume<short int> seedref;
+  struct add_particle_args args;
 
   read_volume(seedref,opts.seedref.value());
 
+  if (opts.network.value())
+    args = ReadNetworkSeeds(seedref);
+  else
+    args = ReadSeedFile(seedref);
+
+  if (opts.seeds_to_dti.value() != "")
+    ToDiffusion(&args);
+  return args;
+}
+
+struct ParticleGenerator::add_particle_args ParticleGenerator::ReadSeedFile(
+    const NEWIMAGE::volume<short int> &seedref)
+{
+  oclptxOptions& opts = oclptxOptions::getInstance();
   NEWMAT::Matrix Seeds = read_ascii_matrix(opts.seedfile.value());
   if (Seeds.Ncols() != 3 && Seeds.Nrows() == 3)
     Seeds = Seeds.t();
 
-  total_particles_ = 2 * opts.nparticles.value() * Seeds.Nrows();
-
   float *newSeeds = new float[Seeds.Nrows() * 3];
+  cl_uint *seedVoxels = new cl_uint[Seeds.Nrows()];
+  cl_uint *seedRois = new cl_uint[Seeds.Nrows()];
 
   // convert coordinates from nifti (external) to newimage (internal)
   //   conventions - Note: for radiological files this should do nothing
@@ -89,21 +151,205 @@ Fifo<struct OclPtxHandler::particle_data> *ParticleGenerator::Init(int fifo_size
     newSeeds[3*n]   = v(1);
     newSeeds[3*n+1] = v(2);
     newSeeds[3*n+2] = v(3);
-  }
 
-  particle_fifo_ =
-      new Fifo<struct OclPtxHandler::particle_data>(fifo_size);
+    // Nearest voxel, as the kernel looks up masks.
+    int vx = NearestVoxel(v(1), seedref.xsize());
+    int vy = NearestVoxel(v(2), seedref.ysize());
+    int vz = NearestVoxel(v(3), seedref.zsize());
+    seedVoxels[n] = (vx * seedref.ysize() + vy) * seedref.zsize() + vz;
+    seedRois[n] = 0;
+  }
 
   struct add_particle_args args = {newSeeds,
+                                   seedVoxels,
+                                   seedRois,
                                    Seeds.Nrows(),
                                    seedref.xdim(),
                                    seedref.ydim(),
                                    seedref.zdim()};
+  return args;
+}
+
+// Network mode: -x lists one ROI mask per line, and every voxel of every ROI
+// is a seed, tagged with its ROI.
+struct ParticleGenerator::add_particle_args ParticleGenerator::ReadNetworkSeeds(
+    const NEWIMAGE::volume<short int> &seedref)
+{
+  oclptxOptions& opts = oclptxOptions::getInstance();
+  std::vector<float> coords;
+  std::vector<cl_uint> voxels;
+  std::vector<cl_uint> rois;
+
+  std::ifstream roi_list(opts.seedfile.value().c_str());
+  std::string roi_name;
+  for (cl_uint roi = 0; roi_list >> roi_name; ++roi)
+  {
+    NEWIMAGE::volume<short int> roi_mask;
+    read_volume(roi_mask, roi_name);
+    // Seed voxels index the --seedref grid.
+    if (roi_mask.xsize() != seedref.xsize()
+     || roi_mask.ysize() != seedref.ysize()
+     || roi_mask.zsize() != seedref.zsize())
+    {
+      printf("Network mask %s is %ix%ix%i, but --seedref is %ix%ix%i.\n",
+        roi_name.c_str(), roi_mask.xsize(), roi_mask.ysize(),
+        roi_mask.zsize(), seedref.xsize(), seedref.ysize(),
+        seedref.zsize());
+      exit(EXIT_FAILURE);
+    }
+    for (int x = 0; x < roi_mask.xsize(); x++)
+      for (int y = 0; y < roi_mask.ysize(); y++)
+        for (int z = 0; z < roi_mask.zsize(); z++)
+          if (roi_mask(x, y, z))
+          {
+            coords.push_back(x);
+            coords.push_back(y);
+            coords.push_back(z);
+            voxels.push_back((x * seedref.ysize() + y) * seedref.zsize() + z);
+            rois.push_back(roi);
+          }
+  }
+
+  float *newSeeds = new float[coords.size()];
+  cl_uint *seedVoxels = new cl_uint[voxels.size()];
+  cl_uint *seedRois = new cl_uint[rois.size()];
+  std::copy(coords.begin(), coords.end(), newSeeds);
+  std::copy(voxels.begin(), voxels.end(), seedVoxels);
+  std::copy(rois.begin(), rois.end(), seedRois);
+
+  struct add_particle_args args = {newSeeds,
+                                   seedVoxels,
+                                   seedRois,
+                                   static_cast<int>(rois.size()),
+                                   seedref.xdim(),
+                                   seedref.ydim(),
+                                   seedref.zdim()};
+  return args;
+}
+
+void ParticleGenerator::UseDevice(OclEnv *env)
+{
+  env_ = env;
+}
+
+const SeedTransform *ParticleGenerator::SeedToDiffusion()
+{
+  oclptxOptions& opts = oclptxOptions::getInstance();
+  if (opts.seeds_to_dti.value() == "")
+    return NULL;
+
+  if (NULL == seed_transform_)
+  {
+    NEWIMAGE::volume<short int> seedref;
+    NEWIMAGE::read_volume_hdr_only(seedref, opts.seedref.value());
+    NEWIMAGE::read_volume_hdr_only(dti_ref_, opts.maskfile.value());
+    seed_transform_ = new SeedTransform;
+    seed_transform_->Init(opts.seeds_to_dti.value(),
+                          opts.dti_to_seeds.value(),
+                          seedref,
+                          dti_ref_);
+  }
+  return seed_transform_;
+}
+
+// Seeds are read in voxels of --seedref.  LoadSeeds() only runs once, so
+// neither does the transform.
+void ParticleGenerator::ToDiffusion(struct add_particle_args *args)
+{
+  const SeedTransform *xfm = SeedToDiffusion();
+
+  if (env_)
+    env_->TransformSeeds(*xfm, args->newSeeds, args->count);
+  else
+    xfm->Apply(args->newSeeds, args->count);
+
+  for (int n = 0; n < args->count; n++)
+  {
+    int vx = NearestVoxel(args->newSeeds[3*n], dti_ref_.xsize());
+    int vy = NearestVoxel(args->newSeeds[3*n+1], dti_ref_.ysize());
+    int vz = NearestVoxel(args->newSeeds[3*n+2], dti_ref_.zsize());
+    args->seedVoxels[n] = (vx * dti_ref_.ysize() + vy) * dti_ref_.zsize() + vz;
+  }
+  args->xdim = dti_ref_.xdim();
+  args->ydim = dti_ref_.ydim();
+  args->zdim = dti_ref_.zdim();
+}
+
+Fifo<struct PtxHandler::particle_data> *ParticleGenerator::Init(int fifo_size)
+{
+  oclptxOptions& opts = oclptxOptions::getInstance();
+  struct add_particle_args args = ReadSeeds();
+
+  total_particles_ = 2 * opts.nparticles.value() * args.count;
+
+  particle_fifo_ =
+      new Fifo<struct PtxHandler::particle_data>(fifo_size);
+
   particlegen_thread_ = new std::thread(&ParticleGenerator::AddParticles, this, args);
 
   return particle_fifo_;
 }
 
+Fifo<struct PtxHandler::particle_data> *ParticleGenerator::Sample(int count)
+{
+  struct add_particle_args args = ReadSeeds();
+  std::mt19937_64 gen(args.count);
+  std::uniform_int_distribution<int> pick(0, args.count - 1);
+  struct PtxHandler::particle_data *particle;
+  cl_ulong8 rng = {{0,}};
+
+  Fifo<struct PtxHandler::particle_data> *fifo =
+      new Fifo<struct PtxHandler::particle_data>(count + 1);
+
+  for (int p = 0; p < count; p++)
+  {
+    int seed = pick(gen);
+    particle = new PtxHandler::particle_data;
+    for (int i = 0; i < 5; i++)
+      rng.s[i] = gen();
+    particle->rng = rng;
+    particle->position.s[0] = args.newSeeds[3*seed];
+    particle->position.s[1] = args.newSeeds[3*seed+1];
+    particle->position.s[2] = args.newSeeds[3*seed+2];
+    particle->position.s[3] = 0.;
+    particle->dr.s[0] = (p & 1) ? -1.0 : 1.0;
+    particle->dr.s[1] = 0.;
+    particle->dr.s[2] = 0.;
+    particle->dr.s[3] = 0.;
+    particle->seed_voxel = args.seedVoxels[seed];
+    particle->seed_roi = args.seedRois[seed];
+    fifo->Push(particle);
+  }
+  fifo->Finish();
+  delete[] args.newSeeds;
+  delete[] args.seedVoxels;
+  delete[] args.seedRois;
+
+  return fifo;
+}
+
+int64_t ParticleGenerator::CountParticles()
+{
+  oclptxOptions& opts = oclptxOptions::getInstance();
+  struct add_particle_args args = ReadSeeds();
+  delete[] args.newSeeds;
+  delete[] args.seedVoxels;
+  delete[] args.seedRois;
+
+  return 2 * opts.nparticles.value() * static_cast<int64_t>(args.count);
+}
+
+std::vector<cl_uint> ParticleGenerator::SeedVoxels()
+{
+  struct add_particle_args args = ReadSeeds();
+  std::vector<cl_uint> voxels(args.seedVoxels, args.seedVoxels + args.count);
+  delete[] args.newSeeds;
+  delete[] args.seedVoxels;
+  delete[] args.seedRois;
+
+  return voxels;
+}
+
 int64_t ParticleGenerator::total_particles()
 {
   return total_particles_;
@@ -117,19 +363,23 @@ void ParticleGenerator::AddParticles(struct add_particle_args args)
     x = args.newSeeds[3*i];
     y = args.newSeeds[3*i+1];
     z = args.newSeeds[3*i+2];
-    AddSeedParticle(x, y, z, args.xdim, args.ydim, args.zdim);
+    AddSeedParticle(x, y, z, args.xdim, args.ydim, args.zdim,
+                    args.seedVoxels[i], args.seedRois[i]);
   }
   particle_fifo_->Finish();
   delete[] args.newSeeds;
+  delete[] args.seedVoxels;
+  delete[] args.seedRois;
 }
 
 void ParticleGenerator::AddSeedParticle(
-    float x, float y, float z, float xdim, float ydim, float zdim)
+    float x, float y, float z, float xdim, float ydim, float zdim,
+    cl_uint seed_voxel, cl_uint seed_roi)
 {
   oclptxOptions& opts = oclptxOptions::getInstance();
 
   float sampvox = opts.sampvox.value();
-  struct OclPtxHandler::particle_data *particle;
+  struct PtxHandler::particle_data *particle;
 
   cl_float4 forward = {{ 1.0, 0., 0., 0.}};
   cl_float4 reverse = {{-1.0, 0., 0., 0.}};
@@ -160,16 +410,20 @@ void ParticleGenerator::AddSeedParticle(
     }
 
   
-    particle = new OclPtxHandler::particle_data;
+    particle = new PtxHandler::particle_data;
     particle->rng = NewRng();
     particle->position = pos;
     particle->dr = forward;
+    particle->seed_voxel = seed_voxel;
+    particle->seed_roi = seed_roi;
     particle_fifo_->Push(particle);
 
-    particle = new OclPtxHandler::particle_data;
+    particle = new PtxHandler::particle_data;
     particle->rng = NewRng();
     particle->position = pos;
     particle->dr = reverse;
+    particle->seed_voxel = seed_voxel;
+    particle->seed_roi = seed_roi;
     particle_fifo_->Push(particle);
   }
 }
@@ -9,26 +9,61 @@
 
 #include "fifo.h"
 #include "newimage/newimageall.h"
-#include "oclptxhandler.h"
+#include "ptxhandler.h"
+#include "seedtransform.h"
 
 #include <thread>
+#include <vector>
+
+class OclEnv;
 
 class ParticleGenerator
 {
  public:
   ParticleGenerator();
   ~ParticleGenerator();
-  Fifo<struct OclPtxHandler::particle_data> *Init(int fifo_size);
+  Fifo<struct PtxHandler::particle_data> *Init(int fifo_size);
+  // A finished FIFO of count particles from random seeds, for calibration
+  // runs.  Leaves rand() alone, so the real run is unaffected.  The caller
+  // deletes it.
+  Fifo<struct PtxHandler::particle_data> *Sample(int count);
+  // Particles in the real run.  Valid before Init.
+  int64_t CountParticles();
+  // The voxel each seed starts in, as particle_data::seed_voxel, in the
+  // order of the seed file.  Valid before Init.
+  std::vector<cl_uint> SeedVoxels();
+
+  // Seed transforms (--xfm) run on env's first device from now on, rather
+  // than on the host.
+  void UseDevice(OclEnv *env);
+  // NULL without --xfm.
+  const SeedTransform *SeedToDiffusion();
 
   int64_t total_particles();
  private:
-  Fifo<struct OclPtxHandler::particle_data> *particle_fifo_;
+  Fifo<struct PtxHandler::particle_data> *particle_fifo_;
   std::thread *particlegen_thread_;
   int64_t total_particles_;
+  OclEnv *env_;
+  SeedTransform *seed_transform_;
+  // Header of the brain mask, which seeds are moved onto.
+  NEWIMAGE::volume<short int> dti_ref_;
 
   struct add_particle_args;
+  // Every seed, as ReadSeeds() returns it.  Loaded once.
+  struct add_particle_args *seeds_;
+
+  // A copy of seeds_ for the caller to delete[].
+  struct add_particle_args ReadSeeds();
+  struct add_particle_args LoadSeeds();
+  struct add_particle_args ReadSeedFile(
+      const NEWIMAGE::volume<short int> &seedref);
+  struct add_particle_args ReadNetworkSeeds(
+      const NEWIMAGE::volume<short int> &seedref);
+  void ToDiffusion(struct add_particle_args *args);
   void AddParticles(struct add_particle_args);
   void AddSeedParticle(float x, float y, float z,
-    float xdim, float ydim, float zdim);
+    float xdim, float ydim, float zdim, cl_uint seed_voxel,
+    cl_uint seed_roi);
 };
 
@@ -0,0 +1,125 @@
+/* Copyright 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ *
+ * Interface shared by the tracking engines.  threading::RunThreads drives any
+ * of them the same way: write particles into free slots, run a batch of steps
+ * on one side while the other is being refilled, read back completion codes.
+ */
+
+#ifndef PTXHANDLER_H_
+#define PTXHANDLER_H_
+
+#include <stdio.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+class PtxHandler{
+ public:
+  // Completion codes that do not mean a particle finished.  Slots start out
+  // as kBreakInit, and a slot that was not refilled reads kStillFinished.
+  // These must match oclkernels/attrs.h.
+  // Codes from kBreakBrick up park a particle, still on the device, until
+  // brick (code - kBreakBrick) is loaded.
+  enum
+  {
+    kBreakInit = 8,
+    kStillFinished = 9,
+    kBreakBrick = 16
+  };
+
+  // These must match oclkernels/attrs.h.
+  struct particle_data
+  {
+    cl_ulong8 rng;
+    cl_float4 position;
+    cl_float4 dr;
+    cl_uint seed_voxel;  // x*ny*nz + y*nz + z of the seed, for matrices
+    cl_uint seed_roi;  // Seed mask, with --network
+  } __attribute__((aligned(64)));
+
+  struct particle_attrs
+  {
+    cl_float4 brain_mask_dim;
+    cl_int steps_per_kernel;
+    cl_int max_steps;
+    cl_int min_steps;
+    cl_int particles_per_side;
+    cl_uint sample_nx;
+    cl_uint sample_ny;
+    cl_uint sample_nz;
+    cl_uint num_samples;
+    cl_float curvature_threshold;
+    cl_uint n_waypoint_masks;
+    cl_float step_length;
+    cl_uint lx;  // Loopcheck sizes
+    cl_uint ly;
+    cl_uint lz;
+    cl_int fibst;
+    cl_int randfib;
+    cl_float fibthresh;
+    cl_int num_wg;
+    cl_uint brick_width;  // Resident brick, see BrickInfo
+    cl_uint brick_first_x;
+    cl_uint brick_last_x;
+    cl_uint brick_base_x;
+    cl_uint brick_nx;
+  } __attribute__((aligned(16)));
+
+  virtual ~PtxHandler() {}
+
+  virtual int particles_per_side() = 0;
+  // Number of step batches that have run to completion.
+  virtual int launches() = 0;
+
+  // Write a single particle
+  virtual void WriteParticle(struct particle_data *data, int offset) = 0;
+  // Write data[i] into slot offsets[i], for count particles.  Offsets
+  // ascend.
+  virtual void WriteParticles(
+      struct particle_data *data,
+      const int *offsets,
+      int count)
+  {
+    for (int i = 0; i < count; ++i)
+      WriteParticle(data + i, offsets[i]);
+  }
+  // Run one batch of steps on a side.  Returns once it has finished.
+  virtual void RunKernel(int side) = 0;
+  // Read the "completion" codes back into the vector pointed to by ret.
+  virtual void ReadStatus(int offset, int count, cl_ushort *ret) = 0;
+  // Dump path to file.
+  virtual void DumpPath(int offset, int count) = 0;
+  // Aggregate the paths.
+  virtual void RunSumKernel() = 0;
+
+  // In-kernel refill.  Engines without it have no reserve.
+  virtual int reserve_size() { return 0; }
+  // Replace the reserve's contents.  Nothing may be running.
+  virtual void WriteReserve(struct particle_data *data, int count) {}
+  // After a launch: how many reserve particles were taken from the front,
+  // and how many of the particles they replaced stopped during it.
+  virtual void ReadReserve(int *taken, int *finished)
+  {
+    *taken = 0;
+    *finished = 0;
+  }
+
+  // Report particles stopped as soon as they could no longer be kept (by
+  // --avoid or --wayorder), and the steps that saved.
+  virtual void PrintRejects() {}
+
+  // Out-of-core tracking.  Engines that hold the whole volume have one brick.
+  virtual int num_bricks() { return 1; }
+  // Make a brick resident.  Nothing may be running.
+  virtual void LoadBrick(int brick) {}
+  // Let a parked particle carry on from where it stopped.
+  virtual void ResumeParticle(int offset) {}
+};
+
+#endif  // PTXHANDLER_H_
@@ -33,6 +33,7 @@
 #include <fstream>
 #include <sstream>
 #include <cmath>
+#include <algorithm>
 
 #include "fifo.h"
 #include "oclptxhandler.h"
@@ -270,6 +271,43 @@ void SampleManager::LoadBedpostData(const std::string& aBasename)
   printf("\n");
 }
 
+// Count the fibers present on disk without reading any sample data.
+void SampleManager::ProbeBedpostData(const std::string& aBasename)
+{
+  std::string thetaSampleName;
+  _nFibers = 0;
+
+  if(NEWIMAGE::fsl_imageexists(aBasename+"_thsamples"))
+  {
+    _nFibers = 1;
+    thetaSampleName = aBasename+"_thsamples";
+  }
+  else
+  {
+    while(NEWIMAGE::fsl_imageexists(
+      aBasename+"_th"+IntTostring(_nFibers+1)+"samples"))
+    {
+      _nFibers++;
+    }
+    thetaSampleName = aBasename+"_th1samples";
+  }
+
+  if(_nFibers == 0)
+  {
+    std::cout<<
+     "Could not find samples. Exiting Program..."<<std::endl;
+    exit(1);
+  }
+
+  // Sizes only, the data itself is read by LoadSamples().
+  NEWIMAGE::volume4D<float> header;
+  NEWIMAGE::read_volume4D_hdr_only(header, thetaSampleName);
+  _geometry.nx = header.xsize();
+  _geometry.ny = header.ysize();
+  _geometry.nz = header.zsize();
+  _geometry.ns = header.tsize();
+}
+
 void SampleManager::ParseCommandLine(int argc, char** argv)
 {
   _oclptxOptions.parse_command_line(argc, argv);
@@ -281,16 +319,93 @@ void SampleManager::ParseCommandLine(int argc, char** argv)
 
   srand(_oclptxOptions.rseed.value());
 
-  if (_oclptxOptions.matrix1out.value() ||
-    _oclptxOptions.matrix3out.value())
+  if (_oclptxOptions.matrix3out.value() &&
+    _oclptxOptions.mask3.value() == "")
+  {
+    std::cout<<
+     "Error: --omatrix3 needs --target3"<<
+        std::endl;
+    exit(1);
+  }
+  if (_oclptxOptions.lrmask3.value() != "")
+  {
+    std::cout<<
+     "Error: --lrtarget3 is not supported, matrix3 is always NxN"<<
+        std::endl;
+    exit(1);
+  }
+
+  // Seeds to targets.  Targets are packed a bit each into a uint per voxel.
+  // Network mode tracks from the seed masks listed in --seed, and uses the
+  // same bits to tell which of them a path went through.
+  if (_oclptxOptions.s2tout.value() && _oclptxOptions.network.value())
   {
     std::cout<<
-     "Error: cannot use matrix1 and matrix3 in simple mode"<<
+     "Error: --os2t is not supported with --network"<<
         std::endl;
     exit(1);
   }
+  if (_oclptxOptions.s2tout.value() || _oclptxOptions.network.value())
+  {
+    const bool network = _oclptxOptions.network.value();
+    const std::string listName = network ?
+      _oclptxOptions.seedfile.value() : _oclptxOptions.targetfile.value();
+    std::ifstream targetList(listName.c_str());
+    if (!targetList)
+    {
+      if (network)
+        std::cout<<
+         "Error: --network needs a list of seed masks (--seed)"<<
+            std::endl;
+      else
+        std::cout<<
+         "Error: --os2t needs a list of target masks (--targetmasks)"<<
+            std::endl;
+      exit(1);
+    }
+    std::string targetName;
+    while(targetList >> targetName)
+      _targetNames.push_back(targetName);
+    if (_targetNames.empty() || _targetNames.size() > kMaxTargets)
+    {
+      std::cout<<
+       "Error: "<<(network ? "--seed" : "--targetmasks")<<
+       " must list between 1 and "<<kMaxTargets<<" masks"<<std::endl;
+      exit(1);
+    }
+  }
+
+  this->ProbeBedpostData(_oclptxOptions.basename.value());
+
+  // Same file LoadSamples() reads the brain mask from.
+  NEWIMAGE::volume<short int> maskHeader;
+  if(_oclptxOptions.seedref.value() == ""
+    || _oclptxOptions.seeds_to_dti.value() != "")
+    NEWIMAGE::read_volume_hdr_only(maskHeader,
+      _oclptxOptions.maskfile.value());
+  else
+    NEWIMAGE::read_volume_hdr_only(maskHeader,
+      _oclptxOptions.seedref.value());
+  _geometry.xdim = maskHeader.xdim();
+  _geometry.ydim = maskHeader.ydim();
+  _geometry.zdim = maskHeader.zdim();
+
+  _nWayMasks = 0;
+  if(_oclptxOptions.waypoints.set())
+  {
+    std::istringstream ss(_oclptxOptions.waypoints.value());
+    std::string wayMaskLocation;
+    while(std::getline(ss,wayMaskLocation,','))
+      _nWayMasks++;
+  }
+}
+
+void SampleManager::LoadSamples()
+{
   this->LoadBedpostData(_oclptxOptions.basename.value());
-  if(_oclptxOptions.seedref.value() == "")
+  // With --xfm, --seedref only describes the seeds.
+  if(_oclptxOptions.seedref.value() == ""
+    || _oclptxOptions.seeds_to_dti.value() != "")
   {
     NEWIMAGE::read_volume(_brainMask,
       _oclptxOptions.maskfile.value());
@@ -310,6 +425,40 @@ void SampleManager::ParseCommandLine(int argc, char** argv)
     NEWIMAGE::read_volume(_terminationMask,
     _oclptxOptions.stopfile.value());
   }
+  if(_oclptxOptions.matrix3out.value())
+  {
+    NEWIMAGE::read_volume(_target3Mask,
+    _oclptxOptions.mask3.value());
+  }
+  if(_oclptxOptions.loccurvthresh.value() != "")
+  {
+    NEWIMAGE::read_volume(_locCurvThresh,
+    _oclptxOptions.loccurvthresh.value());
+  }
+  if(_oclptxOptions.locfibchoice.value() != "")
+  {
+    NEWIMAGE::read_volume(_locFibChoice,
+    _oclptxOptions.locfibchoice.value());
+  }
+  for (unsigned int i = 0; i < _targetNames.size(); i++)
+  {
+    NEWIMAGE::volume<short int> vol;
+    NEWIMAGE::read_volume(vol, _targetNames.at(i));
+    // Indexed like the brain mask by GetTargetBitsToArray().
+    if (vol.xsize() != _brainMask.xsize()
+      || vol.ysize() != _brainMask.ysize()
+      || vol.zsize() != _brainMask.zsize())
+    {
+      std::cout<<
+       "Error: "<<(_oclptxOptions.network.value() ? "seed" : "target")<<
+       " mask "<<_targetNames.at(i)<<" is "<<vol.xsize()<<"x"<<
+       vol.ysize()<<"x"<<vol.zsize()<<", but the brain mask is "<<
+       _brainMask.xsize()<<"x"<<_brainMask.ysize()<<"x"<<
+       _brainMask.zsize()<<std::endl;
+      exit(1);
+    }
+    _targetMasks.push_back(vol);
+  }
   if(_oclptxOptions.waypoints.set())
   {
     std::string waypoints = _oclptxOptions.waypoints.value();
@@ -326,7 +475,40 @@ void SampleManager::ParseCommandLine(int argc, char** argv)
 
 const unsigned short int* SampleManager::GetBrainMaskToArray()
 {
-  return GetMaskToArray(_brainMask);
+  unsigned short int* target = GetMaskToArray(_brainMask);
+  const bool curvThresh = _oclptxOptions.loccurvthresh.value() != "";
+  const bool fibChoice = _oclptxOptions.locfibchoice.value() != "";
+  if (!curvThresh && !fibChoice)
+    return target;
+
+  const int sizeX = _brainMask.xsize();
+  const int sizeY = _brainMask.ysize();
+  const int sizeZ = _brainMask.zsize();
+  for (int x = 0; x < sizeX; x++)
+  {
+    for (int y = 0; y < sizeY; y++)
+    {
+      for (int z = 0; z < sizeZ; z++)
+      {
+        unsigned short int& voxel = target[x*sizeY*sizeZ + y*sizeZ + z];
+        if (voxel == 0)
+          continue;
+        voxel = 1;
+
+        if (fibChoice)
+        {
+          int choice = _locFibChoice(x,y,z);
+          if (choice == 1 || choice == 2)
+            voxel |= choice << kVoxelFibreShift;
+        }
+        if (curvThresh && _locCurvThresh(x,y,z) != 0)
+        {
+          voxel |= CurvatureLevel(_locCurvThresh(x,y,z)) << kVoxelCurvShift;
+        }
+      }
+    }
+  }
+  return target;
 }
 
 const unsigned short int* SampleManager::GetExclusionMaskToArray()
@@ -345,6 +527,183 @@ const unsigned short int* SampleManager::GetTerminationMaskToArray()
     return NULL;
 }
 
+const unsigned short int* SampleManager::GetTarget3MaskToArray()
+{
+  if(_oclptxOptions.matrix3out.value())
+    return GetMaskToArray(_target3Mask);
+  else
+    return NULL;
+}
+
+const cl_uint* SampleManager::GetTargetBitsToArray()
+{
+  if (_targetMasks.empty())
+    return NULL;
+
+  const int sizeX = _brainMask.xsize();
+  const int sizeY = _brainMask.ysize();
+  const int sizeZ = _brainMask.zsize();
+  cl_uint* target = new cl_uint[sizeX * sizeY * sizeZ];
+
+  for (int x = 0; x < sizeX; x++)
+  {
+    for (int y = 0; y < sizeY; y++)
+    {
+      for (int z = 0; z < sizeZ; z++)
+      {
+        cl_uint bits = 0;
+        for (unsigned int t = 0; t < _targetMasks.size(); t++)
+        {
+          if (_targetMasks.at(t)(x,y,z) != 0)
+            bits |= 1u << t;
+        }
+        target[x*sizeY*sizeZ + y*sizeZ + z] = bits;
+      }
+    }
+  }
+  return target;
+}
+
+// Mask file name without directory or extension.
+static std::string MaskBaseName(const std::string& aTargetName)
+{
+  std::string name = aTargetName.substr(aTargetName.find_last_of('/') + 1);
+  const char* extensions[] = {".nii.gz", ".nii", ".hdr", ".img"};
+  for (unsigned int e = 0; e < 4; e++)
+  {
+    std::string ext = extensions[e];
+    if (name.size() > ext.size() &&
+      name.compare(name.size() - ext.size(), ext.size(), ext) == 0)
+    {
+      name.erase(name.size() - ext.size());
+      break;
+    }
+  }
+  return name;
+}
+
+// seeds_to_<target>, named after the target file as probtrackx does.
+static std::string SeedsToTargetName(const std::string& aTargetName)
+{
+  return "seeds_to_" + MaskBaseName(aTargetName);
+}
+
+void SampleManager::WriteSeedsToTargets(
+  const uint32_t* counts,
+  const std::vector<cl_uint>& seed_voxels)
+{
+  const int sizeX = _brainMask.xsize();
+  const int sizeY = _brainMask.ysize();
+  const int sizeZ = _brainMask.zsize();
+  const size_t voxels = sizeX * sizeY * sizeZ;
+
+  if (_oclptxOptions.s2tastext.value())
+  {
+    // One row per seed voxel, in the order of the seed file.
+    std::ofstream matrix("matrix_seeds_to_all_targets");
+    std::vector<bool> written(voxels, false);
+    for (unsigned int i = 0; i < seed_voxels.size(); i++)
+    {
+      cl_uint v = seed_voxels.at(i);
+      if (v >= voxels || written[v])
+        continue;
+      written[v] = true;
+
+      matrix << v / (sizeY*sizeZ) << " " << v / sizeZ % sizeY << " "
+        << v % sizeZ;
+      for (unsigned int t = 0; t < _targetNames.size(); t++)
+        matrix << " " << counts[t*voxels + v];
+      matrix << std::endl;
+    }
+    return;
+  }
+
+  for (unsigned int t = 0; t < _targetNames.size(); t++)
+  {
+    NEWIMAGE::volume<float> seedsToTarget;
+    NEWIMAGE::copyconvert(_brainMask, seedsToTarget);
+    seedsToTarget = 0;
+    for (int x = 0; x < sizeX; x++)
+      for (int y = 0; y < sizeY; y++)
+        for (int z = 0; z < sizeZ; z++)
+          seedsToTarget(x,y,z) =
+            counts[t*voxels + x*sizeY*sizeZ + y*sizeZ + z];
+    NEWIMAGE::save_volume(seedsToTarget,
+      SeedsToTargetName(_targetNames.at(t)));
+  }
+}
+
+void SampleManager::WriteNetwork(const uint32_t* counts)
+{
+  const int sizeX = _brainMask.xsize();
+  const int sizeY = _brainMask.ysize();
+  const int sizeZ = _brainMask.zsize();
+  const size_t voxels = sizeX * sizeY * sizeZ;
+  const size_t nRois = _targetNames.size();
+
+  std::ofstream matrix("fdt_network_matrix");
+  for (size_t i = 0; i < nRois; i++)
+  {
+    for (size_t j = 0; j < nRois; j++)
+      matrix << counts[i*nRois + j] << (j + 1 < nRois ? " " : "");
+    matrix << std::endl;
+  }
+
+  const uint32_t* pdfs = counts + nRois*nRois;
+  for (size_t i = 0; i < nRois; i++)
+  {
+    NEWIMAGE::volume<float> pdf;
+    NEWIMAGE::copyconvert(_brainMask, pdf);
+    pdf = 0;
+    for (int x = 0; x < sizeX; x++)
+      for (int y = 0; y < sizeY; y++)
+        for (int z = 0; z < sizeZ; z++)
+          pdf(x,y,z) = pdfs[i*voxels + x*sizeY*sizeZ + y*sizeZ + z];
+    NEWIMAGE::save_volume(pdf,
+      "fdt_paths_" + MaskBaseName(_targetNames.at(i)));
+  }
+}
+
+void SampleManager::WritePathDirs(const float* tensors)
+{
+  const int sizeX = _brainMask.xsize();
+  const int sizeY = _brainMask.ysize();
+  const int sizeZ = _brainMask.zsize();
+  const size_t voxels = sizeX * sizeY * sizeZ;
+
+  NEWIMAGE::volume<float> frame;
+  NEWIMAGE::copyconvert(_brainMask, frame);
+  frame = 0;
+  NEWIMAGE::volume4D<float> pathDirs;
+  for (int c = 0; c < 3; c++)
+    pathDirs.addvolume(frame);
+
+  // Principal eigenvector of each voxel's tensor.  Its sign is arbitrary,
+  // as a tract has no direction.
+  NEWMAT::SymmetricMatrix tensor(3);
+  NEWMAT::DiagonalMatrix values;
+  NEWMAT::Matrix vectors;
+  for (int x = 0; x < sizeX; x++)
+    for (int y = 0; y < sizeY; y++)
+      for (int z = 0; z < sizeZ; z++)
+      {
+        const float* t = tensors + x*sizeY*sizeZ + y*sizeZ + z;
+        if (t[0] + t[3*voxels] + t[5*voxels] <= 0)
+          continue;
+        tensor(1,1) = t[0];
+        tensor(1,2) = t[voxels];
+        tensor(1,3) = t[2*voxels];
+        tensor(2,2) = t[3*voxels];
+        tensor(2,3) = t[4*voxels];
+        tensor(3,3) = t[5*voxels];
+        NEWMAT::EigenValues(tensor, values, vectors);
+        // Eigenvalues come out in ascending order.
+        for (int c = 0; c < 3; c++)
+          pathDirs[c](x,y,z) = vectors(c+1,3);
+      }
+  NEWIMAGE::save_volume4D(pathDirs, "fdt_paths_dir");
+}
+
 vector<unsigned short int*>* SampleManager::GetWayMasksToVector()
 {
   vector<unsigned short int*>* waymasks =
@@ -465,6 +824,9 @@ cl_float4 SampleManager::brain_mask_dim()
 
 SampleManager::SampleManager():
   _oclptxOptions(oclptxOptions::getInstance()),
+  _nFibers(0),
+  _nWayMasks(0),
+  _geometry(),
   loaded_(0)
 {}
 
@@ -62,8 +62,15 @@ class SampleManager
     // specified, the program will seed using a single point:
     // the midpoint of the brainmask data.
     // TODO: Update with documentation required for Waymasks
+    //
+    // Only parses options and probes the sample files on disk; nothing is
+    // loaded until LoadSamples() is called.  Everything OpenCL needs to build
+    // its kernels is known after this returns.
     void ParseCommandLine(int argc, char** argv);
 
+    // Load bedpostx samples and masks named by the parsed options.
+    void LoadSamples();
+
     //Getters: Data
     float const GetThetaData(int aFiberNum,
       int aSamp, int aX, int aY, int aZ);
@@ -72,9 +79,30 @@ class SampleManager
     float const GetfData(int aFiberNum,
       int aSamp, int aX, int aY, int aZ);
 
+    // Non-zero inside the brain.  With --loccurvthresh or --locfibchoice,
+    // each voxel also carries its local rules, see kVoxelCurvShift.
     const unsigned short int* GetBrainMaskToArray();
     const unsigned short int* GetExclusionMaskToArray();
     const unsigned short int* GetTerminationMaskToArray();
+    // NULL unless --omatrix3.
+    const unsigned short int* GetTarget3MaskToArray();
+    // Bit t is set in every voxel of target t, or with --network of seed
+    // mask t.  NULL unless --os2t or --network.
+    const cl_uint* GetTargetBitsToArray();
+
+    // Seeds to targets: counts holds a volume per target, indexed like the
+    // masks.  One seeds_to_<target> volume per target, or with --s2tastext a
+    // row per seed voxel in matrix_seeds_to_all_targets.
+    void WriteSeedsToTargets(
+      const uint32_t* counts,
+      const std::vector<cl_uint>& seed_voxels);
+    // Network mode: counts holds the NxN seed mask matrix, then a path
+    // distribution volume per seed mask.  Writes fdt_network_matrix and
+    // fdt_paths_<mask>.
+    void WriteNetwork(const uint32_t* counts);
+    // --opathdir: tensors as OclEnv::ReadPathDirs() sums them.  Writes the
+    // mean tract orientation of each voxel, a 3 frame fdt_paths_dir.
+    void WritePathDirs(const float* tensors);
     vector<unsigned short int*>* GetWayMasksToVector();
 
     // Getters:
@@ -82,6 +110,12 @@ class SampleManager
     int const GetNumParticles() {return _nParticles;}
     int const GetNumMaxSteps() {return _nMaxSteps;}
 
+    // Known as soon as the command line has been parsed.
+    int const GetNumFibers() {return _nFibers;}
+    int const GetNumWayMasks() {return _nWayMasks;}
+    int const GetNumTargets() {return _targetNames.size();}
+    const SampleGeometry& GetSampleGeometry() {return _geometry;}
+
     // If you use these getters, you must access data from
     // the BedpostXData vector as follows:
     // Ex Theta: thetaData.data.at(aFiberNum)[(aSamp)*(nx*ny*nz) +
@@ -101,6 +135,7 @@ class SampleManager
     cl_float4 brain_mask_dim();
 
   private:
+    void ProbeBedpostData(const std::string& aBasename);
     void LoadBedpostData(const std::string& aBasename);
     void Progress();
     void LoadBedpostDataHelper(
@@ -147,6 +182,11 @@ class SampleManager
     bool exclude;
     NEWIMAGE::volume<short int> _terminationMask;
     bool terminate;
+    NEWIMAGE::volume<short int> _target3Mask;
+    NEWIMAGE::volume<float> _locCurvThresh;
+    NEWIMAGE::volume<short int> _locFibChoice;
+    std::vector<std::string> _targetNames;
+    std::vector<NEWIMAGE::volume<short int>> _targetMasks;
     std::vector<NEWIMAGE::volume<short int>> _wayMasks;
     bool way;
     //Path Logging
@@ -154,6 +194,9 @@ class SampleManager
     //Input Constants
     int _nParticles; //Default 5000
     int _nMaxSteps; //Default 2000
+    int _nFibers;
+    int _nWayMasks;
+    SampleGeometry _geometry;
 
     int loaded_;
 };
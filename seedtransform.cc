@@ -0,0 +1,181 @@
+/* Copyright (C) 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ */
+
+#include "seedtransform.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "miscmaths/miscmaths.h"
+#include "newimage/newimageall.h"
+
+SeedTransform::SeedTransform():
+  is_warp_(false)
+{
+  cl_uint4 no_size = {{0, 0, 0, 0}};
+  cl_float4 unit_dims = {{1., 1., 1., 0.}};
+  cl_float4 zero = {{0., 0., 0., 0.}};
+
+  seed_size_ = no_size;
+  seed_dims_ = unit_dims;
+  dti_dims_ = unit_dims;
+  for (int r = 0; r < 3; r++)
+  {
+    affine_rows_[r] = zero;
+    affine_rows_[r].s[r] = 1.;
+  }
+}
+
+void SeedTransform::Init(
+    const std::string& xfm,
+    const std::string& inv_xfm,
+    const NEWIMAGE::volume<short int>& seed_ref,
+    const NEWIMAGE::volume<short int>& dti_ref)
+{
+  seed_size_.s[0] = seed_ref.xsize();
+  seed_size_.s[1] = seed_ref.ysize();
+  seed_size_.s[2] = seed_ref.zsize();
+  seed_dims_.s[0] = seed_ref.xdim();
+  seed_dims_.s[1] = seed_ref.ydim();
+  seed_dims_.s[2] = seed_ref.zdim();
+  dti_dims_.s[0] = dti_ref.xdim();
+  dti_dims_.s[1] = dti_ref.ydim();
+  dti_dims_.s[2] = dti_ref.zdim();
+
+  is_warp_ = NEWIMAGE::fsl_imageexists(xfm);
+  if (!is_warp_)
+  {
+    NEWMAT::Matrix flirt = MISCMATHS::read_ascii_matrix(xfm);
+    if (flirt.Nrows() != 4 || flirt.Ncols() != 4)
+    {
+      printf("--xfm %s is neither an image nor a 4x4 matrix.\n", xfm.c_str());
+      exit(EXIT_FAILURE);
+    }
+    NEWMAT::Matrix vox_to_vox =
+      dti_ref.sampling_mat().i() * flirt * seed_ref.sampling_mat();
+    cl_float4 rows[3];
+    for (int r = 0; r < 3; r++)
+      for (int c = 0; c < 4; c++)
+        rows[r].s[c] = vox_to_vox(r + 1, c + 1);
+    InitAffine(rows);
+    return;
+  }
+
+  if (inv_xfm == "")
+  {
+    printf("--xfm is a warp, so --invxfm is needed too.\n");
+    exit(EXIT_FAILURE);
+  }
+  NEWIMAGE::volume4D<float> warp;
+  NEWIMAGE::read_volume4D(warp, inv_xfm);
+  if (warp.tsize() != 3
+   || warp.xsize() != seed_ref.xsize()
+   || warp.ysize() != seed_ref.ysize()
+   || warp.zsize() != seed_ref.zsize())
+  {
+    printf("--invxfm must be a displacement field (3 volumes) on the grid "
+      "of --seedref.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  std::vector<cl_float4> field(static_cast<size_t>(warp.xsize())
+    * warp.ysize() * warp.zsize());
+  for (int x = 0; x < warp.xsize(); x++)
+    for (int y = 0; y < warp.ysize(); y++)
+      for (int z = 0; z < warp.zsize(); z++)
+      {
+        cl_float4 &d = field[(x * warp.ysize() + y) * warp.zsize() + z];
+        d.s[0] = warp(x, y, z, 0);
+        d.s[1] = warp(x, y, z, 1);
+        d.s[2] = warp(x, y, z, 2);
+        d.s[3] = 0.;
+      }
+  InitWarp(seed_size_, seed_dims_, dti_dims_, std::move(field));
+}
+
+void SeedTransform::InitAffine(const cl_float4 rows[3])
+{
+  is_warp_ = false;
+  for (int r = 0; r < 3; r++)
+    affine_rows_[r] = rows[r];
+}
+
+void SeedTransform::InitWarp(
+    cl_uint4 seed_size,
+    cl_float4 seed_dims,
+    cl_float4 dti_dims,
+    std::vector<cl_float4> field)
+{
+  is_warp_ = true;
+  seed_size_ = seed_size;
+  seed_dims_ = seed_dims;
+  dti_dims_ = dti_dims;
+  field_.swap(field);
+}
+
+// Trilinear, clamped to the grid, as WarpSeeds.
+cl_float4 SeedTransform::Displacement(float x, float y, float z) const
+{
+  float p[3] = {x, y, z};
+  int lo[3], hi[3];
+  float t[3];
+  for (int i = 0; i < 3; i++)
+  {
+    float f = std::min(std::max(p[i], 0.f),
+                       static_cast<float>(seed_size_.s[i] - 1));
+    lo[i] = static_cast<int>(floor(f));
+    hi[i] = std::min<int>(lo[i] + 1, seed_size_.s[i] - 1);
+    t[i] = f - lo[i];
+  }
+
+  cl_float4 d = {{0., 0., 0., 0.}};
+  for (int corner = 0; corner < 8; corner++)
+  {
+    int v[3];
+    float w = 1.;
+    for (int i = 0; i < 3; i++)
+    {
+      bool upper = corner & (4 >> i);
+      v[i] = upper ? hi[i] : lo[i];
+      w *= upper ? t[i] : 1. - t[i];
+    }
+    const cl_float4 &c =
+      field_[(v[0] * seed_size_.s[1] + v[1]) * seed_size_.s[2] + v[2]];
+    for (int i = 0; i < 3; i++)
+      d.s[i] += w * c.s[i];
+  }
+  return d;
+}
+
+void SeedTransform::Apply(float *xyz, int count) const
+{
+  for (int n = 0; n < count; n++)
+  {
+    float *p = &xyz[3 * n];
+    float q[3];
+    if (is_warp_)
+    {
+      cl_float4 d = Displacement(p[0], p[1], p[2]);
+      for (int i = 0; i < 3; i++)
+        q[i] = (p[i] * seed_dims_.s[i] + d.s[i]) / dti_dims_.s[i];
+    }
+    else
+    {
+      for (int i = 0; i < 3; i++)
+        q[i] = affine_rows_[i].s[0] * p[0] + affine_rows_[i].s[1] * p[1]
+             + affine_rows_[i].s[2] * p[2] + affine_rows_[i].s[3];
+    }
+    p[0] = q[0];
+    p[1] = q[1];
+    p[2] = q[2];
+  }
+}
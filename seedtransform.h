@@ -0,0 +1,71 @@
+/* Copyright (C) 2014
+ *  Afshin Haidari
+ *  Steve Novakov
+ *  Jeff Taylor
+ *
+ * Seed space to diffusion space (--xfm).  Seeds are given in voxels of
+ * --seedref, and tracking wants them in voxels of the brain mask.  A FLIRT
+ * matrix folds into one voxel to voxel affine.  A warp, as probtrackx, is
+ * applied through --invxfm, which lives on the seed grid and holds the
+ * displacement to diffusion space in mm.  oclkernels/transform.cl does
+ * either on a device, and Apply() does the same on the host.
+ */
+
+#ifndef SEEDTRANSFORM_H_
+#define SEEDTRANSFORM_H_
+
+#include <string>
+#include <vector>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.hpp>
+#else
+#include <CL/cl.hpp>
+#endif
+
+#include "newimage/newimageall.h"
+
+class SeedTransform
+{
+ public:
+  SeedTransform();
+  // Exits if a transform can't be read, or a warp isn't on the seed grid.
+  void Init(const std::string& xfm,
+            const std::string& inv_xfm,
+            const NEWIMAGE::volume<short int>& seed_ref,
+            const NEWIMAGE::volume<short int>& dti_ref);
+  // As Init, from a transform already in hand.  rows as affine_rows().
+  void InitAffine(const cl_float4 rows[3]);
+  // field as field(), on a seed_size grid.
+  void InitWarp(cl_uint4 seed_size,
+                cl_float4 seed_dims,
+                cl_float4 dti_dims,
+                std::vector<cl_float4> field);
+
+  bool is_warp() const { return is_warp_; }
+  cl_uint4 seed_size() const { return seed_size_; }
+
+  // Affine: the first three rows, seed voxel to diffusion voxel.
+  const cl_float4* affine_rows() const { return affine_rows_; }
+
+  // Warp: relative displacement in mm per seed voxel, x*ny*nz + y*nz + z.
+  const std::vector<cl_float4>& field() const { return field_; }
+  // Voxel sizes in mm.
+  cl_float4 seed_dims() const { return seed_dims_; }
+  cl_float4 dti_dims() const { return dti_dims_; }
+
+  // count (x, y, z) triples, in place.
+  void Apply(float *xyz, int count) const;
+
+ private:
+  cl_float4 Displacement(float x, float y, float z) const;
+
+  bool is_warp_;
+  cl_uint4 seed_size_;
+  cl_float4 affine_rows_[3];
+  std::vector<cl_float4> field_;
+  cl_float4 seed_dims_;
+  cl_float4 dti_dims_;
+};
+
+#endif  // SEEDTRANSFORM_H_
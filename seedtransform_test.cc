@@ -0,0 +1,67 @@
+// Copyright 2014 Jeff Taylor
+// Test case for moving seeds to diffusion space on the host.
+
+#include "seedtransform.h"
+
+#include<cassert>
+#include<cmath>
+#include<cstdio>
+#include<vector>
+
+void CheckPoint(const float *got, float x, float y, float z)
+{
+  printf("(%g, %g, %g), expected (%g, %g, %g)\n",
+         got[0], got[1], got[2], x, y, z);
+  assert(fabs(got[0] - x) < 1e-5);
+  assert(fabs(got[1] - y) < 1e-5);
+  assert(fabs(got[2] - z) < 1e-5);
+}
+
+int main()
+{
+  // Affine: x' = 2x + 1, y' = z - 1, z' = 3y + 0.5.
+  cl_float4 rows[3] = {{{2., 0., 0., 1.}},
+                       {{0., 0., 1., -1.}},
+                       {{0., 3., 0., .5}}};
+  SeedTransform affine;
+  affine.InitAffine(rows);
+  assert(!affine.is_warp());
+
+  float points[6] = {1., 2., 3., 0., 0., 0.};
+  affine.Apply(points, 2);
+  CheckPoint(&points[0], 3., 2., 6.5);
+  CheckPoint(&points[3], 1., -1., .5);
+
+  puts("Affine");
+
+  // Warp on a 2x2x2 grid of 2mm voxels, to 1x1x2mm diffusion voxels.  The
+  // displacement is x: 1mm at x = 0 and 3mm at x = 1, y: 0.5mm, z: -z mm.
+  cl_uint4 size = {{2, 2, 2, 0}};
+  cl_float4 seed_dims = {{2., 2., 2., 0.}};
+  cl_float4 dti_dims = {{1., 1., 2., 0.}};
+  std::vector<cl_float4> field(8);
+  for (int x = 0; x < 2; x++)
+    for (int y = 0; y < 2; y++)
+      for (int z = 0; z < 2; z++)
+      {
+        cl_float4 &d = field[(x * 2 + y) * 2 + z];
+        d.s[0] = 1. + 2. * x;
+        d.s[1] = .5;
+        d.s[2] = -z;
+        d.s[3] = 0.;
+      }
+  SeedTransform warp;
+  warp.InitWarp(size, seed_dims, dti_dims, field);
+  assert(warp.is_warp());
+
+  // (0.5, 0, 1) is 1, 0, 2mm, displaced by 2, 0.5, -1mm trilinearly.
+  // (-1, 3, 0) is off the grid, displaced as the nearest voxel, (0, 1, 0).
+  float warped[6] = {.5, 0., 1., -1., 3., 0.};
+  warp.Apply(warped, 2);
+  CheckPoint(&warped[0], 3., .5, .5);
+  CheckPoint(&warped[3], -1., 6.5, 0.);
+
+  puts("Warp");
+
+  return 0;
+}
@@ -4,22 +4,85 @@
 //
 
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <thread>
+#include <vector>
+
+#include "threading.h"
 
 #include "fifo.h"
-#include "oclptxhandler.h"
+#include "loadbalancer.h"
+#include "morton.h"
+#include "ptxhandler.h"
 
 namespace threading
 {
 
+typedef std::chrono::high_resolution_clock Clock;
+
+// particle_data is 64-byte aligned, which new[] doesn't promise before
+// C++17.  Release with free().
+static struct PtxHandler::particle_data *AllocParticles(int count)
+{
+  void *mem = NULL;
+  if (0 == count)
+    return NULL;
+  if (posix_memalign(&mem, 64, count * sizeof(PtxHandler::particle_data)))
+  {
+    puts("Ran out of host memory while allocating particle buffers.");
+    exit(-1);
+  }
+  return reinterpret_cast<struct PtxHandler::particle_data*>(mem);
+}
+
+static double SecondsSince(Clock::time_point *t)
+{
+  Clock::time_point now = Clock::now();
+  std::chrono::duration<double> delta_t = now - *t;
+  *t = now;
+  return delta_t.count();
+}
+
+PipelineStats::PipelineStats()
+{
+  total_.batches = 0;
+  total_.finished = 0;
+  total_.wait = 0.;
+  total_.write = 0.;
+  total_.kernel = 0.;
+  total_.read = 0.;
+  total_.dump = 0.;
+}
+
+void PipelineStats::Add(const StageTimes &batch)
+{
+  std::unique_lock<std::mutex> lk(lock_);
+  total_.batches += batch.batches;
+  total_.finished += batch.finished;
+  total_.wait += batch.wait;
+  total_.write += batch.write;
+  total_.kernel += batch.kernel;
+  total_.read += batch.read;
+  total_.dump += batch.dump;
+}
+
+StageTimes PipelineStats::Get()
+{
+  std::unique_lock<std::mutex> lk(lock_);
+  return total_;
+}
+
 
 struct shared_data {
   int chunk_size;  // Amount of space allocated
   int count;  // Number of occupied elements
 
-  struct OclPtxHandler::particle_data *chunk;
+  struct PtxHandler::particle_data *chunk;
   cl_ushort *complete;
   int *particle_offset;
   int chunk_offset;
@@ -34,10 +97,206 @@ struct shared_data {
 
   bool done;
   bool has_data;
+  int finished;  // Particles that finished in the last batch
+
+  LoadBalancer *balancer;
+  int device;
+};
+
+// Out-of-core bookkeeping for one device (--bricks).  A particle that leaves
+// the resident brick parks in its slot, state intact, with the brick it needs
+// in its completion code.  Once far more particles wait on another brick than
+// run in this one, that brick is loaded and its particles resumed.
+class BrickManager
+{
+ public:
+  explicit BrickManager(PtxHandler *handler);
+
+  // Completion codes just read for slots [offset, offset + count).
+  void Update(int offset, int count, const cl_ushort *status);
+  // A new particle went into slot offset.
+  void Refilled(int offset);
+  // Nothing may be running on the device.
+  void MaybeSwitch();
+
+ private:
+  // Loading a brick costs a full upload, so only switch for a clear gain.
+  static const int kSwitchRatio = 2;
+  enum
+  {
+    kFree = -2,
+    kActive = -1
+  };
+
+  PtxHandler *handler_;
+  int resident_;
+  int switches_;
+  std::vector<int> slot_brick_;  // kFree, kActive or the brick waited on
+};
+
+BrickManager::BrickManager(PtxHandler *handler):
+  handler_(handler),
+  resident_(0),
+  switches_(0),
+  slot_brick_(2 * handler->particles_per_side(), kFree)
+{
+  handler_->LoadBrick(resident_);
+}
+
+void BrickManager::Update(int offset, int count, const cl_ushort *status)
+{
+  for (int i = 0; i < count; ++i)
+  {
+    if (0 == status[i])
+      slot_brick_[offset + i] = kActive;
+    else if (PtxHandler::kBreakBrick <= status[i])
+      slot_brick_[offset + i] = std::min<int>(
+          status[i] - PtxHandler::kBreakBrick, handler_->num_bricks() - 1);
+    else
+      slot_brick_[offset + i] = kFree;
+  }
+}
+
+void BrickManager::Refilled(int offset)
+{
+  slot_brick_[offset] = kActive;
+}
+
+void BrickManager::MaybeSwitch()
+{
+  std::vector<int> parked(handler_->num_bricks(), 0);
+  int active = 0;
+  for (size_t i = 0; i < slot_brick_.size(); ++i)
+  {
+    if (kActive == slot_brick_[i])
+      active++;
+    else if (0 <= slot_brick_[i])
+      parked[slot_brick_[i]]++;
+  }
+
+  int best = 0;
+  for (int b = 1; b < handler_->num_bricks(); ++b)
+    if (parked[b] > parked[best])
+      best = b;
+
+  if (0 == parked[best] || kSwitchRatio * active >= parked[best])
+    return;
+
+  handler_->LoadBrick(best);
+  resident_ = best;
+  switches_++;
+
+  for (size_t i = 0; i < slot_brick_.size(); ++i)
+  {
+    if (best == slot_brick_[i])
+    {
+      handler_->ResumeParticle(i);
+      slot_brick_[i] = kActive;
+    }
+  }
+}
+
+// In-kernel refill (--kernelrefill).  Lanes whose particle stops take the
+// next one from a reserve on the device instead of idling until the launch
+// ends.  The worker tops the reserve up from the FIFO before each launch.
+class RefillReserve
+{
+ public:
+  RefillReserve(
+      PtxHandler *handler,
+      Fifo<PtxHandler::particle_data> *particles,
+      LoadBalancer *balancer,
+      int device);
+  ~RefillReserve();
+
+  // Before a launch.
+  void TopUp();
+  // After a launch.  Returns how many particles stopped and were replaced
+  // during it, which the host never sees a completion code for.
+  int Collect();
+  // Particles still waiting.
+  int count() { return count_; }
+
+ private:
+  PtxHandler *handler_;
+  Fifo<PtxHandler::particle_data> *particles_;
+  LoadBalancer *balancer_;
+  int device_;
+  struct PtxHandler::particle_data *data_;
+  int count_;
 };
 
+RefillReserve::RefillReserve(
+    PtxHandler *handler,
+    Fifo<PtxHandler::particle_data> *particles,
+    LoadBalancer *balancer,
+    int device):
+  handler_(handler),
+  particles_(particles),
+  balancer_(balancer),
+  device_(device),
+  count_(0)
+{
+  data_ = AllocParticles(handler->reserve_size());
+}
+
+RefillReserve::~RefillReserve()
+{
+  free(data_);
+}
+
+void RefillReserve::TopUp()
+{
+  struct PtxHandler::particle_data *particle;
+  int first_new = count_;
+
+  while (count_ < handler_->reserve_size())
+  {
+    if (balancer_ && !balancer_->MayRefill(device_))
+      break;
+
+    particle = particles_->Pop();
+    if (!particle)
+      break;  // No particles left.
+
+    if (balancer_)
+      balancer_->Started(device_);
+
+    data_[count_++] = *particle;
+    delete particle;
+  }
+
+  // Lanes that stop together take neighbouring entries.
+  MortonSort(data_ + first_new, count_ - first_new);
+  handler_->WriteReserve(data_, count_);
+}
+
+int RefillReserve::Collect()
+{
+  int taken;
+  int finished;
+  handler_->ReadReserve(&taken, &finished);
+
+  // Lanes take from the front.
+  std::copy(data_ + taken, data_ + count_, data_);
+  count_ -= taken;
+
+  if (balancer_)
+    for (int i = 0; i < finished; ++i)
+      balancer_->Finished(device_);
+
+  return finished;
+}
+
 // Worker thread.  Controls the GPU.
-void Worker(struct shared_data *sdata, OclPtxHandler *handler, int num_reducers)
+void Worker(
+    struct shared_data *sdata,
+    PtxHandler *handler,
+    Fifo<PtxHandler::particle_data> *particles,
+    int num_reducers,
+    LoadBalancer *balancer,
+    int device,
+    PipelineStats *stats)
 {
   // Note, there are two "sides" of GPU memory.  At all times, a kernel must
   // only access the one side.  We must only copy data to and from the
@@ -45,11 +304,22 @@ void Worker(struct shared_data *sdata, OclPtxHandler *handler, int num_reducers)
   int inactive_side = 0;
   bool has_data_side[2] = {true, true};
   std::unique_lock<std::mutex> *lk[num_reducers];
+  BrickManager *bricks = NULL;
+  if (1 < handler->num_bricks())
+    bricks = new BrickManager(handler);
+  RefillReserve *reserve = NULL;
+  if (0 < handler->reserve_size())
+    reserve = new RefillReserve(handler, particles, balancer, device);
+
+  StageTimes batch;
+  Clock::time_point t_stage = Clock::now();
 
   while (1)
   {
-    // If no data on either side, we're done!
-    if (!has_data_side[0] && !has_data_side[1])
+    // If no data on either side, we're done!  Particles left in the reserve
+    // go to idle lanes on the next launch.
+    if (!has_data_side[0] && !has_data_side[1]
+     && (!reserve || 0 == reserve->count()))
     {
       // Wake up reducers and have them exit.
       for (int i = 0; i < num_reducers; ++i)
@@ -59,9 +329,16 @@ void Worker(struct shared_data *sdata, OclPtxHandler *handler, int num_reducers)
         sdata[i].data_ready_cv.notify_one();
         lock.unlock();
       }
+      delete bricks;
+      delete reserve;
       return;
     }
 
+    batch.batches = 1;
+    batch.finished = 0;
+    batch.wait = 0.;
+    batch.write = 0.;
+
     has_data_side[inactive_side] = false;
     for (int i = 0; i < num_reducers; ++i)
     {
@@ -72,18 +349,38 @@ void Worker(struct shared_data *sdata, OclPtxHandler *handler, int num_reducers)
                                             std::chrono::milliseconds(100));
       }
       sdata[i].reduction_complete = false;
+      batch.finished += sdata[i].finished;
 
       if (sdata[i].has_data)
       {
         has_data_side[inactive_side] = true;
-        for (int j = 0; j < sdata[i].count; ++j)
-          handler->WriteParticle(
-              (sdata[i].chunk + j),
-              sdata[i].particle_offset[j]);
+        batch.wait += SecondsSince(&t_stage);
+        handler->WriteParticles(
+            sdata[i].chunk,
+            sdata[i].particle_offset,
+            sdata[i].count);
+        batch.write += SecondsSince(&t_stage);
+        if (bricks)
+          for (int j = 0; j < sdata[i].count; ++j)
+            bricks->Refilled(sdata[i].particle_offset[j]);
       }
     }
+    batch.wait += SecondsSince(&t_stage);
+
+    if (bricks)
+      bricks->MaybeSwitch();
+    if (reserve)
+    {
+      reserve->TopUp();
+      batch.write += SecondsSince(&t_stage);
+    }
 
     handler->RunKernel(inactive_side);
+    batch.kernel = SecondsSince(&t_stage);
+    if (balancer)
+      balancer->ReportBatch(device, batch.kernel);
+    if (reserve)
+      batch.finished += reserve->Collect();
 
     // Inactive side is now active
     inactive_side = (0 == inactive_side)? 1: 0;
@@ -105,6 +402,8 @@ void Worker(struct shared_data *sdata, OclPtxHandler *handler, int num_reducers)
         leftover_particles--;
       }
       handler->ReadStatus(offset, count, sdata[i].complete);
+      if (bricks)
+        bricks->Update(offset, count, sdata[i].complete);
 
       sdata[i].data_ready = true;
       sdata[i].count = count;
@@ -115,18 +414,23 @@ void Worker(struct shared_data *sdata, OclPtxHandler *handler, int num_reducers)
 
       delete lk[i];
     }
+    batch.read = SecondsSince(&t_stage);
 
     // Dump all paths
     handler->DumpPath(inactive_side * handler->particles_per_side(),
                       handler->particles_per_side());
+    batch.dump = SecondsSince(&t_stage);
+
+    if (stats)
+      stats->Add(batch);
   }
 }
 
 void Reducer(
     struct shared_data *sdata,
-    Fifo<OclPtxHandler::particle_data> *particles)
+    Fifo<PtxHandler::particle_data> *particles)
 {
-  struct OclPtxHandler::particle_data *particle;
+  struct PtxHandler::particle_data *particle;
   int reduced_count;
 
   while (1)
@@ -143,21 +447,37 @@ void Reducer(
 
     // Do the actual reduction
     reduced_count = 0;
+    sdata->finished = 0;
     sdata->has_data = false;
     for (int i = 0; i < sdata->count; i++)
     {
-      if (sdata->complete[i])
+      cl_ushort status = sdata->complete[i];
+      // Parked particles are still in flight, just waiting for their brick.
+      if (status && PtxHandler::kBreakBrick > status)
       {
         // Do something with the finished particle here, if we so desire.
-        // It's "chunk.v[i]".  Note: the first few particles will be
-        // unprocessed garbage.  I might need to add an extra state to the
-        // status buffer.
+        // It's "chunk.v[i]".  Slots that never held a particle read
+        // kBreakInit, slots left empty last time read kStillFinished.
+        if (PtxHandler::kBreakInit != status
+         && PtxHandler::kStillFinished != status)
+        {
+          sdata->finished++;
+          if (sdata->balancer)
+            sdata->balancer->Finished(sdata->device);
+        }
+
+        // Leave the slot empty for a faster device to take the particle.
+        if (sdata->balancer && !sdata->balancer->MayRefill(sdata->device))
+          continue;
 
         // New particle.
         particle = particles->Pop();
         if (!particle)
           continue;  // No particles left.
 
+        if (sdata->balancer)
+          sdata->balancer->Started(sdata->device);
+
         sdata->chunk[reduced_count] = *particle;
         sdata->particle_offset[reduced_count] = sdata->chunk_offset + i;
         ++reduced_count;
@@ -167,6 +487,9 @@ void Reducer(
 
       sdata->has_data = true;
     }
+    // Offsets ascend, so this puts particles near each other in the volume
+    // into neighbouring slots, and so into the same work-groups.
+    MortonSort(sdata->chunk, reduced_count);
     sdata->count = reduced_count;
 
     sdata->reduction_complete = true;
@@ -176,11 +499,14 @@ void Reducer(
 }
 
 void RunThreads(
-    OclPtxHandler *handler,
-    Fifo<OclPtxHandler::particle_data> *particles,
-    int num_reducers)
+    PtxHandler *handler,
+    Fifo<PtxHandler::particle_data> *particles,
+    int num_reducers,
+    LoadBalancer *balancer,
+    int device,
+    PipelineStats *stats)
 {
-  // Push blank data with complete=1 to reducer.  It will fill it in with
+  // Push blank data with complete=kBreakInit to reducer.  It will fill it in with
   // particles.
   int leftover_particles = handler->particles_per_side() % num_reducers;
   int chunk_size = handler->particles_per_side() / num_reducers + 1;
@@ -188,7 +514,7 @@ void RunThreads(
   int offset = 0;
   int count;
   struct shared_data sdata[num_reducers];
-  struct OclPtxHandler::particle_data *data;
+  struct PtxHandler::particle_data *data;
   cl_ushort *status;
   int *particle_offset;
 
@@ -201,12 +527,12 @@ void RunThreads(
       leftover_particles--;
     }
 
-    data = new OclPtxHandler::particle_data[chunk_size];
+    data = AllocParticles(chunk_size);
     status = new cl_ushort[chunk_size];
     particle_offset = new int[chunk_size];
 
     for (int j = 0; j < chunk_size; ++j)
-      status[j] = true;  // complete = 1
+      status[j] = PtxHandler::kBreakInit;
 
     sdata[i].chunk = data;
     sdata[i].chunk_offset = offset;
@@ -220,6 +546,10 @@ void RunThreads(
     sdata[i].reduction_complete = false;
     sdata[i].done = false;
     sdata[i].has_data = true;
+    sdata[i].finished = 0;
+
+    sdata[i].balancer = balancer;
+    sdata[i].device = device;
 
     offset += count;
   }
@@ -230,7 +560,7 @@ void RunThreads(
   {
     reducers[i] = new std::thread(Reducer, &sdata[i], particles);
   }
-  Worker(sdata, handler, num_reducers);
+  Worker(sdata, handler, particles, num_reducers, balancer, device, stats);
 
   // Clean everything up.
   for (int i = 0; i < num_reducers; ++i)
@@ -239,7 +569,7 @@ void RunThreads(
     delete reducers[i];
     delete[] sdata[i].particle_offset;
     delete[] sdata[i].complete;
-    delete[] sdata[i].chunk;
+    free(sdata[i].chunk);
   }
 
 }
@@ -5,15 +5,50 @@
 #ifndef THREADING_H_
 #define THREADING_H_
 
+#include <stdint.h>
+
+#include <mutex>
+
 #include "fifo.h"
+#include "loadbalancer.h"
+#include "ptxhandler.h"
 
 namespace threading
 {
 
+// Where a device's worker thread spends its time, summed over batches.
+struct StageTimes
+{
+  int64_t batches;
+  int64_t finished;  // Particles that finished tracking
+  double wait;  // Waiting on the reducers
+  double write;  // Refilling slots
+  double kernel;
+  double read;  // Reading completion codes back
+  double dump;  // Paths, with --savepaths
+};
+
+// Running StageTimes for one device, safe to read while it tracks.
+class PipelineStats{
+ public:
+  PipelineStats();
+  void Add(const StageTimes &batch);
+  StageTimes Get();
+
+ private:
+  StageTimes total_;
+  std::mutex lock_;
+};
+
+// balancer may be NULL, in which case every free slot is refilled.  stats
+// may be NULL.
 void RunThreads(
-    OclPtxHandler *handler,
-    Fifo<struct OclPtxHandler::particle_data> *particles,
-    int num_reducers);
+    PtxHandler *handler,
+    Fifo<struct PtxHandler::particle_data> *particles,
+    int num_reducers,
+    LoadBalancer *balancer,
+    int device,
+    PipelineStats *stats);
 
 }  // namespace threading
 